@@ -0,0 +1,318 @@
+#define _GNU_SOURCE
+#include "async_io.h"
+#include "file_manager.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#if defined(__linux__) && !defined(DBBPT_NO_IO_URING) && defined(__NR_io_uring_setup) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define HAVE_IO_URING 1
+#endif
+
+
+// GLOBALS.
+async_io aio = { .backend = ASYNC_IO_BACKEND_NONE, .ring_fd = -1 };
+
+
+void init_async_io(void) {
+	if (aio.backend != ASYNC_IO_BACKEND_NONE) return;
+
+	for (int i = 0; i < ASYNC_IO_QUEUE_DEPTH; i++) aio.requests[i].next_free = i + 1 < ASYNC_IO_QUEUE_DEPTH ? i + 1 : -1;
+	aio.free_request = 0;
+	aio.num_queued = 0;
+	aio.num_in_flight = 0;
+
+	if (setup_io_uring()) {
+		aio.backend = ASYNC_IO_BACKEND_URING;
+		return;
+	}
+	start_async_io_workers();
+	aio.backend = ASYNC_IO_BACKEND_THREADS;
+}
+
+const char *get_async_io_backend_name(void) {
+	if (aio.backend == ASYNC_IO_BACKEND_URING) return "io_uring";
+	if (aio.backend == ASYNC_IO_BACKEND_THREADS) return "threads";
+	return "none";
+}
+
+bool queue_page_read(int fd, int64_t pgn, char *dest, int64_t tag) {
+	async_io_request *request = take_async_io_request();
+	if (request == NULL) return false;
+
+	request->is_write = false;
+	request->fd = fd;
+	request->first_pgn = pgn;
+	request->num_pages = 1;
+	request->tag = tag;
+	request->inline_iov.iov_base = dest;
+	request->inline_iov.iov_len = PAGE_SIZE;
+	request->iov = &(request->inline_iov);
+
+	int request_index = (int)(request - aio.requests);
+	if (aio.backend == ASYNC_IO_BACKEND_URING) queue_io_uring_request(request_index);
+	else aio.queued[aio.num_queued] = request_index;
+	aio.num_queued += 1;
+	return true;
+}
+
+bool queue_page_writes(int fd, int64_t first_pgn, const char *const *srcs, int count, int64_t tag) {
+	async_io_request *request = take_async_io_request();
+	if (request == NULL) return false;
+
+	request->is_write = true;
+	request->fd = fd;
+	request->first_pgn = first_pgn;
+	request->num_pages = count;
+	request->tag = tag;
+	request->iov = (struct iovec *)malloc(count * sizeof(struct iovec));
+	if (request->iov == NULL) exit_with_err_msg("Error on allocating write request.");
+	for (int i = 0; i < count; i++) {
+		request->iov[i].iov_base = (void *)srcs[i];
+		request->iov[i].iov_len = PAGE_SIZE;
+	}
+
+	int request_index = (int)(request - aio.requests);
+	if (aio.backend == ASYNC_IO_BACKEND_URING) queue_io_uring_request(request_index);
+	else aio.queued[aio.num_queued] = request_index;
+	aio.num_queued += 1;
+	return true;
+}
+
+void submit_async_io(void) {
+	if (aio.num_queued == 0) return;
+	if (aio.backend == ASYNC_IO_BACKEND_URING) {
+		submit_io_uring();
+		return;
+	}
+
+	pthread_mutex_lock(&(aio.lock));
+	for (int i = 0; i < aio.num_queued; i++) {
+		aio.pending[(aio.pending_head + aio.pending_count) % ASYNC_IO_QUEUE_DEPTH] = aio.queued[i];
+		aio.pending_count += 1;
+	}
+	aio.num_in_flight += aio.num_queued;
+	aio.num_queued = 0;
+	pthread_cond_broadcast(&(aio.work_ready));
+	pthread_mutex_unlock(&(aio.lock));
+}
+
+int reap_async_io(async_io_completion *completions, int max, bool wait) {
+	if (aio.backend == ASYNC_IO_BACKEND_NONE) return 0;
+	// A waiting caller expects its queued requests to be running.
+	if (wait) submit_async_io();
+	if (aio.backend == ASYNC_IO_BACKEND_URING) return reap_io_uring(completions, max, wait);
+	return reap_async_io_workers(completions, max, wait);
+}
+
+int get_async_io_outstanding(void) {
+	return aio.num_queued + aio.num_in_flight;
+}
+
+// Helper functions
+async_io_request *take_async_io_request(void) {
+	init_async_io();
+	if (aio.free_request == -1) return NULL;
+
+	async_io_request *request = &(aio.requests[aio.free_request]);
+	aio.free_request = request->next_free;
+	request->next_free = -1;
+	return request;
+}
+
+void release_async_io_request(int request_index) {
+	async_io_request *request = &(aio.requests[request_index]);
+	if (request->iov != &(request->inline_iov)) free(request->iov);
+	request->iov = NULL;
+	request->next_free = aio.free_request;
+	aio.free_request = request_index;
+}
+
+void fill_async_io_completion(async_io_completion *completion, int request_index, int64_t result) {
+	async_io_request *request = &(aio.requests[request_index]);
+	completion->is_write = request->is_write;
+	completion->fd = request->fd;
+	completion->first_pgn = request->first_pgn;
+	completion->num_pages = request->num_pages;
+	completion->tag = request->tag;
+	completion->result = result;
+	release_async_io_request(request_index);
+}
+
+#ifdef HAVE_IO_URING
+bool setup_io_uring(void) {
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	int ring_fd = (int)syscall(__NR_io_uring_setup, ASYNC_IO_QUEUE_DEPTH, &params);
+	if (ring_fd < 0) return false;
+
+	aio.sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	aio.cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	// Newer kernels share one mapping between the submission and the completion rings.
+	bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+	if (single_mmap) {
+		if (aio.cq_ring_size > aio.sq_ring_size) aio.sq_ring_size = aio.cq_ring_size;
+		aio.cq_ring_size = aio.sq_ring_size;
+	}
+
+	aio.sq_ring = mmap(NULL, aio.sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+	if (aio.sq_ring == MAP_FAILED) {
+		close(ring_fd);
+		return false;
+	}
+	aio.cq_ring = single_mmap ? aio.sq_ring
+	                          : mmap(NULL, aio.cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+	aio.sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	aio.sqes = (struct io_uring_sqe *)mmap(NULL, aio.sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+	if (aio.cq_ring == MAP_FAILED || aio.sqes == MAP_FAILED) {
+		munmap(aio.sq_ring, aio.sq_ring_size);
+		if (!single_mmap && aio.cq_ring != MAP_FAILED) munmap(aio.cq_ring, aio.cq_ring_size);
+		close(ring_fd);
+		return false;
+	}
+
+	char *sq = (char *)aio.sq_ring;
+	char *cq = (char *)aio.cq_ring;
+	aio.sq_tail = (unsigned *)(sq + params.sq_off.tail);
+	aio.sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+	aio.sq_array = (unsigned *)(sq + params.sq_off.array);
+	aio.cq_head = (unsigned *)(cq + params.cq_off.head);
+	aio.cq_tail = (unsigned *)(cq + params.cq_off.tail);
+	aio.cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+	aio.cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+	aio.ring_fd = ring_fd;
+	return true;
+}
+
+void queue_io_uring_request(int request_index) {
+	// Only this process writes the submission tail, so a plain read is enough. The kernel reads it after the release store.
+	async_io_request *request = &(aio.requests[request_index]);
+	unsigned tail = *(aio.sq_tail);
+	unsigned slot = tail & *(aio.sq_mask);
+	struct io_uring_sqe *sqe = &(aio.sqes[slot]);
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	sqe->opcode = request->is_write ? IORING_OP_WRITEV : IORING_OP_READV;
+	sqe->fd = request->fd;
+	sqe->addr = (uint64_t)(uintptr_t)request->iov;
+	sqe->len = (uint32_t)request->num_pages;
+	sqe->off = (uint64_t)request->first_pgn * PAGE_SIZE;
+	sqe->user_data = (uint64_t)request_index;
+	aio.sq_array[slot] = slot;
+	__atomic_store_n(aio.sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+void submit_io_uring(void) {
+	while (aio.num_queued > 0) {
+		int submitted = (int)syscall(__NR_io_uring_enter, aio.ring_fd, aio.num_queued, 0, 0, NULL, 0);
+		if (submitted < 0) {
+			if (errno == EINTR) continue;
+			// The completion ring is full. Waiting on it frees room, and the completions stay in the ring for the next reap.
+			if ((errno == EAGAIN || errno == EBUSY) && aio.num_in_flight > 0) {
+				syscall(__NR_io_uring_enter, aio.ring_fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+				continue;
+			}
+			exit_with_err_msg("Error on submitting asynchronous I/O.");
+		}
+		aio.num_queued -= submitted;
+		aio.num_in_flight += submitted;
+	}
+}
+
+int reap_io_uring(async_io_completion *completions, int max, bool wait) {
+	int count = 0;
+	while (count == 0) {
+		unsigned head = *(aio.cq_head);
+		unsigned tail = __atomic_load_n(aio.cq_tail, __ATOMIC_ACQUIRE);
+		while (head != tail && count < max) {
+			struct io_uring_cqe *cqe = &(aio.cqes[head & *(aio.cq_mask)]);
+			fill_async_io_completion(&(completions[count++]), (int)cqe->user_data, cqe->res);
+			head += 1;
+		}
+		__atomic_store_n(aio.cq_head, head, __ATOMIC_RELEASE);
+		aio.num_in_flight -= count;
+
+		if (count > 0 || !wait || aio.num_in_flight == 0) break;
+		if (syscall(__NR_io_uring_enter, aio.ring_fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR) {
+			exit_with_err_msg("Error on waiting for asynchronous I/O.");
+		}
+	}
+	return count;
+}
+#else
+bool setup_io_uring(void) {
+	return false;
+}
+
+void queue_io_uring_request(int request_index) {}
+
+void submit_io_uring(void) {}
+
+int reap_io_uring(async_io_completion *completions, int max, bool wait) {
+	return 0;
+}
+#endif
+
+void start_async_io_workers(void) {
+	pthread_mutex_init(&(aio.lock), NULL);
+	pthread_cond_init(&(aio.work_ready), NULL);
+	pthread_cond_init(&(aio.work_done), NULL);
+	aio.pending_head = 0;
+	aio.pending_count = 0;
+	aio.done_head = 0;
+	aio.done_count = 0;
+
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, ASYNC_IO_WORKER_STACK_SIZE);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	for (int i = 0; i < ASYNC_IO_WORKERS; i++) {
+		if (pthread_create(&(aio.workers[i]), &attr, run_async_io_worker, NULL) != 0) {
+			exit_with_err_msg("Error on starting asynchronous I/O workers.");
+		}
+	}
+	pthread_attr_destroy(&attr);
+}
+
+void *run_async_io_worker(void *arg) {
+	pthread_mutex_lock(&(aio.lock));
+	while (true) {
+		while (aio.pending_count == 0) pthread_cond_wait(&(aio.work_ready), &(aio.lock));
+		int request_index = aio.pending[aio.pending_head];
+		aio.pending_head = (aio.pending_head + 1) % ASYNC_IO_QUEUE_DEPTH;
+		aio.pending_count -= 1;
+		pthread_mutex_unlock(&(aio.lock));
+
+		async_io_request *request = &(aio.requests[request_index]);
+		off_t offset = (off_t)request->first_pgn * PAGE_SIZE;
+		ssize_t transferred = request->is_write ? pwritev(request->fd, request->iov, request->num_pages, offset)
+		                                        : preadv(request->fd, request->iov, request->num_pages, offset);
+		int64_t result = transferred < 0 ? -errno : transferred;
+
+		pthread_mutex_lock(&(aio.lock));
+		request->result = result;
+		aio.done[(aio.done_head + aio.done_count) % ASYNC_IO_QUEUE_DEPTH] = request_index;
+		aio.done_count += 1;
+		pthread_cond_signal(&(aio.work_done));
+	}
+	return NULL;
+}
+
+int reap_async_io_workers(async_io_completion *completions, int max, bool wait) {
+	pthread_mutex_lock(&(aio.lock));
+	while (wait && aio.done_count == 0 && aio.num_in_flight > 0) pthread_cond_wait(&(aio.work_done), &(aio.lock));
+	int count = 0;
+	while (aio.done_count > 0 && count < max) {
+		int request_index = aio.done[aio.done_head];
+		aio.done_head = (aio.done_head + 1) % ASYNC_IO_QUEUE_DEPTH;
+		aio.done_count -= 1;
+		fill_async_io_completion(&(completions[count++]), request_index, aio.requests[request_index].result);
+	}
+	aio.num_in_flight -= count;
+	pthread_mutex_unlock(&(aio.lock));
+	return count;
+}
@@ -0,0 +1,160 @@
+#ifndef __ASYNC_IO_H__
+#define __ASYNC_IO_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#ifdef _WIN32
+#define bool char
+#define false 0
+#define true 1
+#endif
+
+
+// Constants
+#define ASYNC_IO_QUEUE_DEPTH 64 // Requests that can be in flight at once.
+#define ASYNC_IO_WORKERS 4 // Threads of the fallback backend.
+#define ASYNC_IO_WORKER_STACK_SIZE (64 * 1024) // Workers only issue system calls. Keeps four threads well inside the 64 MiB memory cap.
+
+
+// Structures
+typedef enum async_io_backend {
+	ASYNC_IO_BACKEND_NONE, // Not started yet.
+	ASYNC_IO_BACKEND_URING,
+	ASYNC_IO_BACKEND_THREADS,
+} async_io_backend;
+
+typedef struct async_io_request {
+	bool is_write;
+	int fd;
+	int64_t first_pgn;
+	int num_pages;
+	int64_t tag; // Chosen by the caller and handed back with the completion.
+	struct iovec *iov; // One entry per page. Stays valid until the request completes.
+	struct iovec inline_iov; // Storage for the single entry of a page read.
+	int64_t result; // Bytes transferred, or a negative errno. Filled in by the workers of the fallback backend.
+	int next_free;
+} async_io_request;
+
+typedef struct async_io_completion {
+	bool is_write;
+	int fd;
+	int64_t first_pgn;
+	int num_pages;
+	int64_t tag;
+	int64_t result; // Bytes transferred, or a negative errno.
+} async_io_completion;
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+typedef struct async_io {
+	async_io_backend backend;
+	async_io_request requests[ASYNC_IO_QUEUE_DEPTH];
+	int free_request; // Head of the list of unused requests, or -1.
+	int num_queued; // Requests prepared but not handed to the kernel or the workers yet.
+	int num_in_flight; // Requests handed over whose completions were not reaped yet.
+
+	// io_uring backend. The rings are shared with the kernel through mmap.
+	int ring_fd;
+	void *sq_ring;
+	size_t sq_ring_size;
+	void *cq_ring;
+	size_t cq_ring_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	// Thread pool backend. The queues hold request indices in FIFO order.
+	int queued[ASYNC_IO_QUEUE_DEPTH];
+	pthread_t workers[ASYNC_IO_WORKERS];
+	pthread_mutex_t lock;
+	pthread_cond_t work_ready;
+	pthread_cond_t work_done;
+	int pending[ASYNC_IO_QUEUE_DEPTH];
+	int pending_head;
+	int pending_count;
+	int done[ASYNC_IO_QUEUE_DEPTH];
+	int done_head;
+	int done_count;
+} async_io;
+
+
+// APIs
+/**
+ * @brief Start the asynchronous I/O backend. Called on the first request if never called.
+ *
+ * io_uring is set up with raw system calls, so no library is needed. If the kernel or a sandbox
+ * refuses it, or the tree is built with DBBPT_NO_IO_URING, a small pool of threads issuing
+ * preadv/pwritev takes its place.
+ */
+void init_async_io(void);
+
+/**
+ * @brief Get the name of the backend in use, for statistics.
+ * @return "io_uring", "threads", or "none" if no request was made yet.
+ */
+const char *get_async_io_backend_name(void);
+
+/**
+ * @brief Queue a read of one page. It is not started before `submit_async_io()`.
+ * @param fd[in] The file descriptor of the database file.
+ * @param pgn[in] The page number to read.
+ * @param dest[out] The PAGE_SIZE bytes to read into. Must stay valid until the completion is reaped.
+ * @param tag[in] A value handed back with the completion.
+ * @return false if ASYNC_IO_QUEUE_DEPTH requests are already outstanding. Reap completions and retry.
+ */
+bool queue_page_read(int fd, int64_t pgn, char *dest, int64_t tag);
+
+/**
+ * @brief Queue a write of consecutive pages from scattered buffers. It is not started before `submit_async_io()`.
+ * @param fd[in] The file descriptor of the database file.
+ * @param first_pgn[in] The page number of the first page.
+ * @param srcs[in] The PAGE_SIZE images of the pages. They must stay valid until the completion is reaped.
+ * @param count[in] The number of pages.
+ * @param tag[in] A value handed back with the completion.
+ * @return false if ASYNC_IO_QUEUE_DEPTH requests are already outstanding. Reap completions and retry.
+ */
+bool queue_page_writes(int fd, int64_t first_pgn, const char *const *srcs, int count, int64_t tag);
+
+/**
+ * @brief Start every queued request in one batch.
+ */
+void submit_async_io(void);
+
+/**
+ * @brief Collect finished requests.
+ * @param completions[out] The destination for up to `max` completions.
+ * @param max[in] The capacity of `completions`.
+ * @param wait[in] Whether to block until at least one request finishes, if any is outstanding.
+ * @return The number of completions stored. A request that failed reports a negative errno as its result.
+ */
+int reap_async_io(async_io_completion *completions, int max, bool wait);
+
+/**
+ * @brief Get the number of requests whose completions were not reaped yet.
+ * @return The number of outstanding requests, including queued ones.
+ */
+int get_async_io_outstanding(void);
+
+
+// Helper functions
+async_io_request *take_async_io_request(void);
+void release_async_io_request(int request_index);
+bool setup_io_uring(void);
+void queue_io_uring_request(int request_index);
+void submit_io_uring(void);
+int reap_io_uring(async_io_completion *completions, int max, bool wait);
+void start_async_io_workers(void);
+void *run_async_io_worker(void *arg);
+int reap_async_io_workers(async_io_completion *completions, int max, bool wait);
+void fill_async_io_completion(async_io_completion *completion, int request_index, int64_t result);
+
+#endif /* __ASYNC_IO_H__ */
@@ -0,0 +1,266 @@
+#include "file_manager.h"
+#include "buffer_pool.h"
+#include "dbbpt.h"
+#include "key_search.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Benchmark defaults. The tree is built larger than the default pool so that misses reach the file.
+#define BENCH_DEFAULT_KEYS 200000
+#define BENCH_DEFAULT_FINDS 20000
+#define BENCH_SEARCH_PROBES 1000000 // Searches per kernel and key layout in the intra-page search benchmark.
+#define BENCH_DELTA_WIDTHS 3 // Delta widths in the intra-page search benchmark: 2, 4 and 8 bytes.
+
+
+// TYPES.
+typedef struct bench_result {
+	double scan_ms;
+	int64_t scanned;
+	double find_ms;
+	int64_t found;
+	int64_t misses; // Buffer pool misses over both phases, that is, pages read from the file.
+} bench_result;
+
+// FUNCTION PROTOTYPES.
+void build_bench_tree(const char *path, int64_t num_keys);
+void drop_page_cache(const char *path);
+void run_bench(const char *path, bool direct_io, int64_t num_keys, int num_finds, bench_result *result);
+void run_search_bench(const char *path, int64_t num_keys);
+double time_key_search(const char *keys, int stride, int num_keys, const int64_t *probes, int64_t *checksum);
+double time_delta_search(const char *deltas, int width, int num_deltas, const int64_t *probes, int64_t *checksum);
+double elapsed_ms(const struct timespec *start);
+
+
+// MAIN.
+int main(int argc, char **argv) {
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s <path> [num_keys] [num_finds] [pool_frames]\n", argv[0]);
+		return 1;
+	}
+	const char *path = argv[1];
+	int64_t num_keys = argc > 2 ? atoll(argv[2]) : BENCH_DEFAULT_KEYS;
+	int num_finds = argc > 3 ? atoi(argv[3]) : BENCH_DEFAULT_FINDS;
+	init_buffer_pool(argc > 4 ? atoi(argv[4]) : DEFAULT_BUFFER_POOL_FRAMES);
+	if (num_keys < 1) num_keys = 1;
+
+	build_bench_tree(path, num_keys);
+
+	buffer_pool_stats pool_stats;
+	get_buffer_pool_stats(&pool_stats);
+	printf("Tree: %ld keys, buffer pool: %d frames (%d KiB).\n", num_keys, pool_stats.num_frames, pool_stats.num_frames * (PAGE_SIZE / 1024));
+	printf("%-10s %12s %14s %12s %14s %12s\n", "mode", "scan (ms)", "keys/s", "finds (ms)", "finds/s", "page reads");
+
+	// Each mode starts from a cold page cache, so buffered I/O only gains what it caches during its own run.
+	const char *mode_names[2] = { "buffered", "direct" };
+	for (int mode = 0; mode < 2; mode++) {
+		bench_result result;
+		run_bench(path, mode == 1, num_keys, num_finds, &result);
+		printf("%-10s %12.1f %14.0f %12.1f %14.0f %12ld\n", mode_names[mode],
+		       result.scan_ms, result.scanned / (result.scan_ms / 1000.0),
+		       result.find_ms, result.found / (result.find_ms / 1000.0), result.misses);
+	}
+
+	run_search_bench(path, num_keys);
+	unlink(path);
+	return 0;
+}
+
+
+// FUNCTION DEFINITIONS.
+void build_bench_tree(const char *path, int64_t num_keys) {
+	unlink(path);
+	int fd = open_or_create_tree(path, DEFAULT_LEAF_ORDER, DEFAULT_INTERNAL_ORDER);
+	if (fd == -1) exit_with_err_msg("Error on creating benchmark tree.");
+
+	tree_builder *builder = (tree_builder *)malloc(sizeof(tree_builder));
+	if (builder == NULL) exit_with_err_msg("Error on allocating tree builder.");
+	start_tree_builder(builder, fd, DEFAULT_FILL_PERCENT);
+	char value[120];
+	for (int64_t key = 1; key <= num_keys; key++) {
+		snprintf(value, sizeof(value), "value%ld", key);
+		add_to_tree_builder(builder, key, value);
+	}
+	finish_tree_builder(builder);
+	free(builder);
+
+	sync_tree(fd);
+	close_tree(fd);
+}
+
+void drop_page_cache(const char *path) {
+	int fd = open(path, O_RDONLY);
+	if (fd == -1) exit_with_err_msg("Error on opening benchmark tree.");
+	posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	close(fd);
+}
+
+void run_bench(const char *path, bool direct_io, int64_t num_keys, int num_finds, bench_result *result) {
+	memset(result, 0, sizeof(bench_result));
+	drop_page_cache(path);
+
+	tree_options options;
+	memset(&options, 0, sizeof(tree_options));
+	options.use_direct_io = direct_io;
+	int fd = open_or_create_tree1(path, DEFAULT_LEAF_ORDER, DEFAULT_INTERNAL_ORDER, &options);
+	if (fd == -1) exit_with_err_msg("Error on opening benchmark tree.");
+	if (direct_io && !get_tree_handle(fd)->options.use_direct_io) printf("(direct I/O is not available, the direct run is buffered)\n");
+
+	buffer_pool_stats before, after;
+	get_buffer_pool_stats(&before);
+
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	join_cursor cursor;
+	open_tree_cursor(fd, &cursor);
+	while (cursor.valid) {
+		result->scanned += 1;
+		advance_join_cursor(&cursor);
+	}
+	close_join_cursor(&cursor);
+	result->scan_ms = elapsed_ms(&start);
+
+	// Every run probes the same keys, so the modes are compared on the same access pattern.
+	srand(1);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int i = 0; i < num_finds; i++) {
+		int64_t key = 1 + (((int64_t)rand() << 16) ^ rand()) % num_keys;
+		if (db_find(fd, key, false, NULL) != NULL) result->found += 1;
+	}
+	result->find_ms = elapsed_ms(&start);
+
+	get_buffer_pool_stats(&after);
+	result->misses = after.misses - before.misses;
+	close_tree(fd);
+}
+
+void run_search_bench(const char *path, int64_t num_keys) {
+	int fd = open_or_create_tree(path, DEFAULT_LEAF_ORDER, DEFAULT_INTERNAL_ORDER);
+	if (fd == -1) exit_with_err_msg("Error on opening benchmark tree.");
+
+	// The layouts searched on the way down: the first internal page above the leaves, as a pinned image with
+	// keys between child page numbers and as the keys of a page struct, and the first leaf.
+	header_page header;
+	load_header_page(fd, &header);
+	page *internal = alloc_page_struct(fd);
+	page *leaf = alloc_page_struct(fd);
+	char *image = (char *)malloc(PAGE_SIZE);
+	int64_t *probes = (int64_t *)malloc(BENCH_SEARCH_PROBES * sizeof(int64_t));
+	if (image == NULL || probes == NULL) exit_with_err_msg("Error on allocating search benchmark.");
+	load_page(fd, header.root_pgn, internal);
+	if (internal->is_leaf) {
+		printf("Intra-page search: the tree has no internal page.\n");
+		close_tree(fd);
+		free(internal);
+		free(leaf);
+		free(image);
+		free(probes);
+		return;
+	}
+	while (true) {
+		load_page(fd, internal->child_pgns[0], leaf);
+		if (leaf->is_leaf) break;
+		page *child = leaf;
+		leaf = internal;
+		internal = child;
+	}
+	memcpy(image, pin_page(fd, internal->pgn, true), PAGE_SIZE);
+	unpin_page(fd, internal->pgn, false);
+	close_tree(fd);
+
+	// Probes are spread over the key range of each page, so the search ends at a different index each time.
+	const char *layout_names[3] = { "internal image", "internal keys", "leaf keys" };
+	const char *layout_keys[3] = { image + PAGE_HEADER_SIZE, (const char *)internal->keys, (const char *)leaf->keys };
+	int layout_strides[3] = { INTERNAL_ENTRY_SIZE, 8, 8 };
+	int layout_num_keys[3] = { internal->num_keys, internal->num_keys, leaf->num_keys };
+	int64_t layout_spans[3] = { internal->keys[internal->num_keys - 1] + 1, internal->keys[internal->num_keys - 1] + 1, leaf->keys[leaf->num_keys - 1] + 1 };
+	key_search_kernel default_kernel = get_key_search_kernel();
+
+	printf("Intra-page search (ns per search, %d keys per internal page, %d per leaf, default kernel %s):\n",
+	       internal->num_keys, leaf->num_keys, get_key_search_kernel_name(default_kernel));
+	printf("%-12s %16s %16s %16s\n", "kernel", layout_names[0], layout_names[1], layout_names[2]);
+	int64_t expected[3] = { 0, 0, 0 };
+	for (int kernel = 0; kernel < KEY_SEARCH_KERNELS; kernel++) {
+		if (!select_key_search_kernel((key_search_kernel)kernel)) continue;
+		printf("%-12s", get_key_search_kernel_name((key_search_kernel)kernel));
+		for (int layout = 0; layout < 3; layout++) {
+			srand(2);
+			for (int i = 0; i < BENCH_SEARCH_PROBES; i++) probes[i] = (((int64_t)rand() << 16) ^ rand()) % layout_spans[layout];
+			int64_t checksum;
+			double ms = time_key_search(layout_keys[layout], layout_strides[layout], layout_num_keys[layout], probes, &checksum);
+			if (kernel == KEY_SEARCH_LINEAR) expected[layout] = checksum;
+			else if (checksum != expected[layout]) exit_with_err_msg("Error on searching keys: the kernels disagree.");
+			printf(" %16.2f", ms * 1000000.0 / BENCH_SEARCH_PROBES);
+		}
+		printf("\n");
+	}
+
+	// The keys of the same internal page as the deltas of a packed page, at each width, so that the SIMD
+	// kernels are measured on deltas too. The deltas are searched for the delta of each probe, as in a descent.
+	int delta_widths[BENCH_DELTA_WIDTHS] = { 2, 4, 8 };
+	char *deltas = (char *)malloc((int64_t)internal->num_keys * 8 * BENCH_DELTA_WIDTHS);
+	if (deltas == NULL) exit_with_err_msg("Error on allocating search benchmark.");
+	int64_t span = internal->keys[internal->num_keys - 1] - internal->keys[0] + 1;
+	srand(3);
+	for (int i = 0; i < BENCH_SEARCH_PROBES; i++) probes[i] = (((int64_t)rand() << 16) ^ rand()) % span;
+	for (int w = 0; w < BENCH_DELTA_WIDTHS; w++) {
+		for (int i = 0; i < internal->num_keys; i++) {
+			uint64_t delta = (uint64_t)(internal->keys[i] - internal->keys[0]);
+			memcpy(deltas + (int64_t)internal->num_keys * 8 * w + (int64_t)i * delta_widths[w], &delta, delta_widths[w]);
+		}
+	}
+
+	printf("Delta search (ns per search, %d deltas):\n", internal->num_keys);
+	printf("%-12s %16s %16s %16s\n", "kernel", "2-byte deltas", "4-byte deltas", "8-byte deltas");
+	int64_t expected_deltas[BENCH_DELTA_WIDTHS] = { 0, 0, 0 };
+	for (int kernel = 0; kernel < KEY_SEARCH_KERNELS; kernel++) {
+		if (!select_key_search_kernel((key_search_kernel)kernel)) continue;
+		printf("%-12s", get_key_search_kernel_name((key_search_kernel)kernel));
+		for (int w = 0; w < BENCH_DELTA_WIDTHS; w++) {
+			if (delta_widths[w] == 2 && span > UINT16_MAX + 1) {
+				printf(" %16s", "-");
+				continue;
+			}
+			int64_t checksum;
+			double ms = time_delta_search(deltas + (int64_t)internal->num_keys * 8 * w, delta_widths[w], internal->num_keys, probes, &checksum);
+			if (kernel == KEY_SEARCH_LINEAR) expected_deltas[w] = checksum;
+			else if (checksum != expected_deltas[w]) exit_with_err_msg("Error on searching deltas: the kernels disagree.");
+			printf(" %16.2f", ms * 1000000.0 / BENCH_SEARCH_PROBES);
+		}
+		printf("\n");
+	}
+	select_key_search_kernel(default_kernel);
+	free(deltas);
+	free(internal);
+	free(leaf);
+	free(image);
+	free(probes);
+}
+
+double time_key_search(const char *keys, int stride, int num_keys, const int64_t *probes, int64_t *checksum) {
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	int64_t sum = 0;
+	for (int i = 0; i < BENCH_SEARCH_PROBES; i++) sum += search_keys(keys, stride, num_keys, probes[i]);
+	*checksum = sum;
+	return elapsed_ms(&start);
+}
+
+double time_delta_search(const char *deltas, int width, int num_deltas, const int64_t *probes, int64_t *checksum) {
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	int64_t sum = 0;
+	for (int i = 0; i < BENCH_SEARCH_PROBES; i++) sum += search_deltas(deltas, width, num_deltas, (uint64_t)probes[i]);
+	*checksum = sum;
+	return elapsed_ms(&start);
+}
+
+double elapsed_ms(const struct timespec *start) {
+	struct timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (end.tv_sec - start->tv_sec) * 1000.0 + (end.tv_nsec - start->tv_nsec) / 1000000.0;
+}
@@ -0,0 +1,341 @@
+#include "buffer_pool.h"
+#include "file_manager.h"
+#include "async_io.h"
+#include "wal.h"
+#include "value_log.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+// GLOBALS.
+buffer_pool pool = { 0, NULL, NULL, 0, NULL, 0, NULL, 0, 0, { 0, 0, 0, 0, 0, 0, 0, 0, 0 } };
+
+
+void init_buffer_pool(int num_frames) {
+	if (pool.pages != NULL) return;
+	if (num_frames < MIN_BUFFER_POOL_FRAMES) num_frames = MIN_BUFFER_POOL_FRAMES;
+	if (num_frames > MAX_BUFFER_POOL_FRAMES) num_frames = MAX_BUFFER_POOL_FRAMES;
+
+	pool.num_frames = num_frames;
+	// Frames are page aligned so that O_DIRECT trees can read and write them in place.
+	void *pages;
+	if (posix_memalign(&pages, PAGE_SIZE, (size_t)num_frames * PAGE_SIZE) != 0) pages = NULL;
+	pool.pages = (char *)pages;
+	pool.frames = (buffer_frame *)malloc(num_frames * sizeof(buffer_frame));
+	pool.write_order = (int *)malloc(num_frames * sizeof(int));
+	if (pool.pages == NULL || pool.frames == NULL || pool.write_order == NULL) exit_with_err_msg("Error on allocating buffer pool.");
+
+	pool.num_buckets = 1;
+	while (pool.num_buckets < num_frames * 2) pool.num_buckets *= 2;
+	pool.buckets = (int *)malloc(pool.num_buckets * sizeof(int));
+	if (pool.buckets == NULL) exit_with_err_msg("Error on allocating buffer pool.");
+	for (int i = 0; i < pool.num_buckets; i++) pool.buckets[i] = -1;
+
+	for (int i = 0; i < num_frames; i++) {
+		pool.frames[i].fd = -1;
+		pool.frames[i].pgn = -1;
+		pool.frames[i].pin_count = 0;
+		pool.frames[i].dirty = false;
+		pool.frames[i].referenced = false;
+		pool.frames[i].loading = false;
+		pool.frames[i].read_ahead = false;
+		pool.frames[i].in_transaction = false;
+		pool.frames[i].lsn = 0;
+		pool.frames[i].hash_next = -1;
+	}
+	pool.clock_hand = 0;
+	pool.pending_reads = 0;
+	pool.pending_writes = 0;
+	memset(&(pool.stats), 0, sizeof(buffer_pool_stats));
+	pool.stats.num_frames = num_frames;
+}
+
+char *pin_page(int fd, int64_t pgn, bool need_load) {
+	// Trees opened with the mmap backend bypass the pool and leave caching to the kernel.
+	char *mapped_page = pin_mapped_page(fd, pgn);
+	if (mapped_page != NULL) return mapped_page;
+
+	if (pool.pages == NULL) init_buffer_pool(DEFAULT_BUFFER_POOL_FRAMES);
+
+	int frame_index = find_frame(fd, pgn);
+	if (frame_index != -1) {
+		pool.stats.hits += 1;
+		if (pool.frames[frame_index].read_ahead) pool.stats.read_ahead_hits += 1;
+		while (pool.frames[frame_index].loading) complete_page_io(true);
+	} else {
+		pool.stats.misses += 1;
+		frame_index = claim_frame(fd, pgn);
+		if (need_load) read_page_image(fd, pgn, pool.pages + (size_t)frame_index * PAGE_SIZE);
+	}
+
+	buffer_frame *frame = &(pool.frames[frame_index]);
+	frame->read_ahead = false;
+	frame->pin_count += 1;
+	frame->referenced = true;
+	return pool.pages + (size_t)frame_index * PAGE_SIZE;
+}
+
+void unpin_page(int fd, int64_t pgn, bool dirty) {
+	if (unpin_mapped_page(fd, pgn)) return;
+
+	int frame_index = find_frame(fd, pgn);
+	if (frame_index == -1 || pool.frames[frame_index].pin_count == 0) {
+		exit_with_err_msg("Error on unpinning a page that is not pinned.");
+	}
+	buffer_frame *frame = &(pool.frames[frame_index]);
+	frame->pin_count -= 1;
+	if (!dirty) return;
+	frame->dirty = true;
+	// The open mini-transaction of a logged tree logs the page on commit.
+	if (!frame->in_transaction && note_transaction_page(fd, pgn)) frame->in_transaction = true;
+}
+
+void flush_buffer_pool(int fd) {
+	int count = 0;
+	for (int i = 0; i < pool.num_frames; i++) {
+		if (pool.frames[i].fd == fd && pool.frames[i].dirty) pool.write_order[count++] = i;
+	}
+	write_back_frames(pool.write_order, count);
+}
+
+void drop_buffer_pool(int fd) {
+	while (pool.pending_reads > 0) complete_page_io(true);
+	flush_buffer_pool(fd);
+	for (int i = 0; i < pool.num_frames; i++) {
+		if (pool.frames[i].fd != fd) continue;
+		remove_frame_from_hash(i);
+		pool.frames[i].fd = -1;
+		pool.frames[i].pgn = -1;
+		pool.frames[i].pin_count = 0;
+		pool.frames[i].referenced = false;
+		pool.frames[i].read_ahead = false;
+		pool.frames[i].in_transaction = false;
+		pool.frames[i].lsn = 0;
+	}
+}
+
+void discard_buffer_pages(int fd, int64_t first_pgn) {
+	while (pool.pending_reads > 0) complete_page_io(true);
+	for (int i = 0; i < pool.num_frames; i++) {
+		if (pool.frames[i].fd != fd || pool.frames[i].pgn < first_pgn) continue;
+		if (pool.frames[i].pin_count > 0) exit_with_err_msg("Error on discarding a page that is pinned.");
+		remove_frame_from_hash(i);
+		pool.frames[i].fd = -1;
+		pool.frames[i].pgn = -1;
+		pool.frames[i].dirty = false;
+		pool.frames[i].referenced = false;
+		pool.frames[i].read_ahead = false;
+		pool.frames[i].in_transaction = false;
+		pool.frames[i].lsn = 0;
+	}
+}
+
+int read_ahead_pages(int fd, const int64_t *pgns, int count) {
+	if (pool.pages == NULL) init_buffer_pool(DEFAULT_BUFFER_POOL_FRAMES);
+	// Mapped pages are faulted in by the kernel, which does its own read-ahead.
+	tree_handle *handle = get_tree_handle(fd);
+	if (handle != NULL && handle->options.use_mmap) return count;
+
+	int max_pending_reads = pool.num_frames / READ_AHEAD_POOL_FRACTION;
+	bool queued = false;
+	int handled;
+	for (handled = 0; handled < count && pool.pending_reads < max_pending_reads; handled++) {
+		int64_t pgn = pgns[handled];
+		if (find_frame(fd, pgn) != -1) continue;
+
+		int frame_index = claim_frame(fd, pgn);
+		buffer_frame *frame = &(pool.frames[frame_index]);
+		frame->loading = true;
+		frame->read_ahead = true;
+		frame->referenced = true;
+		while (!queue_page_read(fd, pgn, pool.pages + (size_t)frame_index * PAGE_SIZE, frame_index)) complete_page_io(true);
+		pool.pending_reads += 1;
+		pool.stats.read_aheads += 1;
+		queued = true;
+	}
+	if (queued) submit_async_io();
+	return handled;
+}
+
+const char *get_cached_page(int fd, int64_t pgn) {
+	int frame_index = find_frame(fd, pgn);
+	if (frame_index == -1) return NULL;
+	while (pool.frames[frame_index].loading) complete_page_io(true);
+	return pool.pages + (size_t)frame_index * PAGE_SIZE;
+}
+
+void set_page_lsn(int fd, int64_t pgn, int64_t lsn) {
+	int frame_index = find_frame(fd, pgn);
+	if (frame_index == -1) return;
+	pool.frames[frame_index].lsn = lsn;
+	pool.frames[frame_index].in_transaction = false;
+}
+
+void get_buffer_pool_stats(buffer_pool_stats *stats) {
+	*stats = pool.stats;
+	stats->num_frames = pool.pages == NULL ? 0 : pool.num_frames;
+}
+
+// Helper functions
+int find_frame(int fd, int64_t pgn) {
+	if (pool.buckets == NULL) return -1;
+	for (int i = pool.buckets[hash_frame_key(fd, pgn)]; i != -1; i = pool.frames[i].hash_next) {
+		if (pool.frames[i].fd == fd && pool.frames[i].pgn == pgn) return i;
+	}
+	return -1;
+}
+
+int hash_frame_key(int fd, int64_t pgn) {
+	uint64_t h = (uint64_t)pgn * 0x9E3779B97F4A7C15ULL ^ (uint64_t)fd * 0xC2B2AE3D27D4EB4FULL;
+	return (int)((h >> 32) & (uint64_t)(pool.num_buckets - 1));
+}
+
+void remove_frame_from_hash(int frame_index) {
+	buffer_frame *frame = &(pool.frames[frame_index]);
+	int *link = &(pool.buckets[hash_frame_key(frame->fd, frame->pgn)]);
+	while (*link != -1 && *link != frame_index) link = &(pool.frames[*link].hash_next);
+	if (*link == frame_index) *link = frame->hash_next;
+	frame->hash_next = -1;
+}
+
+int pick_victim_frame(void) {
+	while (true) {
+		// Two full sweeps clear every reference bit, so a third one finds a victim unless all are pinned.
+		// A page of the open mini-transaction costs an UNDO record, so it is taken only if nothing else is left.
+		int transaction_victim = -1;
+		for (int step = 0; step < pool.num_frames * 3; step++) {
+			int frame_index = pool.clock_hand;
+			buffer_frame *frame = &(pool.frames[frame_index]);
+			pool.clock_hand = (pool.clock_hand + 1) % pool.num_frames;
+
+			if (frame->pin_count > 0 || frame->loading) continue;
+			if (frame->fd == -1) return frame_index;
+			if (frame->referenced) {
+				frame->referenced = false;
+			} else if (!frame->in_transaction) {
+				return frame_index;
+			} else if (transaction_victim == -1) {
+				transaction_victim = frame_index;
+			}
+		}
+		if (transaction_victim != -1) return transaction_victim;
+		// Frames waiting for read-ahead become evictable once their reads complete.
+		if (pool.pending_reads == 0) break;
+		complete_page_io(true);
+	}
+	exit_with_err_msg("Error on finding an unpinned buffer frame.");
+	return -1;
+}
+
+int claim_frame(int fd, int64_t pgn) {
+	int frame_index = pick_victim_frame();
+	buffer_frame *victim = &(pool.frames[frame_index]);
+	if (victim->fd != -1) {
+		pool.stats.evictions += 1;
+		if (victim->dirty) write_back_ahead_of(frame_index);
+		remove_frame_from_hash(frame_index);
+	}
+
+	victim->fd = fd;
+	victim->pgn = pgn;
+	victim->dirty = false;
+	victim->read_ahead = false;
+	victim->in_transaction = false;
+	victim->lsn = 0;
+	int bucket = hash_frame_key(fd, pgn);
+	victim->hash_next = pool.buckets[bucket];
+	pool.buckets[bucket] = frame_index;
+	return frame_index;
+}
+
+void complete_page_io(bool wait) {
+	async_io_completion completions[ASYNC_IO_QUEUE_DEPTH];
+	int count = reap_async_io(completions, ASYNC_IO_QUEUE_DEPTH, wait);
+	for (int i = 0; i < count; i++) {
+		async_io_completion *completion = &(completions[i]);
+		if (completion->is_write) {
+			pool.pending_writes -= 1;
+			if (completion->result == (int64_t)completion->num_pages * PAGE_SIZE) continue;
+			// Redo a failed or short write synchronously. That retries without O_DIRECT, or reports the error.
+			const char *images[WRITE_BACK_MAX_RUN_PAGES];
+			for (int j = 0; j < completion->num_pages; j++) {
+				images[j] = pool.pages + (size_t)find_frame(completion->fd, completion->first_pgn + j) * PAGE_SIZE;
+			}
+			write_page_images(completion->fd, completion->first_pgn, images, completion->num_pages);
+			continue;
+		}
+
+		// Short reads past the end of the file are fine, as with read_page_image().
+		int frame_index = (int)completion->tag;
+		if (completion->result < 0) read_page_image(completion->fd, completion->first_pgn, pool.pages + (size_t)frame_index * PAGE_SIZE);
+		pool.frames[frame_index].loading = false;
+		pool.pending_reads -= 1;
+	}
+}
+
+void write_back_frames(int *frame_indices, int count) {
+	if (count == 0) return;
+	qsort(frame_indices, count, sizeof(int), compare_frame_keys);
+	pool.stats.flushes += 1;
+
+	// Write-ahead rule: the log records of a page, and the old image of a page of the open
+	// mini-transaction, must be durable before the page overwrites its image in the file. Without a
+	// log, a leaf of a value log tree must still not reach the file before the values it refers to.
+	for (int i = 0; i < count; i++) {
+		buffer_frame *frame = &(pool.frames[frame_indices[i]]);
+		sync_value_log(frame->fd);
+		if (frame->in_transaction) {
+			int64_t lsn = log_undo_image(frame->fd, frame->pgn);
+			if (lsn > frame->lsn) frame->lsn = lsn;
+		}
+		if (frame->lsn > 0) force_tree_log(frame->fd, frame->lsn);
+		frame->lsn = 0;
+	}
+
+	const char *images[WRITE_BACK_MAX_RUN_PAGES];
+	int start = 0;
+	while (start < count) {
+		buffer_frame *first = &(pool.frames[frame_indices[start]]);
+		int end = start + 1;
+		while (end < count && end - start < WRITE_BACK_MAX_RUN_PAGES) {
+			buffer_frame *next = &(pool.frames[frame_indices[end]]);
+			if (next->fd != first->fd || next->pgn != first->pgn + (end - start)) break;
+			end += 1;
+		}
+
+		for (int i = start; i < end; i++) {
+			images[i - start] = pool.pages + (size_t)frame_indices[i] * PAGE_SIZE;
+			pool.frames[frame_indices[i]].dirty = false;
+		}
+		while (!queue_page_writes(first->fd, first->pgn, images, end - start, -1)) complete_page_io(true);
+		pool.pending_writes += 1;
+		pool.stats.write_calls += 1;
+		pool.stats.write_backs += end - start;
+		start = end;
+	}
+
+	// The runs are written concurrently. The frames stay untouched until every write is done.
+	submit_async_io();
+	while (pool.pending_writes > 0) complete_page_io(true);
+}
+
+void write_back_ahead_of(int victim_index) {
+	int count = 0;
+	for (int step = 0; step < WRITE_BACK_BATCH_FRAMES && step < pool.num_frames; step++) {
+		int frame_index = (victim_index + step) % pool.num_frames;
+		buffer_frame *frame = &(pool.frames[frame_index]);
+		if (!frame->dirty) continue;
+		if (frame_index == victim_index || (frame->pin_count == 0 && !frame->in_transaction)) pool.write_order[count++] = frame_index;
+	}
+	write_back_frames(pool.write_order, count);
+}
+
+int compare_frame_keys(const void *a, const void *b) {
+	const buffer_frame *frame_a = &(pool.frames[*(const int *)a]);
+	const buffer_frame *frame_b = &(pool.frames[*(const int *)b]);
+	if (frame_a->fd != frame_b->fd) return frame_a->fd < frame_b->fd ? -1 : 1;
+	if (frame_a->pgn != frame_b->pgn) return frame_a->pgn < frame_b->pgn ? -1 : 1;
+	return 0;
+}
@@ -0,0 +1,164 @@
+#ifndef __BUFFER_POOL_H__
+#define __BUFFER_POOL_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#ifdef _WIN32
+#define bool char
+#define false 0
+#define true 1
+#endif
+
+
+// Constants
+#define MIN_BUFFER_POOL_FRAMES 16
+#define MAX_BUFFER_POOL_FRAMES ((32 << 20) / PAGE_SIZE) // 32 MiB of frames, half of the 64 MiB memory cap.
+#define DEFAULT_BUFFER_POOL_FRAMES ((8 << 20) / PAGE_SIZE)
+#define WRITE_BACK_BATCH_FRAMES 64 // Frames ahead of the CLOCK hand written back along with a dirty victim.
+#define WRITE_BACK_MAX_RUN_PAGES 256 // Pages per vectored write. Below IOV_MAX.
+#define READ_AHEAD_POOL_FRACTION 8 // At most 1/8 of the frames wait for read-ahead I/O at once.
+
+
+// Structures
+typedef struct buffer_frame {
+	int fd; // -1 if the frame holds no page.
+	int64_t pgn;
+	int pin_count;
+	bool dirty;
+	bool referenced; // The CLOCK reference bit.
+	bool loading; // An asynchronous read of the page is in flight. The frame cannot be evicted.
+	bool read_ahead; // The page was read ahead and was not pinned since.
+	bool in_transaction; // Dirtied by the open mini-transaction of a logged tree. Evicted only if nothing else can be.
+	int64_t lsn; // The log must be durable up to here before the page is written back. 0 if the page was not logged.
+	int hash_next; // The next frame in the same hash bucket, or -1.
+} buffer_frame;
+
+typedef struct buffer_pool_stats {
+	int num_frames;
+	int64_t hits;
+	int64_t misses;
+	int64_t evictions;
+	int64_t write_backs; // Pages written back.
+	int64_t flushes; // Batches of dirty pages written back together.
+	int64_t write_calls; // Vectored writes issued by the batches.
+	int64_t read_aheads; // Pages read ahead asynchronously. Not counted as misses.
+	int64_t read_ahead_hits; // Pins served by a page that was read ahead.
+} buffer_pool_stats;
+
+typedef struct buffer_pool {
+	int num_frames;
+	char *pages; // num_frames * PAGE_SIZE bytes of raw on-disk page images.
+	buffer_frame *frames;
+	int num_buckets;
+	int *buckets;
+	int clock_hand;
+	int *write_order; // Scratch space for the frames of a write-back batch.
+	int pending_reads; // Read-ahead requests not completed yet.
+	int pending_writes; // Write-back requests not completed yet.
+	buffer_pool_stats stats;
+} buffer_pool;
+
+
+// APIs
+/**
+ * @brief Create the buffer pool shared by all open trees.
+ * @param num_frames[in] The number of PAGE_SIZE frames. Clamped to [MIN_BUFFER_POOL_FRAMES, MAX_BUFFER_POOL_FRAMES].
+ *
+ * Calling it again after pages were cached has no effect. If it is never called, the pool is
+ * created with DEFAULT_BUFFER_POOL_FRAMES on the first page access.
+ */
+void init_buffer_pool(int num_frames);
+
+/**
+ * @brief Pin a page in the buffer pool and return its frame.
+ * @param fd[in] The file descriptor of the database file.
+ * @param pgn[in] The page number of the page to pin.
+ * @param need_load[in] Whether the page has to be read on a miss. Pass false if the caller overwrites the whole page.
+ * @return The PAGE_SIZE bytes of the page image. Valid until the page is unpinned.
+ *
+ * Victims are chosen by CLOCK among unpinned frames. A dirty victim is written back in one batch with
+ * the dirty pages of the next WRITE_BACK_BATCH_FRAMES frames, which the hand would reach soon anyway.
+ * If the page is still being read ahead, wait for that read instead of issuing another one.
+ * Pages of an open mini-transaction are evicted last, after an UNDO record of their old image is logged.
+ * If every frame is pinned, kill the process using the `exit_with_err_msg()` function.
+ * For a tree opened with the mmap backend, the page is returned from its mapping instead.
+ */
+char *pin_page(int fd, int64_t pgn, bool need_load);
+
+/**
+ * @brief Unpin a page pinned with `pin_page()`.
+ * @param fd[in] The file descriptor of the database file.
+ * @param pgn[in] The page number of the page to unpin.
+ * @param dirty[in] Whether the caller modified the page image.
+ */
+void unpin_page(int fd, int64_t pgn, bool dirty);
+
+/**
+ * @brief Write back every dirty page of a database file.
+ * @param fd[in] The file descriptor of the database file.
+ *
+ * The pages are written in page number order, and runs of consecutive pages go out in one vectored write.
+ * All runs are submitted to the asynchronous I/O backend at once, and the call returns when they are done.
+ */
+void flush_buffer_pool(int fd);
+
+/**
+ * @brief Write back and forget every page of a database file, e.g. before its descriptor is closed.
+ * @param fd[in] The file descriptor of the database file.
+ */
+void drop_buffer_pool(int fd);
+
+/**
+ * @brief Forget the pages of a database file from `first_pgn` on without writing them back, e.g. before the file is truncated.
+ * @param fd[in] The file descriptor of the database file.
+ * @param first_pgn[in] The first page number to forget.
+ */
+void discard_buffer_pages(int fd, int64_t first_pgn);
+
+/**
+ * @brief Start asynchronous reads of pages that are about to be pinned.
+ * @param fd[in] The file descriptor of the database file.
+ * @param pgns[in] The page numbers, in the order they will be pinned.
+ * @param count[in] The number of page numbers.
+ * @return The number of leading page numbers handled. The rest can be passed again later.
+ *
+ * Cached pages are skipped. The reads stop once pool.num_frames / READ_AHEAD_POOL_FRACTION are in
+ * flight, so that read-ahead cannot take over the pool. Trees opened with the mmap backend are skipped.
+ */
+int read_ahead_pages(int fd, const int64_t *pgns, int count);
+
+/**
+ * @brief Get the cached image of a page without pinning it, e.g. to log it.
+ * @param fd[in] The file descriptor of the database file.
+ * @param pgn[in] The page number of the page.
+ * @return The PAGE_SIZE bytes of the page image, or NULL if the page is not cached.
+ */
+const char *get_cached_page(int fd, int64_t pgn);
+
+/**
+ * @brief Note that the current image of a cached page was logged.
+ * @param fd[in] The file descriptor of the database file.
+ * @param pgn[in] The page number of the page. Nothing happens if it is not cached.
+ * @param lsn[in] The end of the log record. The page is not written back before the log is durable up to it.
+ */
+void set_page_lsn(int fd, int64_t pgn, int64_t lsn);
+
+/**
+ * @brief Get the hit, miss and eviction counters of the buffer pool.
+ * @param stats[out] The destination to store the counters.
+ */
+void get_buffer_pool_stats(buffer_pool_stats *stats);
+
+
+// Helper functions
+int find_frame(int fd, int64_t pgn);
+int hash_frame_key(int fd, int64_t pgn);
+void remove_frame_from_hash(int frame_index);
+int pick_victim_frame(void);
+int claim_frame(int fd, int64_t pgn);
+void complete_page_io(bool wait);
+void write_back_frames(int *frame_indices, int count);
+void write_back_ahead_of(int victim_index);
+int compare_frame_keys(const void *a, const void *b);
+
+#endif /* __BUFFER_POOL_H__ */
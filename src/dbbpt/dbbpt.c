@@ -1,5 +1,9 @@
 #include "file_manager.h"
+#include "buffer_pool.h"
 #include "dbbpt.h"
+#include "wal.h"
+#include "value_log.h"
+#include "upper_index.h"
 
 #include <stdbool.h>
 #ifdef _WIN32
@@ -10,91 +14,159 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// GLOBALS.
+// The value returned by db_find when the caller does not ask for the leaf page.
+record found_record;
+
 
 // FUNCTION DEFINITIONS.
 // Find API
 record *db_find(int fd, int64_t key, bool verbose, page **leaf_out) {
 	header_page header;
 	load_header_page(fd, &header);
-	return find1(fd, header.root_pgn, key, verbose, NULL);
+	if (leaf_out != NULL) return find1(fd, header.root_pgn, key, verbose, leaf_out, NULL);
+
+	// Nobody needs the leaf page, so probe its pinned image and copy out only the value.
+	int64_t leaf_pgn = find_leaf_pgn(fd, header.root_pgn, key, verbose, NULL);
+	if (leaf_pgn < 0) return NULL;
+
+	record *found = NULL;
+	const char *leaf = pin_page(fd, leaf_pgn, true);
+	int index = leaf_image_find(leaf, key);
+	if (index >= 0) {
+		char value[VALUE_SIZE];
+		strcpy(found_record.value, read_leaf_value(fd, leaf, index, value));
+		found = &found_record;
+	}
+	unpin_page(fd, leaf_pgn, false);
+	return found;
 }
 
 // Helper functions for find API
-record *find1(int fd, int64_t root_pgn, int64_t key, bool verbose, page **leaf_out) {
-  page *leaf = find_leaf(fd, root_pgn, key, verbose);
+record *find1(int fd, int64_t root_pgn, int64_t key, bool verbose, page **leaf_out, descent_path *path) {
+  page *leaf = find_leaf(fd, root_pgn, key, verbose, path);
 	if (leaf == NULL) return NULL;
 
-	int i = 0;
-	for (i = 0; i < leaf->num_keys; i++) if (leaf->keys[i] == key) break;
+	int i = page_find_key(leaf, key);
 	if (leaf_out != NULL) *leaf_out = leaf;
 
-	if (i == leaf->num_keys) return NULL;
+	if (i == -1) return NULL;
 	else return &(leaf->records[i]);
 }
 
-page *find_leaf(int fd, int64_t root_pgn, int64_t key, bool verbose) {
+page *find_leaf(int fd, int64_t root_pgn, int64_t key, bool verbose, descent_path *path) {
+	int64_t leaf_pgn = find_leaf_pgn(fd, root_pgn, key, verbose, path);
+	if (leaf_pgn < 0) return NULL;
+
+	page *leaf = alloc_page_struct(fd);
+	load_page(fd, leaf_pgn, leaf);
+	return leaf;
+}
+
+int64_t find_leaf_pgn(int fd, int64_t root_pgn, int64_t key, bool verbose, descent_path *path) {
+	if (path != NULL) path->depth = 0;
 	if (root_pgn <= 0) {
 		if (verbose) printf("Empty tree.\n");
-		return NULL;
+		return -1;
 	}
 
-	page *cur_page = (page *)malloc(sizeof(page));
-	load_page(fd, root_pgn, cur_page);
-	while (!cur_page->is_leaf) {
+	// The upper index holds every internal page, so only the leaf is left to read.
+	if (!verbose) {
+		int64_t leaf_pgn = search_upper_index(fd, root_pgn, key, path);
+		if (leaf_pgn >= 0) return leaf_pgn;
+	}
+
+	// Internal pages are only read, so the descent works on pinned page images instead of decoded copies.
+	int64_t cur_pgn = root_pgn;
+	const char *cur_image = pin_page(fd, cur_pgn, true);
+	while (!page_image_is_leaf(cur_image)) {
+		int num_keys = page_image_num_keys(cur_image);
 		if (verbose) {
 			printf("[");
-			for (int i= 0; i < cur_page->num_keys - 1; i++) printf("%ld ", cur_page->keys[i]);
-			printf("%ld] ", cur_page->keys[cur_page->num_keys - 1]);
+			for (int i = 0; i < num_keys - 1; i++) printf("%ld ", internal_image_key(cur_image, i));
+			printf("%ld] ", internal_image_key(cur_image, num_keys - 1));
 		}
 
-		int target_index;
-		for (target_index = 0; target_index < cur_page->num_keys; target_index++) {
-			if (key < cur_page->keys[target_index]) break;
-		}
+		int target_index = internal_image_search(cur_image, key);
 		if (verbose) printf("%d ->\n", target_index);
 
-		load_page(fd, cur_page->child_pgns[target_index], cur_page);
+		int64_t child_pgn = internal_image_child(cur_image, target_index);
+		unpin_page(fd, cur_pgn, false);
+		if (path != NULL) {
+			if (path->depth == MAX_TREE_HEIGHT) exit_with_err_msg("Error on finding leaf: the tree is too deep.");
+			path->pgns[path->depth++] = cur_pgn;
+		}
+		cur_pgn = child_pgn;
+		cur_image = pin_page(fd, cur_pgn, true);
 	}
 
 	if (verbose) {
+		int num_keys = page_image_num_keys(cur_image);
 		printf("Leaf [");
-		for (int i = 0; i < cur_page->num_keys - 1; i++) printf("%ld ", cur_page->keys[i]);
-		printf("%ld] ", cur_page->keys[cur_page->num_keys - 1]);
+		for (int i = 0; i < num_keys - 1; i++) printf("%ld ", leaf_image_key(cur_image, i));
+		printf("%ld] ", leaf_image_key(cur_image, num_keys - 1));
 	}
-	return cur_page;
+	unpin_page(fd, cur_pgn, false);
+	return cur_pgn;
 }
 
 // Insertion API
 void db_insert(int fd, int64_t key, char *value) {
 	header_page header;
 	load_header_page(fd, &header);
+	begin_mini_transaction(fd);
+
+	// A value log tree appends the value first, and the leaf entry only refers to it.
+	record new_record;
+	store_leaf_value(fd, key, value, &new_record);
 
+	// A key after all others goes straight to the rightmost leaf the last insert remembered.
 	page *leaf = NULL;
-	record *record = find1(fd, header.root_pgn, key, false, &leaf);
+	descent_path path;
+	record *record = NULL;
+	int tail_inserts = 0;
+	if (!find_append_leaf(fd, &header, key, &leaf, &path, &tail_inserts)) record = find1(fd, header.root_pgn, key, false, &leaf, &path);
 	if (record != NULL) {
-		strcpy(record->value, value);
-		write_page(fd, leaf);
-		free(leaf);
-		return;
+		copy_record(record, &new_record);
+		if (!(header.flags & HEADER_FLAG_SLOTTED_LEAVES) || leaf_used_bytes(&header, leaf) <= SLOTTED_LEAF_SPACE) {
+			write_page(fd, leaf);
+		} else {
+			forget_append_leaf(fd);
+			// The longer value does not fit in the slotted leaf any more, so the entry is inserted again with a split.
+			for (int i = (int)(record - leaf->records); i < leaf->num_keys - 1; i++) {
+				leaf->keys[i] = leaf->keys[i + 1];
+				copy_record(&(leaf->records[i]), &(leaf->records[i + 1]));
+			}
+			leaf->num_keys -= 1;
+			insert_into_leaf_after_splitting(fd, &header, &path, leaf, key, &new_record, false);
+		}
+	} else if (header.root_pgn == -1) {
+		start_new_tree(fd, &header, key, &new_record);
+	} else if (leaf_has_room(&header, leaf, key, value)) {
+		insert_into_leaf(fd, leaf, key, &new_record);
+		remember_append_leaf(fd, leaf, &path, key);
+	} else {
+		// The split consumes the path and may move the pages on it, so the next insert descends again.
+		forget_append_leaf(fd);
+		insert_into_leaf_after_splitting(fd, &header, &path, leaf, key, &new_record, tail_inserts >= APPEND_SPLIT_MIN_RUN);
 	}
 
-	if (header.root_pgn == -1) start_new_tree(fd, &header, key, value);
-	else if (leaf->num_keys < header.leaf_order - 1) insert_into_leaf(fd, leaf, key, value);
-	else insert_into_leaf_after_splitting(fd, &header, leaf, key, value);
-
 	free(leaf);
+	commit_mini_transaction(fd);
 }
 
 // Helper functions for insertion API
-void start_new_tree(int fd, header_page *header, int64_t key, char *value) {
-	page *root = alloc_page1(fd, header);
+void start_new_tree(int fd, header_page *header, int64_t key, const record *rec) {
+	page *root = alloc_page_near(fd, header, true, -1);
 
 	root->is_leaf = true;
-	root->parent_pgn = -1;
 	root->right_sibling_pgn = -1;
 	root->num_keys = 1;
 	root->keys[0] = key;
-	strcpy(root->records[0].value, value);
+	copy_record(&(root->records[0]), rec);
 	write_page(fd, root);
 
 	header->root_pgn = root->pgn;
@@ -103,91 +175,85 @@ void start_new_tree(int fd, header_page *header, int64_t key, char *value) {
 	free(root);
 }
 
-void insert_into_leaf(int fd, page *leaf, int64_t key, char *value) {
-	int insertion_point = 0;
-	while (insertion_point < leaf->num_keys && leaf->keys[insertion_point] < key) {
-		insertion_point += 1;
-	}
-
+void insert_into_leaf(int fd, page *leaf, int64_t key, const record *rec) {
+	int insertion_point = count_keys_below((const char *)leaf->keys, 8, leaf->num_keys, key);
 	for (int i = leaf->num_keys; i > insertion_point; i--) {
 		leaf->keys[i] = leaf->keys[i - 1];
-		strcpy(leaf->records[i].value, leaf->records[i - 1].value);
+		copy_record(&(leaf->records[i]), &(leaf->records[i - 1]));
 	}
 	leaf->keys[insertion_point] = key;
-	strcpy(leaf->records[insertion_point].value, value);
+	copy_record(&(leaf->records[insertion_point]), rec);
 	leaf->num_keys += 1;
 	write_page(fd, leaf);
 }
 
-void insert_into_leaf_after_splitting(int fd, header_page *header, page *leaf, int64_t key, char *value) {
-	int64_t *temp_keys = (int64_t *)malloc((header->leaf_order) * sizeof(int64_t));
+void insert_into_leaf_after_splitting(
+		int fd, header_page *header, descent_path *path, page *leaf, int64_t key, const record *rec, bool sequential) {
+	// A full fixed leaf holds leaf_order - 1 entries, but a slotted leaf overflows by bytes at any count.
+	int total = leaf->num_keys + 1;
+	int64_t *temp_keys = (int64_t *)malloc(total * sizeof(int64_t));
 	if (temp_keys == NULL) exit_with_err_msg("Error on allocating temporary keys array.");
 
-	char **temp_values = (char **)malloc((header->leaf_order) * sizeof(char *));
-	for (int i = 0; i < header->leaf_order; i++) {
-		temp_values[i] = (char *)malloc(120 * sizeof(char));
-		if (temp_values[i] == NULL) exit_with_err_msg("Error on allocating temporary values array.");
-	}
-	if (temp_values == NULL) exit_with_err_msg("Error on allocating temporary values array.");
+	record *temp_records = (record *)malloc(total * sizeof(record));
+	if (temp_records == NULL) exit_with_err_msg("Error on allocating temporary values array.");
 
-	int insertion_index = 0;
-	while (insertion_index < header->leaf_order - 1 && leaf->keys[insertion_index] < key) {
-		insertion_index += 1;
-	}
+	int insertion_index = count_keys_below((const char *)leaf->keys, 8, leaf->num_keys, key);
 
 	for (int i = 0, j = 0; i < leaf->num_keys; i++, j++) {
 		if (j == insertion_index) j += 1;
 		temp_keys[j] = leaf->keys[i];
-		strcpy(temp_values[j], leaf->records[i].value);
+		copy_record(&(temp_records[j]), &(leaf->records[i]));
 	}
 	temp_keys[insertion_index] = key;
-	strcpy(temp_values[insertion_index], value);
+	copy_record(&(temp_records[insertion_index]), rec);
 
+	// Keys appended in a row after all others would leave every left half behind half empty, so the rightmost leaf
+	// keeps more. A single key that lands last, as in random inserts, splits in half.
 	leaf->num_keys = 0;
-	int split = cut(header->leaf_order - 1);
+	bool appended = sequential && leaf->right_sibling_pgn == -1 && insertion_index == total - 1;
+	int split = appended ? pick_append_split(header, temp_records, total) : pick_leaf_split(header, temp_records, total);
 	for (int i = 0; i < split; i++) {
 		leaf->keys[i] = temp_keys[i];
-		strcpy(leaf->records[i].value, temp_values[i]);
+		copy_record(&(leaf->records[i]), &(temp_records[i]));
 		leaf->num_keys += 1;
 	}
 
-	page *new_leaf = alloc_page1(fd, header);
+	page *new_leaf = alloc_page_near(fd, header, true, leaf->pgn);
 	new_leaf->is_leaf = true;
 	new_leaf->num_keys = 0;
-	for (int i = split, j = 0; i < header->leaf_order; i++, j++) {
+	for (int i = split, j = 0; i < total; i++, j++) {
 		new_leaf->keys[j] = temp_keys[i];
-		strcpy(new_leaf->records[j].value, temp_values[i]);
+		copy_record(&(new_leaf->records[j]), &(temp_records[i]));
 		new_leaf->num_keys += 1;
 	}
 
-	for (int i = 0; i < header->leaf_order; i++) free(temp_values[i]);
-	free(temp_values);
+	free(temp_records);
 	free(temp_keys);
 
-  new_leaf->parent_pgn = leaf->parent_pgn;
 	new_leaf->right_sibling_pgn = leaf->right_sibling_pgn;
 	leaf->right_sibling_pgn = new_leaf->pgn;
 	write_page(fd, new_leaf);
 	write_page(fd, leaf);
 
-	insert_into_parent(fd, header, leaf, new_leaf->keys[0], new_leaf);
+	insert_into_parent(fd, header, path, leaf, new_leaf->keys[0], new_leaf);
 	free(new_leaf);
 }
 
-void insert_into_parent(int fd, header_page *header, page *left, int64_t key, page *right) {
-	if (left->parent_pgn == -1) return insert_into_new_root(fd, header, left, key, right);
+void insert_into_parent(int fd, header_page *header, descent_path *path, page *left, int64_t key, page *right) {
+	if (path->depth == 0) return insert_into_new_root(fd, header, left, key, right);
 
-	page parent;
-	load_page(fd, left->parent_pgn, &parent);
+	page *parent = alloc_page_struct(fd);
+	path->depth -= 1;
+	load_page(fd, path->pgns[path->depth], parent);
 
-	int left_index = get_left_index(&parent, left);
-	if (parent.num_keys < header->internal_order - 1) insert_into_page(fd, &parent, left_index, key, right);
-	else insert_into_page_after_splitting(fd, header, &parent, left_index, key, right);
+	int left_index = get_left_index(parent, left);
+	if (internal_page_has_room(header, parent, key)) insert_into_page(fd, parent, left_index, key, right);
+	else insert_into_page_after_splitting(fd, header, path, parent, left_index, key, right);
+	free(parent);
 }
 
 void insert_into_new_root(int fd, header_page *header, page *left, int64_t key, page *right) {
-	page *new_root = alloc_page1(fd, header);
-	new_root->parent_pgn = -1;
+	page *new_root = alloc_page_near(fd, header, false, -1);
 	new_root->is_leaf = false;
 	new_root->keys[0] = key;
 	new_root->child_pgns[0] = left->pgn;
@@ -195,11 +261,6 @@ void insert_into_new_root(int fd, header_page *header, page *left, int64_t key,
 	new_root->num_keys = 1;
 	write_page(fd, new_root);
 
-	left->parent_pgn = new_root->pgn;
-	right->parent_pgn = new_root->pgn;
-	write_page(fd, left);
-	write_page(fd, right);
-
 	header->root_pgn = new_root->pgn;
 	write_header_page(fd, header);
 
@@ -215,16 +276,15 @@ void insert_into_page(int fd, page *p, int left_index, int64_t key, page *new_ch
 	p->keys[left_index] = key;
 	p->num_keys += 1;
 	write_page(fd, p);
-
-	new_child->parent_pgn = p->pgn;
-	write_page(fd, new_child);
 }
 
-void insert_into_page_after_splitting(int fd, header_page *header, page *old_page, int left_index, int64_t key, page *right) {
-	int64_t *temp_keys = (int64_t *)malloc(header->internal_order * sizeof(int64_t));
+void insert_into_page_after_splitting(int fd, header_page *header, descent_path *path, page *old_page, int left_index, int64_t key, page *right) {
+	// A full page holds internal_order - 1 keys, but a packed page overflows by bytes at fewer.
+	int total = old_page->num_keys + 1;
+	int64_t *temp_keys = (int64_t *)malloc(total * sizeof(int64_t));
 	if (temp_keys == NULL) exit_with_err_msg("Error on allocating temporary keys array.");
 
-	int64_t *temp_child_pgns = (int64_t *)malloc((header->internal_order + 1) * sizeof(int64_t));
+	int64_t *temp_child_pgns = (int64_t *)malloc((total + 1) * sizeof(int64_t));
 	if (temp_child_pgns == NULL) exit_with_err_msg("Error on allocating temporary child page numbers array.");
 
 	for (int i = 0, j = 0; i < old_page->num_keys; i++, j++) {
@@ -240,46 +300,93 @@ void insert_into_page_after_splitting(int fd, header_page *header, page *old_pag
 	temp_child_pgns[left_index + 1] = right->pgn;
 	temp_keys[left_index] = key;
 
-	page *new_page = alloc_page1(fd, header);
+	split_internal_page(fd, header, path, old_page, temp_keys, temp_child_pgns, total);
+	free(temp_child_pgns);
+	free(temp_keys);
+}
+
+void split_internal_page(
+		int fd, header_page *header, descent_path *path, page *old_page, const int64_t *keys, const int64_t *child_pgns, int num_keys) {
+	page *new_page = alloc_page_near(fd, header, false, old_page->pgn);
 	new_page->is_leaf = false;
-	new_page->parent_pgn = old_page->parent_pgn;
 	new_page->num_keys = 0;
 	old_page->num_keys = 0;
 
-	int split = cut(header->internal_order);
+	// Both halves of a packed page fit whatever their key range, since each holds at most MAX_WIDE_PACKED_KEYS keys.
+	int split = cut(num_keys);
 	int index;
 	for (index = 0; index < split - 1; index++) {
-		old_page->keys[index] = temp_keys[index];
-		old_page->child_pgns[index] = temp_child_pgns[index];
+		old_page->keys[index] = keys[index];
+		old_page->child_pgns[index] = child_pgns[index];
 		old_page->num_keys += 1;
 	}
-	old_page->child_pgns[index] = temp_child_pgns[index];
+	old_page->child_pgns[index] = child_pgns[index];
 	index += 1;
 
 	int new_page_index;
-	for (new_page_index = 0; index < header->internal_order; index++, new_page_index++) {
-		new_page->keys[new_page_index] = temp_keys[index];
-		new_page->child_pgns[new_page_index] = temp_child_pgns[index];
+	for (new_page_index = 0; index < num_keys; index++, new_page_index++) {
+		new_page->keys[new_page_index] = keys[index];
+		new_page->child_pgns[new_page_index] = child_pgns[index];
 		new_page->num_keys++;
 	}
-	new_page->child_pgns[new_page_index] = temp_child_pgns[index];
+	new_page->child_pgns[new_page_index] = child_pgns[index];
 	write_page(fd, old_page);
 	write_page(fd, new_page);
 
-	for (int i = 0; i < new_page->num_keys + 1; i++) {
-		page child;
-		load_page(fd, new_page->child_pgns[i], &child);
-		child.parent_pgn = new_page->pgn;
-		write_page(fd, &child);
+	// The children moved to the new page keep no pointer back to it, so none of them is rewritten.
+	insert_into_parent(fd, header, path, old_page, keys[split - 1], new_page);
+	free(new_page);
+}
+
+bool find_append_leaf(int fd, const header_page *header, int64_t key, page **leaf_out, descent_path *path, int *tail_inserts) {
+	tree_handle *handle = get_tree_handle(fd);
+	append_hint *hint = handle == NULL ? NULL : handle->append_hint;
+	if (hint == NULL || hint->leaf_pgn < 0) return false;
+	int64_t top_pgn = hint->path.depth > 0 ? hint->path.pgns[0] : hint->leaf_pgn;
+	if (top_pgn != header->root_pgn) return false;
+
+	const char *image = pin_page(fd, hint->leaf_pgn, true);
+	int num_keys = page_image_num_keys(image);
+	bool is_append = page_image_is_leaf(image) && page_image_last_pgn(image) == -1 && num_keys > 0 &&
+	                 key > leaf_image_key(image, num_keys - 1);
+	unpin_page(fd, hint->leaf_pgn, false);
+	if (!is_append) return false;
+
+	page *leaf = alloc_page_struct(fd);
+	load_page(fd, hint->leaf_pgn, leaf);
+	*path = hint->path;
+	*leaf_out = leaf;
+	*tail_inserts = hint->tail_inserts;
+	return true;
+}
+
+void remember_append_leaf(int fd, const page *leaf, const descent_path *path, int64_t key) {
+	tree_handle *handle = get_tree_handle(fd);
+	if (handle == NULL) return;
+	if (leaf->right_sibling_pgn != -1 || leaf->keys[leaf->num_keys - 1] != key) return forget_append_leaf(fd);
+	if (handle->append_hint == NULL) {
+		handle->append_hint = (append_hint *)malloc(sizeof(append_hint));
+		if (handle->append_hint == NULL) exit_with_err_msg("Error on allocating append hint.");
+		handle->append_hint->leaf_pgn = -1;
 	}
+	append_hint *hint = handle->append_hint;
+	hint->tail_inserts = hint->leaf_pgn == leaf->pgn ? hint->tail_inserts + 1 : 1;
+	hint->leaf_pgn = leaf->pgn;
+	hint->path = *path;
+}
 
-	insert_into_parent(fd, header, old_page, temp_keys[split - 1], new_page);
-	free(temp_child_pgns);
-	free(temp_keys);
-	free(new_page);
+void forget_append_leaf(int fd) {
+	tree_handle *handle = get_tree_handle(fd);
+	if (handle != NULL && handle->append_hint != NULL) handle->append_hint->leaf_pgn = -1;
 }
 
 int get_left_index(page *parent, page *left) {
+	// The child whose key range holds the first key of the left page is usually the left page itself.
+	if (left->num_keys > 0) {
+		int left_index = search_keys((const char *)parent->keys, 8, parent->num_keys, left->keys[0]);
+		if (parent->child_pgns[left_index] == left->pgn) return left_index;
+	}
+
 	int left_index = 0;
 	while(left_index <= parent->num_keys && parent->child_pgns[left_index] != left->pgn) {
 		left_index += 1;
@@ -291,50 +398,55 @@ int get_left_index(page *parent, page *left) {
 void db_delete(int fd, int64_t key) {
 	header_page header;
 	load_header_page(fd, &header);
+	forget_append_leaf(fd);
+
+	begin_mini_transaction(fd);
 
 	page *key_leaf = NULL;
-	record *key_record = find1(fd, header.root_pgn, key, false, &key_leaf);
+	descent_path path;
+	record *key_record = find1(fd, header.root_pgn, key, false, &key_leaf, &path);
 
-	if (key_record != NULL && key_leaf != NULL) delete_entry(fd, &header, key_leaf, key, -1);
+	if (key_record != NULL && key_leaf != NULL) delete_entry(fd, &header, &path, key_leaf, key, -1);
 	free(key_leaf);
+	commit_mini_transaction(fd);
 }
 
 // Helper functions for delete API
-void delete_entry(int fd, header_page *header, page *p, int64_t key, int64_t child_pgn) {
+void delete_entry(int fd, header_page *header, descent_path *path, page *p, int64_t key, int64_t child_pgn) {
 	// Remove key and value(child) from page.
 	if (p->is_leaf) remove_entry_from_leaf_page(fd, p, key);
 	else remove_entry_from_internal_page(fd, p, key, child_pgn);
 
 	if (p->pgn == header->root_pgn) return adjust_root(fd, header, p);
-	int min_keys = p->is_leaf ? cut(header->leaf_order - 1) : cut(header->internal_order) - 1;
-	if (p->num_keys >= min_keys) return;
+	if (p->is_leaf ? !leaf_is_underfull(header, p) : !internal_page_is_underfull(header, p)) return;
 
-	page parent;
-	load_page(fd, p->parent_pgn, &parent);
-	int neighbor_index = get_neighbor_index(fd, p, &parent);
+	page *parent = alloc_page_struct(fd);
+	page *neighbor = alloc_page_struct(fd);
+	path->depth -= 1;
+	load_page(fd, path->pgns[path->depth], parent);
+	int neighbor_index = get_neighbor_index(fd, p, parent);
 	int k_prime_index = (neighbor_index == -1 ? 0 : neighbor_index);
-	int64_t k_prime = parent.keys[k_prime_index];
-
-	int64_t neighbor_pgn = (neighbor_index == -1 ? parent.child_pgns[1] : parent.child_pgns[neighbor_index]);
-	page neighbor;
-	load_page(fd, neighbor_pgn, &neighbor);
-
-	int capacity = p->is_leaf ? header->leaf_order : header->internal_order - 1;
-	if (neighbor.num_keys + p->num_keys < capacity) return coalesce_pages(fd, header, p, &neighbor, neighbor_index, k_prime);
-	else return redistribute_pages(fd, header, p, &neighbor, neighbor_index, k_prime_index, k_prime);
+	int64_t k_prime = parent->keys[k_prime_index];
+
+	int64_t neighbor_pgn = (neighbor_index == -1 ? parent->child_pgns[1] : parent->child_pgns[neighbor_index]);
+	load_page(fd, neighbor_pgn, neighbor);
+
+	bool fits_in_one;
+	if (!p->is_leaf) fits_in_one = internal_pages_fit_in_one(header, p, neighbor, k_prime);
+	else if (neighbor_index == -1) fits_in_one = leaves_fit_in_one(header, p, neighbor);
+	else fits_in_one = leaves_fit_in_one(header, neighbor, p);
+	if (fits_in_one) coalesce_pages(fd, header, path, p, neighbor, parent, neighbor_index, k_prime);
+	else redistribute_pages(fd, header, path, p, neighbor, parent, neighbor_index, k_prime_index, k_prime);
+	free(neighbor);
+	free(parent);
 }
 
 void remove_entry_from_leaf_page(int fd, page *p, int64_t key) {
-	bool need_move = false;
-	for (int i = 0; i < p->num_keys; i++) {
-		if (p->keys[i] == key) {
-			i += 1;
-			need_move = true;
-		}
-		if (!need_move) continue;
-		if (i == p->num_keys) break;
+	int index = page_find_key(p, key);
+	if (index == -1) return;
+	for (int i = index + 1; i < p->num_keys; i++) {
 		p->keys[i - 1] = p->keys[i];
-		strcpy(p->records[i - 1].value, p->records[i].value);
+		copy_record(&(p->records[i - 1]), &(p->records[i]));
 	}
 	p->num_keys--;
 	write_page(fd, p);
@@ -378,22 +490,14 @@ int get_neighbor_index(int fd, page *p, page *parent) {
 void adjust_root(int fd, header_page *header,  page *root) {
 	if (root->num_keys > 0) return;
 
-	int64_t new_root_pgn = -1;
-	if (!root->is_leaf) {
-		new_root_pgn = root->child_pgns[0];
-
-		page new_root;
-		load_page(fd, new_root_pgn, &new_root);
-		new_root.parent_pgn = -1;
-		write_page(fd, &new_root);
-	}
+	int64_t new_root_pgn = root->is_leaf ? -1 : root->child_pgns[0];
 	header->root_pgn = new_root_pgn;
 	write_header_page(fd, header);
 
 	free_page(fd, root->pgn);
 }
 
-void coalesce_pages(int fd, header_page *header, page *p, page *neighbor, int neighbor_index, int64_t k_prime) {
+void coalesce_pages(int fd, header_page *header, descent_path *path, page *p, page *neighbor, page *parent, int neighbor_index, int64_t k_prime) {
 	page* survivor = neighbor;
 	page* deleted = p;
 	if (neighbor_index == -1) {
@@ -405,7 +509,7 @@ void coalesce_pages(int fd, header_page *header, page *p, page *neighbor, int ne
 	if (survivor->is_leaf) {
 		for (int i = appended_index, j = 0; j < deleted->num_keys; i++, j++) {
 			survivor->keys[i] = deleted->keys[j];
-			strcpy(survivor->records[i].value, deleted->records[j].value);
+			copy_record(&(survivor->records[i]), &(deleted->records[j]));
 			survivor->num_keys++;
 		}
 		survivor->right_sibling_pgn = deleted->right_sibling_pgn;
@@ -421,37 +525,31 @@ void coalesce_pages(int fd, header_page *header, page *p, page *neighbor, int ne
 			deleted->num_keys -= 1;
 		}
 		survivor->child_pgns[survivor->num_keys] = deleted->child_pgns[deleted_end];
-
-		for (int i = appended_index + 1; i < survivor->num_keys + 1; i++) {
-			page child;
-			load_page(fd, survivor->child_pgns[i], &child);
-			child.parent_pgn = survivor->pgn;
-			write_page(fd, &child);
-		}
 	}
 	write_page(fd, survivor);
 
-	page parent;
-	load_page(fd, survivor->parent_pgn, &parent);
-	delete_entry(fd, header, &parent, k_prime, deleted->pgn);
+	delete_entry(fd, header, path, parent, k_prime, deleted->pgn);
 
 	free_page(fd, deleted->pgn);
 }
 
-void redistribute_pages(int fd, header_page *header, page *p, page *neighbor, int neighbor_index,
+void redistribute_pages(int fd, header_page *header, descent_path *path, page *p, page *neighbor, page *parent, int neighbor_index,
 		int k_prime_index, int64_t k_prime) {
-	page parent;
-	load_page(fd, p->parent_pgn, &parent);
+	if (p->is_leaf && (header->flags & HEADER_FLAG_SLOTTED_LEAVES)) {
+		if (neighbor_index == -1) redistribute_slotted_leaves(fd, header, path, p, neighbor, parent, k_prime_index);
+		else redistribute_slotted_leaves(fd, header, path, neighbor, p, parent, k_prime_index);
+		return;
+	}
 	if (neighbor_index != -1) {
 		if (p->is_leaf) {
 			for (int i = p->num_keys; i > 0; i--) {
 				p->keys[i] = p->keys[i - 1];
-				strcpy(p->records[i].value, p->records[i - 1].value);
+				copy_record(&(p->records[i]), &(p->records[i - 1]));
 			}
 			p->keys[0] = neighbor->keys[neighbor->num_keys - 1];
-			strcpy(p->records[0].value, neighbor->records[neighbor->num_keys - 1].value);
+			copy_record(&(p->records[0]), &(neighbor->records[neighbor->num_keys - 1]));
 
-			parent.keys[k_prime_index] = p->keys[0];
+			parent->keys[k_prime_index] = p->keys[0];
 		} else {
 			p->child_pgns[p->num_keys + 1] = p->child_pgns[p->num_keys];
 			for (int i = p->num_keys; i > 0; i--) {
@@ -461,38 +559,28 @@ void redistribute_pages(int fd, header_page *header, page *p, page *neighbor, in
 			p->keys[0] = k_prime;
 			p->child_pgns[0] = neighbor->child_pgns[neighbor->num_keys];
 
-			parent.keys[k_prime_index] = neighbor->keys[neighbor->num_keys - 1];
-
-			page moved_child;
-			load_page(fd, p->child_pgns[0], &moved_child);
-			moved_child.parent_pgn = p->pgn;
-			write_page(fd, &moved_child);
+			parent->keys[k_prime_index] = neighbor->keys[neighbor->num_keys - 1];
 		}
 	}	else {
 		if (p->is_leaf) {
 			p->keys[p->num_keys] = neighbor->keys[0];
-			strcpy(p->records[p->num_keys].value, neighbor->records[0].value);
+			copy_record(&(p->records[p->num_keys]), &(neighbor->records[0]));
 
-			parent.keys[k_prime_index] = neighbor->keys[1];
+			parent->keys[k_prime_index] = neighbor->keys[1];
 			for (int i = 0; i < neighbor->num_keys - 1; i++) {
 				neighbor->keys[i] = neighbor->keys[i + 1];
-				strcpy(neighbor->records[i].value, neighbor->records[i + 1].value);
+				copy_record(&(neighbor->records[i]), &(neighbor->records[i + 1]));
 			}
 		} else {
 			p->keys[p->num_keys] = k_prime;
 			p->child_pgns[p->num_keys + 1] = neighbor->child_pgns[0];
 
-			parent.keys[k_prime_index] = neighbor->keys[0];
+			parent->keys[k_prime_index] = neighbor->keys[0];
 			for (int i = 0; i < neighbor->num_keys - 1; i++) {
 				neighbor->keys[i] = neighbor->keys[i + 1];
 				neighbor->child_pgns[i] = neighbor->child_pgns[i + 1];
 			}
 			neighbor->child_pgns[neighbor->num_keys - 1] = neighbor->child_pgns[neighbor->num_keys];
-
-			page moved_child;
-			load_page(fd, p->child_pgns[p->num_keys + 1], &moved_child);
-			moved_child.parent_pgn = p->pgn;
-			write_page(fd, &moved_child);
 		}
 	}
 	p->num_keys += 1;
@@ -500,32 +588,1330 @@ void redistribute_pages(int fd, header_page *header, page *p, page *neighbor, in
 
 	write_page(fd, p);
 	write_page(fd, neighbor);
-	write_page(fd, &parent);
+	write_separator_change(fd, header, path, parent);
 }
 
 // Destroy API
 void db_destroy(int fd) {
 	header_page header;
 	load_header_page(fd, &header);
+	forget_append_leaf(fd);
+	begin_mini_transaction(fd);
 	destroy_pages(fd, header.root_pgn);
 	header.root_pgn = -1;
 	write_header_page(fd, &header);
+	commit_mini_transaction(fd);
 }
 
 // Helper functions for destroy API
 void destroy_pages(int fd, int64_t pgn) {
 	if (pgn <= 0) return;
-	page cur_page;
-	load_page(fd, pgn, &cur_page);
-	if (!cur_page.is_leaf) {
-		for (int i = 0; i < cur_page.num_keys + 1; i++) destroy_pages(fd, cur_page.child_pgns[i]);
+	page *cur_page = alloc_page_struct(fd);
+	load_page(fd, pgn, cur_page);
+	if (!cur_page->is_leaf) {
+		for (int i = 0; i < cur_page->num_keys + 1; i++) destroy_pages(fd, cur_page->child_pgns[i]);
 	}
+	free(cur_page);
 	free_page(fd, pgn);
 }
 
 // Join API
 void db_join(int fd1, int fd2, const char *output_filepath) {
-	// TODO: Implement join function
+	FILE *out = fopen(output_filepath, "w");
+	if (out == NULL) exit_with_err_msg("Error on opening join output file.");
+
+	join_cursor left, right;
+	open_tree_cursor(fd1, &left);
+	open_tree_cursor(fd2, &right);
+	merge_join(&left, &right, out);
+	close_join_cursor(&left);
+	close_join_cursor(&right);
+	fclose(out);
+}
+
+void db_join_band(int fd1, int fd2, int64_t delta, const char *output_filepath, band_window_stats *stats) {
+	FILE *out = fopen(output_filepath, "w");
+	if (out == NULL) exit_with_err_msg("Error on opening join output file.");
+
+	// Keys are unique in a tree, so a band never holds more than 2 * delta + 1 right entries.
+	int capacity = BAND_WINDOW_ENTRIES;
+	if (delta < (BAND_WINDOW_ENTRIES - 1) / 2) capacity = (int)(2 * delta + 1);
+
+	int64_t *window_keys = (int64_t *)malloc(capacity * sizeof(int64_t));
+	record *window_records = (record *)malloc(capacity * sizeof(record));
+	if (window_keys == NULL || window_records == NULL) exit_with_err_msg("Error on allocating band join window.");
+	int head = 0;
+	int count = 0;
+
+	stats->capacity = capacity;
+	stats->peak_entries = 0;
+	stats->allocated_bytes = (int64_t)capacity * (sizeof(int64_t) + sizeof(record));
+	stats->peak_bytes = 0;
+	stats->overflow_scans = 0;
+
+	join_cursor left, right;
+	open_tree_cursor(fd1, &left);
+	open_tree_cursor(fd2, &right);
+	while (left.valid) {
+		int64_t key = join_cursor_key(&left);
+		int64_t lower = (key < INT64_MIN + delta) ? INT64_MIN : key - delta;
+		int64_t upper = (key > INT64_MAX - delta) ? INT64_MAX : key + delta;
+
+		// Slide the window: drop entries below the band, then pull right entries up to its upper end.
+		while (count > 0 && window_keys[head] < lower) {
+			head = (head + 1) % capacity;
+			count -= 1;
+		}
+		while (right.valid && count < capacity && join_cursor_key(&right) <= upper) {
+			if (join_cursor_key(&right) >= lower) {
+				int tail = (head + count) % capacity;
+				window_keys[tail] = join_cursor_key(&right);
+				strcpy(window_records[tail].value, join_cursor_value(&right));
+				count += 1;
+			}
+			advance_join_cursor(&right);
+		}
+		if (count > stats->peak_entries) stats->peak_entries = count;
+
+		const char *value = join_cursor_value(&left);
+		for (int i = 0, slot = head; i < count; i++, slot = (slot + 1) % capacity) {
+			fprintf(out, "(%ld, %s, %ld, %s)\n", key, value, window_keys[slot], window_records[slot].value);
+		}
+
+		// The window is full but the band goes on. Serve the rest from a copy of the right cursor,
+		// leaving the cursor itself where the window ends.
+		if (count == capacity && right.valid && join_cursor_key(&right) <= upper) {
+			join_cursor rescan;
+			clone_join_cursor(&rescan, &right);
+			while (rescan.valid && join_cursor_key(&rescan) <= upper) {
+				fprintf(out, "(%ld, %s, %ld, %s)\n", key, value, join_cursor_key(&rescan), join_cursor_value(&rescan));
+				advance_join_cursor(&rescan);
+			}
+			close_join_cursor(&rescan);
+			stats->overflow_scans += 1;
+		}
+		advance_join_cursor(&left);
+	}
+	close_join_cursor(&right);
+	stats->peak_bytes = (int64_t)stats->peak_entries * (sizeof(int64_t) + sizeof(record));
+
+	free(window_records);
+	free(window_keys);
+	fclose(out);
+}
+
+void db_join_many(const join_job *jobs, int num_jobs) {
+	bool *done = (bool *)calloc(num_jobs, sizeof(bool));
+	join_consumer *consumers = (join_consumer *)malloc(num_jobs * sizeof(join_consumer));
+	if (done == NULL || consumers == NULL) exit_with_err_msg("Error on allocating join scheduler.");
+
+	int remaining = num_jobs;
+	while (remaining > 0) {
+		const char *shared_path = pick_shared_input(jobs, num_jobs, done);
+
+		int num_consumers = 0;
+		for (int i = 0; i < num_jobs; i++) {
+			if (done[i]) continue;
+			bool shared_is_left = is_same_tree_file(jobs[i].tree_path1, shared_path);
+			if (!shared_is_left && !is_same_tree_file(jobs[i].tree_path2, shared_path)) continue;
+
+			consumers[num_consumers].job = &jobs[i];
+			consumers[num_consumers].shared_is_left = shared_is_left;
+			num_consumers += 1;
+			done[i] = true;
+		}
+		run_shared_join(shared_path, consumers, num_consumers);
+		remaining -= num_consumers;
+	}
+
+	free(consumers);
+	free(done);
+}
+
+bool db_join_stream(int fd, const char *stream_path, bool binary, const char *output_filepath) {
+	FILE *stream_fp = fopen(stream_path, binary ? "rb" : "r");
+	if (stream_fp == NULL) {
+		printf("Error: Could not open stream file '%s'.\n", stream_path);
+		return false;
+	}
+	FILE *out = fopen(output_filepath, "w");
+	if (out == NULL) exit_with_err_msg("Error on opening join output file.");
+
+	join_stream *stream = (join_stream *)malloc(sizeof(join_stream));
+	if (stream == NULL) exit_with_err_msg("Error on allocating join stream.");
+	start_join_stream(stream, stream_fp, binary);
+
+	join_cursor left, right;
+	open_tree_cursor(fd, &left);
+	open_stream_cursor(stream, &right);
+	merge_join(&left, &right, out);
+	close_join_cursor(&left);
+
+	stop_join_stream(stream);
+	bool unsorted = stream->unsorted;
+	if (unsorted) {
+		printf("Error: Stream '%s' is malformed or not sorted at %s %ld.\n",
+				stream_path, binary ? "entry" : "line", stream->error_position);
+	}
+	free(stream);
+	fclose(stream_fp);
+	fclose(out);
+	return !unsorted;
+}
+
+void db_leaf_chain_stats(int fd, leaf_chain_stats *stats) {
+	memset(stats, 0, sizeof(leaf_chain_stats));
+
+	header_page header;
+	load_header_page(fd, &header);
+	int64_t cur_pgn = find_leaf_pgn(fd, header.root_pgn, INT64_MIN, false, NULL);
+	while (cur_pgn >= 0) {
+		const char *cur_image = pin_page(fd, cur_pgn, true);
+		int64_t right_sibling_pgn = page_image_last_pgn(cur_image);
+		int num_keys = page_image_num_keys(cur_image);
+		stats->num_entries += num_keys;
+		for (int i = 0; i < num_keys && (leaf_image_is_slotted(cur_image) || leaf_image_is_prefixed(cur_image)); i++) {
+			const char *slot = cur_image + PAGE_HEADER_SIZE + i * SLOT_SIZE;
+			uint16_t value_length;
+			memcpy(&value_length, slot + 10, 2);
+			if (leaf_image_is_prefixed(cur_image)) {
+				// The two bytes hold the length of the suffix and of the prefix shared with the value before.
+				stats->value_bytes += (unsigned char)slot[10] + (unsigned char)slot[11] + 1;
+				stats->stored_value_bytes += (unsigned char)slot[10] + 1;
+			} else {
+				stats->value_bytes += value_length + 1;
+				stats->stored_value_bytes += value_length + 1;
+			}
+		}
+		unpin_page(fd, cur_pgn, false);
+
+		stats->num_leaves += 1;
+		if (right_sibling_pgn >= 0) {
+			stats->sibling_hops += 1;
+			if (right_sibling_pgn == cur_pgn + 1) stats->sequential_hops += 1;
+		}
+		cur_pgn = right_sibling_pgn;
+	}
+}
+
+void db_internal_page_stats(int fd, internal_page_stats *stats) {
+	memset(stats, 0, sizeof(internal_page_stats));
+
+	header_page header;
+	load_header_page(fd, &header);
+	if (header.root_pgn > 0) add_internal_page_stats(fd, header.root_pgn, 1, stats);
+}
+
+// Helper functions for statistics API
+void add_internal_page_stats(int fd, int64_t pgn, int depth, internal_page_stats *stats) {
+	const char *image = pin_page(fd, pgn, true);
+	if (page_image_is_leaf(image)) {
+		if (depth > stats->height) stats->height = depth;
+		unpin_page(fd, pgn, false);
+		return;
+	}
+	int num_keys = page_image_num_keys(image);
+	int width = internal_image_key_width(image);
+	stats->num_pages += 1;
+	stats->num_keys += num_keys;
+	stats->entry_bytes += (int64_t)num_keys * (width == 0 ? INTERNAL_ENTRY_SIZE : width + PACKED_CHILD_SIZE);
+
+	// Only the first child is visited on the level above the leaves, since the leaves are all as deep.
+	int64_t *child_pgns = (int64_t *)malloc((num_keys + 1) * sizeof(int64_t));
+	if (child_pgns == NULL) exit_with_err_msg("Error on allocating child page numbers array.");
+	for (int i = 0; i <= num_keys; i++) child_pgns[i] = internal_image_child(image, i);
+	unpin_page(fd, pgn, false);
+
+	for (int i = 0; i <= num_keys; i++) {
+		const char *child_image = pin_page(fd, child_pgns[i], true);
+		bool is_leaf = page_image_is_leaf(child_image);
+		unpin_page(fd, child_pgns[i], false);
+		if (is_leaf) {
+			if (depth + 1 > stats->height) stats->height = depth + 1;
+			break;
+		}
+		add_internal_page_stats(fd, child_pgns[i], depth + 1, stats);
+	}
+	free(child_pgns);
+}
+
+// Helper functions for join API
+void merge_join(join_cursor *left, join_cursor *right, FILE *out) {
+	// Both inputs are sorted by key. A tree never repeats a key, but a stream may, so on a match only
+	// the right side moves on and the left entry stays available for the next duplicate.
+	while (left->valid && right->valid) {
+		int64_t left_key = join_cursor_key(left);
+		int64_t right_key = join_cursor_key(right);
+		if (left_key < right_key) {
+			advance_join_cursor(left);
+		} else if (left_key > right_key) {
+			advance_join_cursor(right);
+		} else {
+			fprintf(out, "(%ld, %s, %s)\n", left_key, join_cursor_value(left), join_cursor_value(right));
+			advance_join_cursor(right);
+		}
+	}
+}
+
+void open_tree_cursor(int fd, join_cursor *cursor) {
+	header_page header;
+	load_header_page(fd, &header);
+
+	cursor->fd = fd;
+	cursor->stream = NULL;
+	cursor->index = 0;
+	cursor->valid = false;
+	cursor->scanning = false;
+	cursor->parent_pgn = -1;
+	cursor->value_pgn = -1;
+	if (header.root_pgn <= 0) return;
+
+	cursor->scanning = true;
+	advise_sequential_scan(fd, true);
+
+	// The cursor keeps its current leaf pinned and reads entries from the page image in place.
+	cursor->leaf_pgn = header.root_pgn;
+	cursor->leaf_image = pin_page(fd, cursor->leaf_pgn, true);
+	while (!page_image_is_leaf(cursor->leaf_image)) {
+		int64_t child_pgn = internal_image_child(cursor->leaf_image, 0);
+		unpin_page(fd, cursor->leaf_pgn, false);
+		cursor->parent_pgn = cursor->leaf_pgn;
+		cursor->leaf_pgn = child_pgn;
+		cursor->leaf_image = pin_page(fd, cursor->leaf_pgn, true);
+	}
+	cursor->parent_index = 0;
+	cursor->read_ahead_index = 1;
+	read_ahead_leaves(cursor);
+
+	cursor->valid = true;
+	cursor->index = -1;
+	advance_join_cursor(cursor);
+}
+
+void open_stream_cursor(join_stream *stream, join_cursor *cursor) {
+	cursor->fd = -1;
+	cursor->stream = stream;
+	cursor->index = 0;
+	cursor->scanning = false;
+	cursor->valid = next_stream_block(stream);
+}
+
+void clone_join_cursor(join_cursor *dest, const join_cursor *src) {
+	*dest = *src;
+	if (dest->valid && dest->stream == NULL) pin_page(dest->fd, dest->leaf_pgn, true);
+	if (dest->scanning) advise_sequential_scan(dest->fd, true);
+}
+
+void close_join_cursor(join_cursor *cursor) {
+	if (cursor->valid && cursor->stream == NULL) unpin_page(cursor->fd, cursor->leaf_pgn, false);
+	if (cursor->scanning) advise_sequential_scan(cursor->fd, false);
+	cursor->valid = false;
+	cursor->scanning = false;
+}
+
+void advance_join_cursor(join_cursor *cursor) {
+	if (!cursor->valid) return;
+
+	cursor->index += 1;
+	if (cursor->stream != NULL) {
+		if (cursor->index < cursor->stream->blocks[cursor->stream->head].num_entries) return;
+		cursor->index = 0;
+		cursor->valid = next_stream_block(cursor->stream);
+		return;
+	}
+
+	// Move along the sibling chain, skipping empty leaves, so that a valid cursor always points at an entry.
+	while (cursor->index >= page_image_num_keys(cursor->leaf_image)) {
+		int64_t right_sibling_pgn = page_image_last_pgn(cursor->leaf_image);
+		unpin_page(cursor->fd, cursor->leaf_pgn, false);
+		if (right_sibling_pgn < 0) {
+			cursor->valid = false;
+			return;
+		}
+		cursor->leaf_pgn = right_sibling_pgn;
+		cursor->leaf_image = pin_page(cursor->fd, cursor->leaf_pgn, true);
+		cursor->index = 0;
+		if (locate_leaf_parent(cursor)) read_ahead_leaves(cursor);
+	}
+}
+
+bool locate_leaf_parent(join_cursor *cursor) {
+	// Usually the new leaf is the next child of the parent page of the previous one.
+	if (cursor->parent_pgn != -1) {
+		const char *parent_image = pin_page(cursor->fd, cursor->parent_pgn, true);
+		int next_index = cursor->parent_index + 1;
+		bool is_next_child = !page_image_is_leaf(parent_image) && next_index <= page_image_num_keys(parent_image)
+		                     && internal_image_child(parent_image, next_index) == cursor->leaf_pgn;
+		unpin_page(cursor->fd, cursor->parent_pgn, false);
+		if (is_next_child) {
+			cursor->parent_index = next_index;
+			return true;
+		}
+	}
+
+	// Otherwise descend again by the first key of the leaf. An empty leaf waits for the next hop.
+	cursor->parent_pgn = -1;
+	if (page_image_num_keys(cursor->leaf_image) == 0) return false;
+	int64_t key = leaf_image_key(cursor->leaf_image, 0);
+	header_page header;
+	load_header_page(cursor->fd, &header);
+
+	int64_t cur_pgn = header.root_pgn;
+	const char *cur_image = pin_page(cursor->fd, cur_pgn, true);
+	while (!page_image_is_leaf(cur_image)) {
+		int target_index = internal_image_search(cur_image, key);
+		int64_t child_pgn = internal_image_child(cur_image, target_index);
+		if (child_pgn == cursor->leaf_pgn) {
+			cursor->parent_pgn = cur_pgn;
+			cursor->parent_index = target_index;
+			cursor->read_ahead_index = target_index + 1;
+			break;
+		}
+		unpin_page(cursor->fd, cur_pgn, false);
+		cur_pgn = child_pgn;
+		cur_image = pin_page(cursor->fd, cur_pgn, true);
+	}
+	unpin_page(cursor->fd, cur_pgn, false);
+	return cursor->parent_pgn != -1;
+}
+
+void read_ahead_leaves(join_cursor *cursor) {
+	// Top the window up in batches, so that each submission carries several reads.
+	if (cursor->parent_pgn == -1) return;
+	// Reads the pool turned down earlier may have been passed by the cursor.
+	if (cursor->read_ahead_index <= cursor->parent_index) cursor->read_ahead_index = cursor->parent_index + 1;
+	if (cursor->read_ahead_index - cursor->parent_index > SCAN_READ_AHEAD_PAGES / 2) return;
+
+	// The next leaves of the chain are the next children of the parent, so their page numbers are known in advance.
+	const char *parent_image = pin_page(cursor->fd, cursor->parent_pgn, true);
+	int end_index = cursor->parent_index + 1 + SCAN_READ_AHEAD_PAGES;
+	if (end_index > page_image_num_keys(parent_image) + 1) end_index = page_image_num_keys(parent_image) + 1;
+	int64_t pgns[SCAN_READ_AHEAD_PAGES];
+	int count = 0;
+	for (int i = cursor->read_ahead_index; i < end_index; i++) pgns[count++] = internal_image_child(parent_image, i);
+	unpin_page(cursor->fd, cursor->parent_pgn, false);
+
+	if (count > 0) cursor->read_ahead_index += read_ahead_pages(cursor->fd, pgns, count);
+}
+
+int64_t join_cursor_key(const join_cursor *cursor) {
+	if (cursor->stream != NULL) return cursor->stream->blocks[cursor->stream->head].keys[cursor->index];
+	return leaf_image_key(cursor->leaf_image, cursor->index);
+}
+
+const char *join_cursor_value(join_cursor *cursor) {
+	if (cursor->stream != NULL) return cursor->stream->blocks[cursor->stream->head].records[cursor->index].value;
+	if (!leaf_image_is_prefixed(cursor->leaf_image)) return read_leaf_value(cursor->fd, cursor->leaf_image, cursor->index, cursor->value_buffer);
+
+	// Each value is decoded from the one before it, so a scan carries the last one on and applies every suffix once.
+	bool is_ahead = cursor->value_pgn == cursor->leaf_pgn && cursor->value_index <= cursor->index;
+	for (int i = is_ahead ? cursor->value_index + 1 : 0; i <= cursor->index; i++) {
+		leaf_image_apply_suffix(cursor->leaf_image, i, cursor->value_buffer);
+	}
+	cursor->value_pgn = cursor->leaf_pgn;
+	cursor->value_index = cursor->index;
+	return cursor->value_buffer;
+}
+
+bool is_same_tree_file(const char *path1, const char *path2) {
+	struct stat stat1, stat2;
+	if (stat(path1, &stat1) == 0 && stat(path2, &stat2) == 0) {
+		return stat1.st_dev == stat2.st_dev && stat1.st_ino == stat2.st_ino;
+	}
+	return strcmp(path1, path2) == 0;
+}
+
+const char *pick_shared_input(const join_job *jobs, int num_jobs, const bool *done) {
+	const char *best_path = NULL;
+	int best_count = 0;
+
+	for (int i = 0; i < num_jobs; i++) {
+		if (done[i]) continue;
+		const char *candidates[2] = { jobs[i].tree_path1, jobs[i].tree_path2 };
+		for (int c = 0; c < 2; c++) {
+			int count = 0;
+			for (int j = 0; j < num_jobs; j++) {
+				if (done[j]) continue;
+				if (is_same_tree_file(jobs[j].tree_path1, candidates[c]) ||
+						is_same_tree_file(jobs[j].tree_path2, candidates[c])) count += 1;
+			}
+			if (count > best_count) {
+				best_count = count;
+				best_path = candidates[c];
+			}
+		}
+	}
+	return best_path;
+}
+
+void run_shared_join(const char *shared_path, join_consumer *consumers, int num_consumers) {
+	int shared_fd = open_or_create_tree(shared_path, DEFAULT_LEAF_ORDER, DEFAULT_INTERNAL_ORDER);
+	if (shared_fd == -1) {
+		printf("Error: Could not open file '%s'.\n", shared_path);
+		return;
+	}
+
+	int active = 0;
+	for (int i = 0; i < num_consumers; i++) {
+		join_consumer *consumer = &consumers[i];
+		const char *other_path = consumer->shared_is_left ? consumer->job->tree_path2 : consumer->job->tree_path1;
+
+		consumer->out = NULL;
+		consumer->cursor.valid = false;
+		consumer->cursor.scanning = false;
+		consumer->fd = open_or_create_tree(other_path, DEFAULT_LEAF_ORDER, DEFAULT_INTERNAL_ORDER);
+		if (consumer->fd == -1) {
+			printf("Error: Could not open file '%s'.\n", other_path);
+			continue;
+		}
+		consumer->out = fopen(consumer->job->output_path, "w");
+		if (consumer->out == NULL) exit_with_err_msg("Error on opening join output file.");
+
+		open_tree_cursor(consumer->fd, &(consumer->cursor));
+		if (consumer->cursor.valid) active += 1;
+	}
+
+	// One physical scan of the shared leaf chain drives the merge step of every consumer.
+	join_cursor shared;
+	open_tree_cursor(shared_fd, &shared);
+	while (shared.valid && active > 0) {
+		int64_t key = join_cursor_key(&shared);
+		for (int i = 0; i < num_consumers; i++) {
+			join_consumer *consumer = &consumers[i];
+			if (!consumer->cursor.valid) continue;
+
+			while (consumer->cursor.valid && join_cursor_key(&(consumer->cursor)) < key) {
+				advance_join_cursor(&(consumer->cursor));
+			}
+			if (!consumer->cursor.valid) {
+				active -= 1;
+				continue;
+			}
+			if (join_cursor_key(&(consumer->cursor)) != key) continue;
+
+			const char *shared_value = join_cursor_value(&shared);
+			const char *other_value = join_cursor_value(&(consumer->cursor));
+			if (consumer->shared_is_left) fprintf(consumer->out, "(%ld, %s, %s)\n", key, shared_value, other_value);
+			else fprintf(consumer->out, "(%ld, %s, %s)\n", key, other_value, shared_value);
+		}
+		advance_join_cursor(&shared);
+	}
+	close_join_cursor(&shared);
+
+	for (int i = 0; i < num_consumers; i++) {
+		close_join_cursor(&(consumers[i].cursor));
+		if (consumers[i].out != NULL) fclose(consumers[i].out);
+		if (consumers[i].fd != -1) close_tree(consumers[i].fd);
+	}
+	close_tree(shared_fd);
+}
+
+// Helper functions for stream join
+void start_join_stream(join_stream *stream, FILE *fp, bool binary) {
+	stream->fp = fp;
+	stream->binary = binary;
+	stream->head = 0;
+	stream->count = 0;
+	stream->consuming = false;
+	stream->eof = false;
+	stream->unsorted = false;
+	stream->error_position = 0;
+	pthread_mutex_init(&(stream->lock), NULL);
+	pthread_cond_init(&(stream->changed), NULL);
+
+	// The reader only parses lines, so a small stack keeps the thread within the memory cap.
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, STREAM_READER_STACK_SIZE);
+	if (pthread_create(&(stream->reader), &attr, read_join_stream, stream) != 0) {
+		exit_with_err_msg("Error on starting stream reader.");
+	}
+	pthread_attr_destroy(&attr);
+}
+
+void stop_join_stream(join_stream *stream) {
+	// The merge may stop before the stream ends. Tell the reader to quit and wait for it.
+	pthread_mutex_lock(&(stream->lock));
+	stream->eof = true;
+	pthread_cond_broadcast(&(stream->changed));
+	pthread_mutex_unlock(&(stream->lock));
+
+	pthread_join(stream->reader, NULL);
+	pthread_cond_destroy(&(stream->changed));
+	pthread_mutex_destroy(&(stream->lock));
+}
+
+void *read_join_stream(void *arg) {
+	join_stream *stream = (join_stream *)arg;
+	int64_t last_key = INT64_MIN;
+	int64_t position = 0;
+
+	while (true) {
+		pthread_mutex_lock(&(stream->lock));
+		while (!stream->eof && stream->count == STREAM_QUEUE_BLOCKS) pthread_cond_wait(&(stream->changed), &(stream->lock));
+		if (stream->eof) {
+			pthread_mutex_unlock(&(stream->lock));
+			return NULL;
+		}
+		// The slot after the filled ones belongs to the reader until it is published.
+		stream_block *block = &(stream->blocks[(stream->head + stream->count) % STREAM_QUEUE_BLOCKS]);
+		pthread_mutex_unlock(&(stream->lock));
+
+		int num_entries = fill_stream_block(stream, block, &last_key, &position);
+
+		pthread_mutex_lock(&(stream->lock));
+		if (num_entries > 0) stream->count += 1;
+		if (num_entries < STREAM_BLOCK_ENTRIES) stream->eof = true;
+		pthread_cond_broadcast(&(stream->changed));
+		pthread_mutex_unlock(&(stream->lock));
+	}
+}
+
+int fill_stream_block(join_stream *stream, stream_block *block, int64_t *last_key, int64_t *position) {
+	block->num_entries = 0;
+	while (block->num_entries < STREAM_BLOCK_ENTRIES) {
+		int64_t key;
+		record *rec = &(block->records[block->num_entries]);
+		*position += 1;
+
+		if (stream->binary) {
+			if (fread(&key, sizeof(int64_t), 1, stream->fp) < 1) break;
+			sprintf(rec->value, "%ld", key);
+		} else {
+			char line[256];
+			if (fgets(line, sizeof(line), stream->fp) == NULL) break;
+			char first;
+			if (sscanf(line, " %c", &first) < 1) continue;
+
+			int count = sscanf(line, "%ld %119s", &key, rec->value);
+			if (count < 1) {
+				stream->unsorted = true;
+				stream->error_position = *position;
+				break;
+			}
+			if (count == 1) sprintf(rec->value, "%ld", key);
+		}
+
+		if (key < *last_key) {
+			stream->unsorted = true;
+			stream->error_position = *position;
+			break;
+		}
+		*last_key = key;
+		block->keys[block->num_entries] = key;
+		block->num_entries += 1;
+	}
+	return block->num_entries;
+}
+
+bool next_stream_block(join_stream *stream) {
+	pthread_mutex_lock(&(stream->lock));
+	// Hand the consumed head block back to the reader.
+	if (stream->consuming) {
+		stream->head = (stream->head + 1) % STREAM_QUEUE_BLOCKS;
+		stream->count -= 1;
+		pthread_cond_broadcast(&(stream->changed));
+	}
+	while (stream->count == 0 && !stream->eof) pthread_cond_wait(&(stream->changed), &(stream->lock));
+	bool has_block = stream->count > 0;
+	stream->consuming = has_block;
+	pthread_mutex_unlock(&(stream->lock));
+	return has_block;
+}
+
+// Bulk load API
+bool db_bulk_load(int fd, const char *stream_path, bool binary, int fill_percent, int64_t *num_loaded) {
+	*num_loaded = 0;
+	header_page header;
+	load_header_page(fd, &header);
+	if (header.root_pgn != -1) {
+		printf("Error: Bulk loading needs an empty tree.\n");
+		return false;
+	}
+	forget_append_leaf(fd);
+	FILE *stream_fp = fopen(stream_path, binary ? "rb" : "r");
+	if (stream_fp == NULL) {
+		printf("Error: Could not open stream file '%s'.\n", stream_path);
+		return false;
+	}
+
+	join_stream *stream = (join_stream *)malloc(sizeof(join_stream));
+	tree_builder *builder = (tree_builder *)malloc(sizeof(tree_builder));
+	if (stream == NULL || builder == NULL) exit_with_err_msg("Error on allocating bulk loader.");
+	start_join_stream(stream, stream_fp, binary);
+	start_tree_builder(builder, fd, fill_percent);
+
+	// The reader thread parses the stream ahead while the builder writes the leaves left to right.
+	join_cursor cursor;
+	open_stream_cursor(stream, &cursor);
+	bool duplicate = false;
+	while (cursor.valid && !duplicate) {
+		duplicate = !add_to_tree_builder(builder, join_cursor_key(&cursor), join_cursor_value(&cursor));
+		if (duplicate) printf("Error: Stream '%s' repeats key %ld.\n", stream_path, join_cursor_key(&cursor));
+		advance_join_cursor(&cursor);
+	}
+	close_join_cursor(&cursor);
+	stop_join_stream(stream);
+	bool unsorted = stream->unsorted;
+	if (unsorted) {
+		printf("Error: Stream '%s' is malformed or not sorted at %s %ld.\n",
+				stream_path, binary ? "entry" : "line", stream->error_position);
+	}
+
+	// The entries before a bad one still make a valid tree.
+	finish_tree_builder(builder);
+	*num_loaded = builder->num_entries;
+	sync_tree(fd);
+	free(builder);
+	free(stream);
+	fclose(stream_fp);
+	return !duplicate && !unsorted;
+}
+
+// Compaction API
+int db_compact(int fd, int fill_percent) {
+	tree_handle *handle = get_tree_handle(fd);
+	if (handle == NULL) exit_with_err_msg("Error on compacting tree: the tree is not open.");
+	char *path = strdup(handle->path);
+	char *temp_path = (char *)malloc(strlen(path) + sizeof(COMPACT_FILE_SUFFIX));
+	if (path == NULL || temp_path == NULL) exit_with_err_msg("Error on allocating compaction file path.");
+	sprintf(temp_path, "%s%s", path, COMPACT_FILE_SUFFIX);
+	tree_options options = handle->options;
+
+	// A value log is not rewritten. The new leaves take the value offsets of the old ones, and the new
+	// file takes over the log, synced up to its end, when it replaces the old one.
+	checkpoint_value_log(fd);
+	header_page header;
+	load_header_page(fd, &header);
+	bool has_value_log = (header.flags & HEADER_FLAG_VALUE_LOG) != 0;
+	int64_t value_log_tail = header.value_log_tail;
+	int64_t value_log_head = header.value_log_head;
+
+	// Build the new file from a scan of the leaf chain, so that leaves come out in key order.
+	unlink(temp_path);
+	int new_fd = open_or_create_tree1(temp_path, header.leaf_order, header.internal_order, &options);
+	if (new_fd == -1) exit_with_err_msg("Error on creating compaction file.");
+	if (has_value_log) {
+		close_value_log(new_fd);
+		remove_value_log(temp_path);
+	}
+
+	tree_builder *builder = (tree_builder *)malloc(sizeof(tree_builder));
+	if (builder == NULL) exit_with_err_msg("Error on allocating tree builder.");
+	start_tree_builder(builder, new_fd, fill_percent);
+	join_cursor cursor;
+	open_tree_cursor(fd, &cursor);
+	while (cursor.valid) {
+		if (has_value_log) {
+			record rec;
+			rec.value[0] = '\0';
+			rec.value_offset = leaf_image_value_offset(cursor.leaf_image, cursor.index);
+			add_record_to_tree_builder(builder, join_cursor_key(&cursor), &rec);
+		} else {
+			add_to_tree_builder(builder, join_cursor_key(&cursor), join_cursor_value(&cursor));
+		}
+		advance_join_cursor(&cursor);
+	}
+	close_join_cursor(&cursor);
+	finish_tree_builder(builder);
+	free(builder);
+
+	load_header_page(new_fd, &header);
+	shrink_tree_file(new_fd, &header);
+	header.value_log_tail = value_log_tail;
+	header.value_log_head = value_log_head;
+	write_header_page(new_fd, &header);
+	sync_tree(new_fd);
+
+	// The rename replaces the old file atomically, so a crash leaves either the old or the new tree.
+	close_tree(fd);
+	if (rename(temp_path, path) == -1) exit_with_err_msg("Error on replacing the tree file.");
+	rename_tree_log(new_fd, path);
+	handle = get_tree_handle(new_fd);
+	free(handle->path);
+	handle->path = path;
+	open_value_log(new_fd);
+	free(temp_path);
+	return new_fd;
+}
+
+bool db_compact_step(int fd, int max_pages) {
+	header_page header;
+	load_header_page(fd, &header);
+	if (!(header.flags & HEADER_FLAG_BITMAP_SPACE)) return false;
+
+	// Move the last pages of the file into free pages nearer the front, then cut the freed tail.
+	forget_append_leaf(fd);
+	begin_mini_transaction(fd);
+	bool relocated = true;
+	for (int i = 0; i < max_pages && relocated; i++) {
+		int64_t src_pgn = find_last_used_page(fd, &header);
+		relocated = !is_space_metadata_page(&header, src_pgn) && relocate_page(fd, src_pgn);
+		load_header_page(fd, &header);
+	}
+	shrink_tree_file(fd, &header);
+	commit_mini_transaction(fd);
+	return relocated;
+}
+
+// Helper functions for compaction API
+bool relocate_page(int fd, int64_t src_pgn) {
+	header_page header;
+	load_header_page(fd, &header);
+
+	// The page, its parent and its left sibling are loaded one after another into the same buffer.
+	page *p = alloc_page_struct(fd);
+	load_page(fd, src_pgn, p);
+	int64_t limit_pgn = src_pgn;
+	if (header.flags & HEADER_FLAG_LEAF_EXTENTS) limit_pgn -= src_pgn % EXTENT_PAGES;
+	int64_t dst_pgn = alloc_page_below(fd, &header, p->is_leaf, limit_pgn);
+	if (dst_pgn == -1) {
+		free(p);
+		return false;
+	}
+
+	// Find the parent and the left sibling while the tree still leads to the page at its old place.
+	descent_path path;
+	if (!find_page_path(fd, &header, p, &path)) exit_with_err_msg("Error on relocating page: it is not in the tree.");
+	int64_t left_sibling_pgn = p->is_leaf ? find_left_leaf_pgn(fd, &path, src_pgn) : -1;
+
+	p->pgn = dst_pgn;
+	write_page(fd, p);
+
+	if (path.depth == 0) {
+		header.root_pgn = dst_pgn;
+		write_header_page(fd, &header);
+	} else {
+		page *parent = p;
+		load_page(fd, path.pgns[path.depth - 1], parent);
+		for (int i = 0; i <= parent->num_keys; i++) {
+			if (parent->child_pgns[i] == src_pgn) parent->child_pgns[i] = dst_pgn;
+		}
+		write_page(fd, parent);
+	}
+
+	if (left_sibling_pgn != -1) {
+		page *left_sibling = p;
+		load_page(fd, left_sibling_pgn, left_sibling);
+		left_sibling->right_sibling_pgn = dst_pgn;
+		write_page(fd, left_sibling);
+	}
+
+	free(p);
+	free_page(fd, src_pgn);
+	return true;
+}
+
+bool find_page_path(int fd, const header_page *header, const page *p, descent_path *path) {
+	// Every page other than an empty root holds its first key in its range, so a descent by it passes the page.
+	path->depth = 0;
+	if (p->pgn == header->root_pgn) return true;
+	if (p->num_keys == 0) return false;
+
+	int64_t cur_pgn = header->root_pgn;
+	const char *cur_image = pin_page(fd, cur_pgn, true);
+	while (cur_pgn != p->pgn && !page_image_is_leaf(cur_image)) {
+		int64_t child_pgn = internal_image_child(cur_image, internal_image_search(cur_image, p->keys[0]));
+		unpin_page(fd, cur_pgn, false);
+		if (path->depth == MAX_TREE_HEIGHT) exit_with_err_msg("Error on finding page: the tree is too deep.");
+		path->pgns[path->depth++] = cur_pgn;
+		cur_pgn = child_pgn;
+		cur_image = pin_page(fd, cur_pgn, true);
+	}
+	unpin_page(fd, cur_pgn, false);
+	return cur_pgn == p->pgn;
+}
+
+int64_t find_left_leaf_pgn(int fd, const descent_path *path, int64_t leaf_pgn) {
+	// Climb to the first ancestor where the path does not take the leftmost child, then take the
+	// rightmost path down the subtree on the left.
+	int64_t child_pgn = leaf_pgn;
+	int64_t cur_pgn = -1;
+	for (int depth = path->depth - 1; depth >= 0 && cur_pgn == -1; depth--) {
+		int64_t parent_pgn = path->pgns[depth];
+		const char *parent_image = pin_page(fd, parent_pgn, true);
+		int num_keys = page_image_num_keys(parent_image);
+		for (int i = 1; i <= num_keys; i++) {
+			if (internal_image_child(parent_image, i) == child_pgn) cur_pgn = internal_image_child(parent_image, i - 1);
+		}
+		unpin_page(fd, parent_pgn, false);
+		child_pgn = parent_pgn;
+	}
+	if (cur_pgn == -1) return -1;
+
+	const char *cur_image = pin_page(fd, cur_pgn, true);
+	while (!page_image_is_leaf(cur_image)) {
+		int64_t next_pgn = internal_image_child(cur_image, page_image_num_keys(cur_image));
+		unpin_page(fd, cur_pgn, false);
+		cur_pgn = next_pgn;
+		cur_image = pin_page(fd, cur_pgn, true);
+	}
+	unpin_page(fd, cur_pgn, false);
+	return cur_pgn;
+}
+
+// Value log API
+bool db_collect_value_log(int fd, value_log_collection *result) {
+	memset(result, 0, sizeof(value_log_collection));
+	int64_t end_offset = get_value_log_end(fd);
+	if (end_offset < 0) return false;
+
+	header_page header;
+	load_header_page(fd, &header);
+	int64_t tail_offset = header.value_log_tail;
+
+	// Values moved during the scan are appended after end_offset, so they are not scanned again.
+	char value[VALUE_SIZE];
+	int64_t offset = tail_offset;
+	while (offset < end_offset) {
+		int64_t key;
+		int64_t next_offset = read_value_log_entry(fd, offset, &key, value);
+		if (next_offset < 0) exit_with_err_msg("Error on collecting value log: a torn entry before its end.");
+		result->scanned_values += 1;
+
+		int64_t leaf_pgn = find_live_value(fd, key, offset);
+		if (leaf_pgn >= 0) {
+			begin_mini_transaction(fd);
+			page *leaf = alloc_page_struct(fd);
+			load_page(fd, leaf_pgn, leaf);
+			int index = page_find_key(leaf, key);
+			if (index >= 0) store_leaf_value(fd, key, value, &(leaf->records[index]));
+			write_page(fd, leaf);
+			free(leaf);
+			commit_mini_transaction(fd);
+			result->moved_values += 1;
+		}
+		offset = next_offset;
+	}
+
+	// The leaves have to refer to the moved values on disk before the old copies go.
+	sync_tree(fd);
+	release_value_log_space(fd, end_offset);
+	result->released_bytes = end_offset - tail_offset;
+	return true;
+}
+
+// Helper functions for value log API
+int64_t find_live_value(int fd, int64_t key, int64_t value_offset) {
+	header_page header;
+	load_header_page(fd, &header);
+	int64_t leaf_pgn = find_leaf_pgn(fd, header.root_pgn, key, false, NULL);
+	if (leaf_pgn < 0) return -1;
+
+	// A value is live only if the entry of its key still refers to it. Updates and deletions leave it behind.
+	bool live = false;
+	const char *leaf = pin_page(fd, leaf_pgn, true);
+	int index = leaf_image_find(leaf, key);
+	if (index >= 0) live = leaf_image_value_offset(leaf, index) == value_offset;
+	unpin_page(fd, leaf_pgn, false);
+	return live ? leaf_pgn : -1;
+}
+
+// Helper functions for bulk building
+void start_tree_builder(tree_builder *builder, int fd, int fill_percent) {
+	memset(builder, 0, sizeof(tree_builder));
+	builder->fd = fd;
+	load_header_page(fd, &(builder->header));
+
+	if (fill_percent < 1) fill_percent = 1;
+	if (fill_percent > 100) fill_percent = 100;
+	int leaf_capacity = builder->header.leaf_order - 1;
+	builder->leaf_fill = leaf_capacity * fill_percent / 100;
+	if (builder->leaf_fill < cut(leaf_capacity)) builder->leaf_fill = cut(leaf_capacity);
+	builder->leaf_fill_bytes = SLOTTED_LEAF_SPACE * fill_percent / 100;
+	if (builder->leaf_fill_bytes < MIN_SLOTTED_LEAF_BYTES + MAX_SLOTTED_ENTRY_SIZE) builder->leaf_fill_bytes = MIN_SLOTTED_LEAF_BYTES + MAX_SLOTTED_ENTRY_SIZE;
+	builder->internal_fill = builder->header.internal_order * fill_percent / 100;
+	if (builder->internal_fill < cut(builder->header.internal_order)) builder->internal_fill = cut(builder->header.internal_order);
+	if (builder->internal_fill < 2) builder->internal_fill = 2;
+	// A page that is full by bytes then holds at least MIN_PACKED_INTERNAL_KEYS keys, whatever their range.
+	builder->internal_fill_bytes = PACKED_INTERNAL_SPACE * fill_percent / 100;
+	if (builder->internal_fill_bytes < MIN_PACKED_INTERNAL_KEYS * (8 + PACKED_CHILD_SIZE)) builder->internal_fill_bytes = MIN_PACKED_INTERNAL_KEYS * (8 + PACKED_CHILD_SIZE);
+}
+
+bool add_to_tree_builder(tree_builder *builder, int64_t key, const char *value) {
+	if (builder->num_entries > 0 && key <= builder->last_key) return false;
+	record rec;
+	store_leaf_value(builder->fd, key, value, &rec);
+	return add_record_to_tree_builder(builder, key, &rec);
+}
+
+bool add_record_to_tree_builder(tree_builder *builder, int64_t key, const record *rec) {
+	if (builder->num_entries > 0 && key <= builder->last_key) return false;
+	add_builder_entry(builder, 0, key, rec, -1);
+	builder->num_entries += 1;
+	builder->last_key = key;
+	return true;
+}
+
+void finish_tree_builder(tree_builder *builder) {
+	// Emitting the last pages of a level adds entries to the level above, so num_levels may grow here.
+	for (int level = 0; level < builder->num_levels; level++) {
+		tree_builder_level *cur = &(builder->levels[level]);
+		if (!cur->has_held && cur->written_pages == 0) {
+			if (level > 0 && cur->filling_count == 1) {
+				// A lone child is the root itself. This happens when the level below was merged into one page.
+				builder->header.root_pgn = cur->filling->child_pgns[0];
+				write_header_page(builder->fd, &(builder->header));
+				free_page(builder->fd, cur->filling->pgn);
+				load_header_page(builder->fd, &(builder->header));
+			} else {
+				write_page(builder->fd, cur->filling);
+				builder->header.root_pgn = cur->filling->pgn;
+				write_header_page(builder->fd, &(builder->header));
+			}
+			break;
+		}
+
+		if (cur->has_held) {
+			balance_builder_level(builder, level);
+			emit_builder_page(builder, level, cur->held, cur->held_min_key);
+		}
+		if (cur->filling_count > 0) emit_builder_page(builder, level, cur->filling, cur->filling_min_key);
+	}
+	for (int level = 0; level < builder->num_levels; level++) {
+		free(builder->levels[level].filling);
+		free(builder->levels[level].held);
+	}
+}
+
+void add_builder_entry(tree_builder *builder, int level, int64_t key, const record *rec, int64_t child_pgn) {
+	if (level == MAX_BUILDER_LEVELS) exit_with_err_msg("Error on building tree: too many levels.");
+	tree_builder_level *cur = &(builder->levels[level]);
+	if (level == builder->num_levels) {
+		// Pages are allocated only for the levels the tree reaches, since a page struct is large with big pages.
+		cur->filling = alloc_page_struct(builder->fd);
+		cur->held = alloc_page_struct(builder->fd);
+		builder->num_levels += 1;
+		start_builder_page(builder, level);
+	}
+
+	bool is_full;
+	if (level > 0) {
+		is_full = cur->filling_count == builder->internal_fill;
+		if ((builder->header.flags & HEADER_FLAG_PACKED_KEYS) && cur->filling_count > 0) {
+			// The key would become the last key of the page, so the deltas would run from its first key up to it.
+			const page *p = cur->filling;
+			int64_t first_key = p->num_keys > 0 ? p->keys[0] : key;
+			int bytes = (p->num_keys + 1) * (packed_key_width(first_key, key) + PACKED_CHILD_SIZE);
+			if (bytes > builder->internal_fill_bytes) is_full = true;
+		}
+	} else if (builder->header.flags & HEADER_FLAG_SLOTTED_LEAVES) {
+		const page *p = cur->filling;
+		const char *previous = p->num_keys > 0 ? p->records[p->num_keys - 1].value : NULL;
+		is_full = cur->filling_bytes + leaf_entry_bytes(&(builder->header), rec->value, previous) > builder->leaf_fill_bytes;
+	}
+	else is_full = cur->filling_count == builder->leaf_fill;
+	if (is_full) {
+		if (cur->has_held) emit_builder_page(builder, level, cur->held, cur->held_min_key);
+		page *full_page = cur->filling;
+		cur->filling = cur->held;
+		cur->held = full_page;
+		cur->held_min_key = cur->filling_min_key;
+		cur->held_count = cur->filling_count;
+		cur->has_held = true;
+		start_builder_page(builder, level);
+		if (level == 0) cur->held->right_sibling_pgn = cur->filling->pgn;
+	}
+
+	page *p = cur->filling;
+	if (cur->filling_count == 0) cur->filling_min_key = key;
+	if (level == 0) {
+		const char *previous = p->num_keys > 0 ? p->records[p->num_keys - 1].value : NULL;
+		cur->filling_bytes += leaf_entry_bytes(&(builder->header), rec->value, previous);
+		p->keys[p->num_keys] = key;
+		copy_record(&(p->records[p->num_keys]), rec);
+		p->num_keys += 1;
+	} else if (cur->filling_count == 0) {
+		p->child_pgns[0] = child_pgn;
+	} else {
+		p->keys[p->num_keys] = key;
+		p->child_pgns[p->num_keys + 1] = child_pgn;
+		p->num_keys += 1;
+	}
+	cur->filling_count += 1;
+}
+
+void start_builder_page(tree_builder *builder, int level) {
+	tree_builder_level *cur = &(builder->levels[level]);
+	bool is_leaf = (level == 0);
+	// Each leaf follows the previous one, so a fresh file gets its leaf chain in consecutive pages.
+	int64_t near_pgn = (is_leaf && builder->num_entries > 0) ? cur->held->pgn : -1;
+	page *new_page = alloc_page_near(builder->fd, &(builder->header), is_leaf, near_pgn);
+
+	// Only the header fields are reset. Entries are written before they are read, and clearing the whole struct costs as much as a page write.
+	cur->filling->pgn = new_page->pgn;
+	cur->filling->is_leaf = is_leaf;
+	cur->filling->right_sibling_pgn = -1;
+	cur->filling->num_keys = 0;
+	cur->filling_count = 0;
+	cur->filling_bytes = 0;
+	free(new_page);
+}
+
+void emit_builder_page(tree_builder *builder, int level, page *p, int64_t min_key) {
+	add_builder_entry(builder, level + 1, min_key, NULL, p->pgn);
+	write_page(builder->fd, p);
+	builder->levels[level].written_pages += 1;
+}
+
+void balance_builder_level(tree_builder *builder, int level) {
+	tree_builder_level *cur = &(builder->levels[level]);
+	bool is_leaf = (level == 0);
+	bool is_slotted = is_leaf && (builder->header.flags & HEADER_FLAG_SLOTTED_LEAVES);
+	bool is_packed = !is_leaf && (builder->header.flags & HEADER_FLAG_PACKED_KEYS);
+	if (is_slotted || is_packed) {
+		if (is_slotted ? !leaf_is_underfull(&(builder->header), cur->filling) : !internal_page_is_underfull(&(builder->header), cur->filling)) return;
+	} else if (cur->filling_count >= (is_leaf ? cut(builder->header.leaf_order - 1) : cut(builder->header.internal_order))) {
+		return;
+	}
+
+	// The last page is underfull. Merge it into the held page if both fit in one, or else split their
+	// entries evenly, so that every page but the root satisfies the occupancy the delete API expects.
+	int total = cur->held_count + cur->filling_count;
+	int capacity = is_leaf ? builder->header.leaf_order - 1 : builder->header.internal_order;
+	bool fits_in_one = is_slotted ? leaves_fit_in_one(&(builder->header), cur->held, cur->filling) : total <= capacity;
+	int held_count = fits_in_one ? total : total - total / 2;
+
+	int64_t *keys = (int64_t *)malloc(total * sizeof(int64_t));
+	int64_t *child_pgns = (int64_t *)malloc(total * sizeof(int64_t));
+	record *records = (record *)malloc(total * sizeof(record));
+	if (keys == NULL || child_pgns == NULL || records == NULL) exit_with_err_msg("Error on allocating temporary entries array.");
+
+	// For internal pages keys[i] is the smallest key under child_pgns[i].
+	page *pages[2] = { cur->held, cur->filling };
+	int64_t min_keys[2] = { cur->held_min_key, cur->filling_min_key };
+	int counts[2] = { cur->held_count, cur->filling_count };
+	for (int i = 0, n = 0; i < 2; i++) {
+		for (int j = 0; j < counts[i]; j++, n++) {
+			if (is_leaf) {
+				keys[n] = pages[i]->keys[j];
+				copy_record(&(records[n]), &(pages[i]->records[j]));
+			} else {
+				keys[n] = (j == 0) ? min_keys[i] : pages[i]->keys[j - 1];
+				child_pgns[n] = pages[i]->child_pgns[j];
+			}
+		}
+	}
+	if (is_slotted && !fits_in_one) held_count = pick_leaf_split(&(builder->header), records, total);
+	if (is_packed) {
+		// The keys of the merged page are the smallest keys under all its children but the first.
+		fits_in_one = packed_keys_fit(total - 1, keys[1], keys[total - 1]);
+		held_count = fits_in_one ? total : total - total / 2;
+		// Half of the keys may still span too wide a range. The last page then takes only as many as it needs,
+		// and the held page keeps a prefix of its own keys, which fit before.
+		if (!fits_in_one && (!packed_keys_fit(held_count - 1, keys[1], keys[held_count - 1]) ||
+				!packed_keys_fit(total - held_count - 1, keys[held_count + 1], keys[total - 1]))) {
+			held_count = total - (MIN_PACKED_INTERNAL_KEYS + 1);
+		}
+	}
+
+	for (int i = 0; i < 2; i++) {
+		int first = (i == 0) ? 0 : held_count;
+		int count = (i == 0) ? held_count : total - held_count;
+		page *p = pages[i];
+		p->num_keys = 0;
+		for (int j = 0; j < count; j++) {
+			if (is_leaf) {
+				p->keys[j] = keys[first + j];
+				copy_record(&(p->records[j]), &(records[first + j]));
+				p->num_keys += 1;
+				continue;
+			}
+			if (j > 0) {
+				p->keys[j - 1] = keys[first + j];
+				p->num_keys += 1;
+			}
+			p->child_pgns[j] = child_pgns[first + j];
+		}
+	}
+	cur->filling_min_key = keys[held_count < total ? held_count : 0];
+	cur->held_count = held_count;
+	cur->filling_count = total - held_count;
+
+	if (cur->filling_count == 0) {
+		// Everything fits in the held page, so the last page is given back.
+		if (is_leaf) cur->held->right_sibling_pgn = -1;
+		write_header_page(builder->fd, &(builder->header));
+		free_page(builder->fd, cur->filling->pgn);
+		load_header_page(builder->fd, &(builder->header));
+	}
+
+	free(records);
+	free(child_pgns);
+	free(keys);
+}
+
+// Helper functions for slotted leaves
+int leaf_entry_bytes(const header_page *header, const char *value, const char *previous) {
+	int shared = (previous != NULL && (header->flags & HEADER_FLAG_PREFIXED_VALUES)) ? shared_prefix_length(previous, value) : 0;
+	return SLOT_SIZE + (int)strlen(value) - shared + 1;
+}
+
+int leaf_used_bytes(const header_page *header, const page *leaf) {
+	int bytes = 0;
+	for (int i = 0; i < leaf->num_keys; i++) {
+		bytes += leaf_entry_bytes(header, leaf->records[i].value, i > 0 ? leaf->records[i - 1].value : NULL);
+	}
+	return bytes;
+}
+
+bool leaf_has_room(const header_page *header, const page *leaf, int64_t key, const char *value) {
+	if (!(header->flags & HEADER_FLAG_SLOTTED_LEAVES)) return leaf->num_keys < header->leaf_order - 1;
+
+	int insertion_point = count_keys_below((const char *)leaf->keys, 8, leaf->num_keys, key);
+	const char *previous = insertion_point > 0 ? leaf->records[insertion_point - 1].value : NULL;
+	int bytes = leaf_used_bytes(header, leaf) + leaf_entry_bytes(header, value, previous);
+	if (insertion_point < leaf->num_keys) {
+		// The entry after the new one is coded against the new value instead of the one before it.
+		const char *next = leaf->records[insertion_point].value;
+		bytes += leaf_entry_bytes(header, next, value) - leaf_entry_bytes(header, next, previous);
+	}
+	return bytes <= SLOTTED_LEAF_SPACE;
+}
+
+bool leaf_is_underfull(const header_page *header, const page *leaf) {
+	if (!(header->flags & HEADER_FLAG_SLOTTED_LEAVES)) return leaf->num_keys < cut(header->leaf_order - 1);
+	return leaf_used_bytes(header, leaf) < MIN_SLOTTED_LEAF_BYTES;
+}
+
+bool leaves_fit_in_one(const header_page *header, const page *left, const page *right) {
+	if (!(header->flags & HEADER_FLAG_SLOTTED_LEAVES)) return left->num_keys + right->num_keys < header->leaf_order;
+	int bytes = leaf_used_bytes(header, left) + leaf_used_bytes(header, right);
+	if (left->num_keys > 0 && right->num_keys > 0) {
+		// The first value of the right page is no longer kept whole once it follows the last value of the left.
+		const char *first = right->records[0].value;
+		bytes += leaf_entry_bytes(header, first, left->records[left->num_keys - 1].value) - leaf_entry_bytes(header, first, NULL);
+	}
+	return bytes <= SLOTTED_LEAF_SPACE;
+}
+
+int pick_leaf_split(const header_page *header, const record *records, int total) {
+	if (!(header->flags & HEADER_FLAG_SLOTTED_LEAVES)) return cut(header->leaf_order - 1);
+
+	// Split where the bytes on both sides differ the least. They then differ by at most one entry,
+	// so both sides of entries that overflow a page hold at least MIN_SLOTTED_LEAF_BYTES. With prefixed
+	// values the first value of the right side is kept whole, which adds the prefix it shared back to it.
+	if (total < 2) return 1;
+	int total_bytes = 0;
+	for (int i = 0; i < total; i++) total_bytes += leaf_entry_bytes(header, records[i].value, i > 0 ? records[i - 1].value : NULL);
+	int left_bytes = 0;
+	int split = 1;
+	int best_difference = -1;
+	for (int i = 1; i < total; i++) {
+		const char *previous = records[i - 1].value;
+		left_bytes += leaf_entry_bytes(header, previous, i > 1 ? records[i - 2].value : NULL);
+		int right_bytes = total_bytes - left_bytes + leaf_entry_bytes(header, records[i].value, NULL) -
+		                  leaf_entry_bytes(header, records[i].value, previous);
+		int difference = abs(left_bytes - right_bytes);
+		if (best_difference == -1 || difference < best_difference) {
+			best_difference = difference;
+			split = i;
+		}
+	}
+	return split;
+}
+
+int pick_append_split(const header_page *header, const record *records, int total) {
+	// The new entry is the last one, so any left side is part of the old leaf and fits. The right side takes the
+	// entries past APPEND_SPLIT_PERCENT, by count or by bytes, and gives some back to the left if it does not fit.
+	if (total < 2) return 1;
+	if (!(header->flags & HEADER_FLAG_SLOTTED_LEAVES)) {
+		int split = total * APPEND_SPLIT_PERCENT / 100;
+		return split < 1 ? 1 : (split > total - 1 ? total - 1 : split);
+	}
+
+	int total_bytes = 0;
+	for (int i = 0; i < total; i++) total_bytes += leaf_entry_bytes(header, records[i].value, i > 0 ? records[i - 1].value : NULL);
+	int split = 1;
+	int left_bytes = leaf_entry_bytes(header, records[0].value, NULL);
+	while (split < total - 1 && left_bytes < total_bytes / 100 * APPEND_SPLIT_PERCENT) {
+		left_bytes += leaf_entry_bytes(header, records[split].value, records[split - 1].value);
+		split += 1;
+	}
+	while (split < total - 1) {
+		int right_bytes = leaf_entry_bytes(header, records[split].value, NULL);
+		for (int i = split + 1; i < total; i++) right_bytes += leaf_entry_bytes(header, records[i].value, records[i - 1].value);
+		if (right_bytes <= SLOTTED_LEAF_SPACE) break;
+		split += 1;
+	}
+	return split;
+}
+
+void redistribute_slotted_leaves(int fd, header_page *header, descent_path *path, page *left, page *right, page *parent, int k_prime_index) {
+	// Entries may differ in size, so moving a single one may not be enough. Split the two evenly instead.
+	int total = left->num_keys + right->num_keys;
+	int64_t *keys = (int64_t *)malloc(total * sizeof(int64_t));
+	record *records = (record *)malloc(total * sizeof(record));
+	if (keys == NULL || records == NULL) exit_with_err_msg("Error on allocating temporary entries array.");
+	for (int i = 0; i < total; i++) {
+		const page *from = (i < left->num_keys) ? left : right;
+		int index = (i < left->num_keys) ? i : i - left->num_keys;
+		keys[i] = from->keys[index];
+		copy_record(&(records[i]), &(from->records[index]));
+	}
+
+	int split = pick_leaf_split(header, records, total);
+	left->num_keys = split;
+	right->num_keys = total - split;
+	for (int i = 0; i < total; i++) {
+		page *to = (i < split) ? left : right;
+		int index = (i < split) ? i : i - split;
+		to->keys[index] = keys[i];
+		copy_record(&(to->records[index]), &(records[i]));
+	}
+	parent->keys[k_prime_index] = right->keys[0];
+
+	write_page(fd, left);
+	write_page(fd, right);
+	write_separator_change(fd, header, path, parent);
+	free(records);
+	free(keys);
+}
+
+// Helper functions for packed internal pages
+bool internal_page_has_room(const header_page *header, const page *p, int64_t key) {
+	if (!(header->flags & HEADER_FLAG_PACKED_KEYS)) return p->num_keys < header->internal_order - 1;
+	int64_t min_key = p->keys[0] < key ? p->keys[0] : key;
+	int64_t max_key = p->keys[p->num_keys - 1] > key ? p->keys[p->num_keys - 1] : key;
+	return packed_keys_fit(p->num_keys + 1, min_key, max_key);
+}
+
+bool internal_page_is_underfull(const header_page *header, const page *p) {
+	if (!(header->flags & HEADER_FLAG_PACKED_KEYS)) return p->num_keys < cut(header->internal_order) - 1;
+	return p->num_keys < MIN_PACKED_INTERNAL_KEYS;
+}
+
+bool internal_pages_fit_in_one(const header_page *header, const page *left, const page *right, int64_t k_prime) {
+	int num_keys = left->num_keys + right->num_keys + 1;
+	if (!(header->flags & HEADER_FLAG_PACKED_KEYS)) return num_keys < header->internal_order;
+
+	// The page that lost a key may have none left, so the range is taken over k_prime and both pages.
+	int64_t min_key = k_prime;
+	int64_t max_key = k_prime;
+	const page *pages[2] = { left, right };
+	for (int i = 0; i < 2; i++) {
+		if (pages[i]->num_keys == 0) continue;
+		if (pages[i]->keys[0] < min_key) min_key = pages[i]->keys[0];
+		if (pages[i]->keys[pages[i]->num_keys - 1] > max_key) max_key = pages[i]->keys[pages[i]->num_keys - 1];
+	}
+	return packed_keys_fit(num_keys, min_key, max_key);
+}
+
+void write_separator_change(int fd, header_page *header, descent_path *path, page *parent) {
+	// A new first separator may widen the key range of a packed page past what its entries fit in. Such a
+	// page holds more than MAX_WIDE_PACKED_KEYS keys, so it is split like a page that overflows on insertion.
+	if (!(header->flags & HEADER_FLAG_PACKED_KEYS) || packed_keys_fit(parent->num_keys, parent->keys[0], parent->keys[parent->num_keys - 1])) {
+		write_page(fd, parent);
+		return;
+	}
+	int64_t *keys = (int64_t *)malloc(parent->num_keys * sizeof(int64_t));
+	int64_t *child_pgns = (int64_t *)malloc((parent->num_keys + 1) * sizeof(int64_t));
+	if (keys == NULL || child_pgns == NULL) exit_with_err_msg("Error on allocating temporary entries array.");
+	memcpy(keys, parent->keys, parent->num_keys * sizeof(int64_t));
+	memcpy(child_pgns, parent->child_pgns, (parent->num_keys + 1) * sizeof(int64_t));
+	split_internal_page(fd, header, path, parent, keys, child_pgns, parent->num_keys);
+	free(child_pgns);
+	free(keys);
 }
 
 // Common utility functions
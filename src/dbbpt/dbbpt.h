@@ -54,14 +54,179 @@
  */
 #include "file_manager.h"
 
+#include <pthread.h>
+#include <stdio.h>
+
+
+// Constants for the write path
+#define MAX_TREE_HEIGHT 64 // Internal pages a descent may pass through.
+#define APPEND_SPLIT_PERCENT 90 // How full a split leaves the rightmost leaf when a key is appended after all others.
+#define APPEND_SPLIT_MIN_RUN 2 // Inserts in a row at the end of the rightmost leaf before a split of it counts as sequential.
+
+// Constants for stream join
+#define STREAM_BLOCK_ENTRIES 512
+#define STREAM_QUEUE_BLOCKS 4
+#define STREAM_READER_STACK_SIZE (256 * 1024)
+
+// Constant for band join
+#define BAND_WINDOW_ENTRIES 4096
+
+// Constant for leaf scans
+#define SCAN_READ_AHEAD_PAGES 16 // Leaves a tree cursor keeps read ahead of itself.
+
+
+// Constants for compaction and bulk building
+#define COMPACT_FILE_SUFFIX ".compact"
+#define DEFAULT_FILL_PERCENT 100
+#define COMPACTION_STEP_PAGES 64
+#define MAX_BUILDER_LEVELS 32
+
+
+// Type for insertion and deletion API
+// The internal pages a descent passed through. Splits and merges climb it instead of following parent pointers.
+typedef struct descent_path {
+	int depth; // The number of internal pages on the path.
+	int64_t pgns[MAX_TREE_HEIGHT]; // pgns[0] is the root, and pgns[depth - 1] the parent of the page reached.
+} descent_path;
+
+// The rightmost leaf and the path to it, remembered by db_insert so that keys appended in increasing order go
+// straight to it. Inserts that split or do not go to the end of the leaf, and all other changes to the shape of
+// the tree, forget it.
+typedef struct append_hint {
+	int64_t leaf_pgn; // -1 if no leaf is remembered.
+	descent_path path;
+	int tail_inserts; // Inserts in a row that went to the end of the leaf.
+} append_hint;
+
+
+// Types for join API
+typedef struct stream_block {
+	int num_entries;
+	int64_t keys[STREAM_BLOCK_ENTRIES];
+	record records[STREAM_BLOCK_ENTRIES];
+} stream_block;
+
+// A sorted (key, value) stream read ahead by a reader thread into a bounded ring of blocks.
+typedef struct join_stream {
+	FILE *fp;
+	bool binary;
+	pthread_t reader;
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+	stream_block blocks[STREAM_QUEUE_BLOCKS];
+	int head; // The block being consumed.
+	int count; // The number of filled blocks, including the head.
+	bool consuming; // Whether the head block is being read by the join.
+	bool eof;
+	bool unsorted;
+	int64_t error_position; // Line number (text) or entry index (binary) of the first bad entry.
+} join_stream;
+
+// A cursor over a leaf chain, or over a join_stream when `stream` is not NULL.
+typedef struct join_cursor {
+	int fd;
+	int64_t leaf_pgn;
+	const char *leaf_image; // The current leaf, pinned in the buffer pool while the cursor is valid.
+	join_stream *stream;
+	int index;
+	bool valid;
+	bool scanning; // Whether the cursor announced a sequential scan of its tree that it must end.
+	int64_t parent_pgn; // The internal page whose children are read ahead, or -1 if unknown.
+	int parent_index; // The child index of the current leaf in the parent page.
+	int read_ahead_index; // The first child of the parent page not read ahead yet.
+	char value_buffer[VALUE_SIZE]; // The last value read from the value log of the tree, or decoded from a prefixed leaf.
+	int64_t value_pgn; // The prefixed leaf value_buffer was decoded from, or -1.
+	int value_index; // The entry of that leaf value_buffer holds.
+} join_cursor;
+
+// Memory usage of the sliding window of a band join.
+typedef struct band_window_stats {
+	int capacity; // The number of entries the ring buffer can hold.
+	int peak_entries;
+	int64_t allocated_bytes;
+	int64_t peak_bytes;
+	int64_t overflow_scans; // Left keys whose band did not fit in the window and were served by a rescan.
+} band_window_stats;
+
+// Physical layout of the leaf chain. A hop from a leaf to the page right after it reads sequentially.
+typedef struct leaf_chain_stats {
+	int64_t num_leaves;
+	int64_t num_entries;
+	int64_t sibling_hops;
+	int64_t sequential_hops; // Hops whose right sibling is the next page in the file.
+	int64_t value_bytes; // The values of slotted and prefixed leaves with their NULs, as they are read.
+	int64_t stored_value_bytes; // The heap bytes those values take in the pages.
+} leaf_chain_stats;
+
+// Shape of the internal levels. The entry bytes are those of the keys and children, without page headers.
+typedef struct internal_page_stats {
+	int height; // Levels of the tree, counting the leaves.
+	int64_t num_pages;
+	int64_t num_keys;
+	int64_t entry_bytes;
+} internal_page_stats;
+
+// The work of one garbage collection of a value log.
+typedef struct value_log_collection {
+	int64_t scanned_values;
+	int64_t moved_values; // Live values appended to the log again.
+	int64_t released_bytes;
+} value_log_collection;
+
+// One level of a tree built bottom-up. The full page before the one being filled is held back
+// until the next page fills up, so that an underfull last page can still borrow from it.
+typedef struct tree_builder_level {
+	page *filling; // Its page number is allocated when the page is started.
+	int64_t filling_min_key;
+	int filling_count; // Entries of a leaf, or children of an internal page.
+	int filling_bytes; // Bytes of the entries of a slotted leaf.
+	page *held; // Swapped with filling when filling is full. Both are allocated when the level is reached.
+	int64_t held_min_key;
+	int held_count;
+	bool has_held;
+	int64_t written_pages;
+} tree_builder_level;
+
+// Writes sorted entries into an empty tree: leaves left to right, internal levels bottom-up.
+typedef struct tree_builder {
+	int fd;
+	header_page header;
+	int leaf_fill; // The number of entries written to each leaf.
+	int leaf_fill_bytes; // With slotted leaves, the bytes of entries written to each leaf instead.
+	int internal_fill; // The number of children written to each internal page.
+	int internal_fill_bytes; // With packed internal pages, the bytes of entries written to each internal page as well.
+	int num_levels;
+	int64_t num_entries;
+	int64_t last_key;
+	tree_builder_level levels[MAX_BUILDER_LEVELS];
+} tree_builder;
+
+typedef struct join_job {
+	char tree_path1[256];
+	char tree_path2[256];
+	char output_path[256];
+} join_job;
+
+typedef struct join_consumer {
+	const join_job *job;
+	bool shared_is_left;
+	int fd;
+	join_cursor cursor;
+	FILE *out;
+} join_consumer;
+
+
 // APIs
 /**
  * @brief Find a record with the given key.
  * @param fd[in] The file descriptor of the database file.
  * @param key[in] The key to find.
  * @param verbose[in] Whether to print verbose output.
- * @param leaf_out[out] The leaf page pointer where the key is found.
+ * @param leaf_out[out] The leaf page pointer where the key is found. The caller frees it.
  * @return The record with the given key, or NULL if not found.
+ *
+ * If `leaf_out` is NULL the leaf is never decoded: the key is probed on the pinned page image and
+ * the returned record is a copy that stays valid until the next call.
  */
 record *db_find(int fd, int64_t key, bool verbose, page **leaf_out);
 
@@ -70,6 +235,8 @@ record *db_find(int fd, int64_t key, bool verbose, page **leaf_out);
  * @param fd[in] The file descriptor of the database file.
  * @param key[in] The key to insert.
  * @param value[in] The value to insert.
+ *
+ * For a tree with a write-ahead log, the insertion and any splits it causes form one mini-transaction.
  */
 void db_insert(int fd, int64_t key, char *value);
 
@@ -94,38 +261,228 @@ void db_destroy(int fd);
  */
 void db_join(int fd1, int fd2, const char *output_filepath);
 
+/**
+ * @brief Band-join two database files: pair every entries whose keys are within `delta` of each other.
+ * @param fd1[in] The file descriptor of the first database file.
+ * @param fd2[in] The file descriptor of the second database file.
+ * @param delta[in] The maximum distance between the joined keys. Must not be negative.
+ * @param output_filepath[in] The filepath of the output file.
+ * @param stats[out] The memory usage of the sliding window.
+ *
+ * The right leaf chain is read once. Entries within the band of the current left key are kept in a
+ * ring buffer of at most BAND_WINDOW_ENTRIES entries. If a band is wider than the ring, the
+ * entries past it are read again from a copy of the right cursor instead of growing the buffer.
+ */
+void db_join_band(int fd1, int fd2, int64_t delta, const char *output_filepath, band_window_stats *stats);
+
+/**
+ * @brief Run a batch of join jobs, sharing leaf-chain scans between jobs with a common input tree.
+ * @param jobs[in] The join jobs. Each job writes its own output file.
+ * @param num_jobs[in] The number of join jobs.
+ *
+ * Jobs are grouped greedily by the input tree that most pending jobs have in common. The shared
+ * tree of a group is scanned once and every entry is fed to the merge consumers of all jobs in the
+ * group, so the shared leaf chain is read a single time per group instead of once per job.
+ */
+void db_join_many(const join_job *jobs, int num_jobs);
+
+/**
+ * @brief Join a database file with a sorted external stream into a new output file.
+ * @param fd[in] The file descriptor of the database file.
+ * @param stream_path[in] The path of the sorted stream file.
+ * @param binary[in] Whether the stream holds packed int64 keys instead of `key value` text lines.
+ * @param output_filepath[in] The filepath of the output file.
+ * @return Whether the stream was read completely. Return false if it is malformed or not sorted.
+ *
+ * The stream is read ahead by a reader thread into a bounded ring of blocks while the tree is
+ * scanned, and is merged with the leaf chain by the same kernel as `db_join`. Entries of a binary
+ * stream, or text lines without a value, take the decimal form of the key as their value.
+ */
+bool db_join_stream(int fd, const char *stream_path, bool binary, const char *output_filepath);
+
+/**
+ * @brief Walk the leaf chain and count how many sibling hops move to the next page of the file.
+ * @param fd[in] The file descriptor of the database file.
+ * @param stats[out] The number of leaves, their entries, and the number of sequential sibling hops. For slotted
+ *                   and prefixed leaves also the value bytes and the bytes they are stored in.
+ */
+void db_leaf_chain_stats(int fd, leaf_chain_stats *stats);
+
+/**
+ * @brief Walk the internal pages and measure the height and fanout of the tree.
+ * @param fd[in] The file descriptor of the database file.
+ * @param stats[out] The height, and the number of internal pages, their keys and the bytes of their entries.
+ */
+void db_internal_page_stats(int fd, internal_page_stats *stats);
+
+/**
+ * @brief Load a sorted stream into an empty tree bottom-up, instead of inserting its entries one by one.
+ * @param fd[in] The file descriptor of the database file. Its tree must be empty.
+ * @param stream_path[in] The path of the stream file, in the format `db_join_stream` reads.
+ * @param binary[in] Whether the stream holds packed int64 keys instead of `key value` text lines.
+ * @param fill_percent[in] How full to pack the leaves and internal pages, between 1 and 100. Pages are
+ * never packed below the occupancy the delete API keeps.
+ * @param num_loaded[out] The number of entries loaded.
+ * @return Whether the whole stream was loaded. Return false if the tree is not empty, or the stream is
+ * missing, malformed, not sorted or repeats a key. The entries before a bad one are kept.
+ *
+ * Leaves are written left to right into leaf extents and each internal level is built as the level
+ * below fills up, so every page is written once. The tree is synced at the end.
+ */
+bool db_bulk_load(int fd, const char *stream_path, bool binary, int fill_percent, int64_t *num_loaded);
+
+/**
+ * @brief Rewrite a tree into a fresh file with its leaves in key order, and swap it in for the old file.
+ * @param fd[in] The file descriptor of the database file. It is closed.
+ * @param fill_percent[in] How full to pack the leaves and internal pages, between 1 and 100. Pages are
+ * never packed below the occupancy the delete API keeps.
+ * @return The file descriptor of the compacted file, opened with the options of the old one.
+ *
+ * The tree is built bottom-up into `<path>.compact`, synced, and renamed over the old file, so a crash
+ * leaves one of the two complete trees. The new file is truncated right after its last page.
+ */
+int db_compact(int fd, int fill_percent);
+
+/**
+ * @brief Do one bounded step of online compaction: move pages from the end of the file to free pages
+ * nearer the front, then truncate the freed tail.
+ * @param fd[in] The file descriptor of the database file.
+ * @param max_pages[in] The maximum number of pages to move.
+ * @return Whether another step may shrink the file further.
+ *
+ * The tree stays valid between steps, so steps can be interleaved with other operations. A moved
+ * page keeps its contents, and the pointers to it in its parent, children and left sibling are
+ * updated. Files that use the linked free list cannot be compacted online. With a write-ahead log,
+ * a step is one mini-transaction, and the freed tail is truncated at the next checkpoint.
+ */
+bool db_compact_step(int fd, int max_pages);
+
+/**
+ * @brief Garbage collect the value log of a tree.
+ * @param fd[in] The file descriptor of the database file.
+ * @param result[out] The number of values scanned and moved, and the log bytes given back.
+ * @return false if the tree has no value log.
+ *
+ * The log is scanned from its tail to the end it has when the collection starts. A value is live if
+ * the leaf entry of its key still refers to it, and live values are appended to the log again, each
+ * move being one mini-transaction. Once the tree is synced, the scanned part is released.
+ */
+bool db_collect_value_log(int fd, value_log_collection *result);
+
 
 // Helper functions for find API
-record *find1(int fd, int64_t root_pgn, int64_t key, bool verbose, page** leaf_out);
-page *find_leaf(int fd, int64_t root_pgn, int64_t key, bool verbose);
+// With a `path`, the internal pages on the way down are recorded in it.
+record *find1(int fd, int64_t root_pgn, int64_t key, bool verbose, page** leaf_out, descent_path *path);
+page *find_leaf(int fd, int64_t root_pgn, int64_t key, bool verbose, descent_path *path);
+int64_t find_leaf_pgn(int fd, int64_t root_pgn, int64_t key, bool verbose, descent_path *path);
 
 
 // Helper functions for insertion API
-void start_new_tree(int fd, header_page *header, int64_t key, char *value);
-void insert_into_leaf(int fd, page *leaf, int64_t key, char *value);
-void insert_into_leaf_after_splitting(int fd, header_page *header, page *leaf, int64_t key, char *value);
-void insert_into_parent(int fd, header_page *header, page *left, int64_t key, page *right);
+void start_new_tree(int fd, header_page *header, int64_t key, const record *rec);
+void insert_into_leaf(int fd, page *leaf, int64_t key, const record *rec);
+// The path holds the ancestors of the page being changed. Moving up to the parent pops it off the path.
+// A sequential split, of the rightmost leaf in a run of appends, leaves the left leaf APPEND_SPLIT_PERCENT full.
+void insert_into_leaf_after_splitting(
+	  int fd, header_page *header, descent_path *path, page *leaf, int64_t key, const record *rec, bool sequential
+);
+void insert_into_parent(int fd, header_page *header, descent_path *path, page *left, int64_t key, page *right);
 void insert_into_new_root(int fd, header_page *header, page *left, int64_t key, page *right);
 void insert_into_page(int fd, page * n, int left_index, int64_t key, page * right);
 void insert_into_page_after_splitting(
-	  int fd, header_page *header, page *old_page, int left_index, int64_t key, page *right
+	  int fd, header_page *header, descent_path *path, page *old_page, int left_index, int64_t key, page *right
 );
+void split_internal_page(
+	  int fd, header_page *header, descent_path *path, page *old_page, const int64_t *keys, const int64_t *child_pgns, int num_keys
+);
+bool find_append_leaf(int fd, const header_page *header, int64_t key, page **leaf_out, descent_path *path, int *tail_inserts);
+void remember_append_leaf(int fd, const page *leaf, const descent_path *path, int64_t key);
+void forget_append_leaf(int fd);
 int get_left_index(page* parent, page* left);
 
 
 // Helper functions for delete API
-void delete_entry(int fd, header_page *header, page *p, int64_t key, int64_t child_pgn);
+void delete_entry(int fd, header_page *header, descent_path *path, page *p, int64_t key, int64_t child_pgn);
 void remove_entry_from_leaf_page(int fd, page *p, int64_t key);
 void remove_entry_from_internal_page(int fd, page *p, int64_t key, int64_t child_pgn);
 int get_neighbor_index(int fd, page *p, page *parent);
 void adjust_root(int fd, header_page *header,  page *root);
-void coalesce_pages(int fd, header_page *header, page *p, page *neighbor, int neighbor_index, int64_t k_prime);
-void redistribute_pages(int fd, header_page *header, page *p, page *neighbor, int neighbor_index, int k_prime_index, int64_t k_prime);
+void coalesce_pages(int fd, header_page *header, descent_path *path, page *p, page *neighbor, page *parent, int neighbor_index, int64_t k_prime);
+void redistribute_pages(
+	  int fd, header_page *header, descent_path *path, page *p, page *neighbor, page *parent, int neighbor_index, int k_prime_index, int64_t k_prime
+);
+void redistribute_slotted_leaves(int fd, header_page *header, descent_path *path, page *left, page *right, page *parent, int k_prime_index);
 
 
 // Helper functions for destroy API
 void destroy_pages(int fd, int64_t pgn);
 
 
+// Helper functions for compaction API
+bool relocate_page(int fd, int64_t src_pgn);
+bool find_page_path(int fd, const header_page *header, const page *p, descent_path *path);
+int64_t find_left_leaf_pgn(int fd, const descent_path *path, int64_t leaf_pgn);
+
+
+// Helper functions for value log API
+int64_t find_live_value(int fd, int64_t key, int64_t value_offset);
+
+
+// Helper functions for bulk building
+void start_tree_builder(tree_builder *builder, int fd, int fill_percent);
+bool add_to_tree_builder(tree_builder *builder, int64_t key, const char *value);
+bool add_record_to_tree_builder(tree_builder *builder, int64_t key, const record *rec);
+void finish_tree_builder(tree_builder *builder);
+void add_builder_entry(tree_builder *builder, int level, int64_t key, const record *rec, int64_t child_pgn);
+void start_builder_page(tree_builder *builder, int level);
+void emit_builder_page(tree_builder *builder, int level, page *p, int64_t min_key);
+void balance_builder_level(tree_builder *builder, int level);
+
+
+// Helper functions for slotted leaves. With fixed leaves these fall back to counting entries against leaf_order.
+// With prefixed values an entry costs less after a value it shares a prefix with, so the pages are passed in key order.
+int leaf_entry_bytes(const header_page *header, const char *value, const char *previous);
+int leaf_used_bytes(const header_page *header, const page *leaf);
+bool leaf_has_room(const header_page *header, const page *leaf, int64_t key, const char *value);
+bool leaf_is_underfull(const header_page *header, const page *leaf);
+bool leaves_fit_in_one(const header_page *header, const page *left, const page *right);
+int pick_leaf_split(const header_page *header, const record *records, int total);
+int pick_append_split(const header_page *header, const record *records, int total);
+
+
+// Helper functions for packed internal pages. Without them these fall back to counting keys against internal_order.
+bool internal_page_has_room(const header_page *header, const page *p, int64_t key);
+bool internal_page_is_underfull(const header_page *header, const page *p);
+bool internal_pages_fit_in_one(const header_page *header, const page *left, const page *right, int64_t k_prime);
+void write_separator_change(int fd, header_page *header, descent_path *path, page *parent);
+
+
+// Helper functions for statistics API
+void add_internal_page_stats(int fd, int64_t pgn, int depth, internal_page_stats *stats);
+
+
+// Helper functions for join API
+void merge_join(join_cursor *left, join_cursor *right, FILE *out);
+void open_tree_cursor(int fd, join_cursor *cursor);
+void open_stream_cursor(join_stream *stream, join_cursor *cursor);
+void clone_join_cursor(join_cursor *dest, const join_cursor *src);
+void close_join_cursor(join_cursor *cursor);
+void advance_join_cursor(join_cursor *cursor);
+int64_t join_cursor_key(const join_cursor *cursor);
+const char *join_cursor_value(join_cursor *cursor);
+bool locate_leaf_parent(join_cursor *cursor);
+void read_ahead_leaves(join_cursor *cursor);
+bool is_same_tree_file(const char *path1, const char *path2);
+const char *pick_shared_input(const join_job *jobs, int num_jobs, const bool *done);
+void run_shared_join(const char *shared_path, join_consumer *consumers, int num_consumers);
+
+
+// Helper functions for stream join
+void start_join_stream(join_stream *stream, FILE *fp, bool binary);
+void stop_join_stream(join_stream *stream);
+void *read_join_stream(void *arg);
+int fill_stream_block(join_stream *stream, stream_block *block, int64_t *last_key, int64_t *position);
+bool next_stream_block(join_stream *stream);
+
+
 // Common utility functions
 int cut(int length);
\ No newline at end of file
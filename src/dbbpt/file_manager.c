@@ -1,89 +1,201 @@
+#define _GNU_SOURCE
 #include "file_manager.h"
+#include "buffer_pool.h"
+#include "wal.h"
+#include "value_log.h"
+#include "upper_index.h"
 
+#include <errno.h>
 #include <fcntl.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 
+// GLOBALS.
+tree_handle *tree_handles[MAX_TREE_FDS];
+file_manager_stats io_stats = { 0, 0 };
+
+
 int open_or_create_tree(const char *file_path, int leaf_order, int internal_order) {
-	int fd = open(file_path, O_RDWR);
+	return open_or_create_tree1(file_path, leaf_order, internal_order, NULL);
+}
 
-	if (fd > 0) return fd;
+int open_or_create_tree1(const char *file_path, int leaf_order, int internal_order, const tree_options *options) {
+	bool direct_io = options != NULL && options->use_direct_io && !options->use_mmap;
+	bool value_log = options != NULL && options->value_log;
+	bool prefixed_values = options != NULL && options->prefixed_values && !value_log;
+	bool slotted_leaves = options != NULL && (options->slotted_leaves || prefixed_values) && !value_log;
+	bool packed_keys = options != NULL && options->packed_keys;
+	bool pax_leaves = options != NULL && options->pax_leaves && !slotted_leaves && !value_log;
+	int fd = open_tree_file(file_path, O_RDWR, direct_io);
+
+	if (fd > 0) {
+		// Every page offset depends on the page size, so a file of another size is refused before its log is replayed.
+		header_page header;
+		read_header_image(fd, &header);
+		int file_page_size = header.page_size == 0 ? LEGACY_PAGE_SIZE : header.page_size;
+		if (file_page_size != PAGE_SIZE) {
+			printf("'%s' has %d-byte pages, but this build uses %d-byte pages.\n", file_path, file_page_size, PAGE_SIZE);
+			close(fd);
+			return -1;
+		}
 
-	if (leaf_order < MIN_LEAF_ORDER || leaf_order > MAX_LEAF_ORDER ||
-			internal_order < MIN_INTERNAL_ORDER || internal_order > MAX_INTERNAL_ORDER) {
+		recover_tree_log(fd, file_path);
+		register_tree_handle(fd, file_path, options);
+		return fd;
+	}
+
+	// Slotted leaves are split by bytes, so their order only bounds the entries a page struct can hold.
+	if (slotted_leaves) leaf_order = SLOTTED_LEAF_ORDER;
+	// Leaves of a value log tree hold 16-byte entries, as many as an internal page.
+	if (value_log) leaf_order = VALUE_LOG_LEAF_ORDER;
+	// Packed internal pages are split by bytes too, so their order only bounds the keys a page struct can hold.
+	if (packed_keys) internal_order = PACKED_INTERNAL_ORDER;
+	if ((!slotted_leaves && !value_log && (leaf_order < MIN_LEAF_ORDER || leaf_order > MAX_LEAF_ORDER)) ||
+			(!packed_keys && (internal_order < MIN_INTERNAL_ORDER || internal_order > MAX_INTERNAL_ORDER))) {
 		printf("Invalid order\n");
 		return -1;
 	}
 	// If the file does not exist, create it.
-	fd = open(file_path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	fd = open_tree_file(file_path, O_RDWR | O_CREAT, direct_io);
 	if (fd == -1) exit_with_err_msg("Error creating file.");
 
-	// Initialize the free pages for a new file.
-	int64_t next_free_pgn = -1;
-	for (int64_t i = 1; i < INIT_PAGE_COUNT; i++) {
-		if (pwrite(fd, &next_free_pgn, 8, i * PAGE_SIZE) < 8) exit_with_err_msg("Error on creating initial free pages.");
-		next_free_pgn = i;
-	}
-
-	// Initialize the header page for a new file.
+	// Initialize the header page for a new file. Space is tracked by bitmap pages, and pages are
+	// handed out in extents, starting after the first extent that holds the header and group metadata.
 	header_page header;
 	header.root_pgn = -1; // No root page yet.
 	header.num_pages = INIT_PAGE_COUNT;
-	header.free_pgn = next_free_pgn;
+	header.free_pgn = -1;
 	header.leaf_order = leaf_order;
 	header.internal_order = internal_order;
+	header.flags = HEADER_FLAG_BITMAP_SPACE | HEADER_FLAG_LEAF_EXTENTS | HEADER_FLAG_NO_PARENT_PGNS;
+	header.page_size = PAGE_SIZE;
+	if (slotted_leaves) header.flags |= HEADER_FLAG_SLOTTED_LEAVES;
+	if (prefixed_values) header.flags |= HEADER_FLAG_PREFIXED_VALUES;
+	if (value_log) header.flags |= HEADER_FLAG_VALUE_LOG;
+	if (packed_keys) header.flags |= HEADER_FLAG_PACKED_KEYS;
+	if (pax_leaves) header.flags |= HEADER_FLAG_PAX_LEAVES;
+	header.high_water_pgn = EXTENT_PAGES;
+	header.value_log_tail = 0;
+	header.value_log_head = 0;
+	while (header.num_pages < header.high_water_pgn) header.num_pages *= 2;
+	extend_tree_file(fd, header.num_pages);
 	write_header_page(fd, &header);
+	// A value log of an earlier file with this path holds nothing the new tree refers to.
+	if (value_log) remove_value_log(file_path);
 
+	register_tree_handle(fd, file_path, options);
+	header.free_pgn = init_group_pages(fd, &header, BITMAP_PAGE_OFFSET_IN_GROUP);
+	mark_pages(fd, HEADER_PAGE_NUM, 1, true);
+	write_header_page(fd, &header);
+	// The log only covers changes from here on, so the new file has to be complete on disk first.
+	checkpoint_tree(fd);
 	return fd;
 }
 
+void close_tree(int fd) {
+	checkpoint_tree(fd);
+	close_tree_log(fd);
+	close_value_log(fd);
+	flush_header_page(fd);
+	drop_buffer_pool(fd);
+	unregister_tree_handle(fd);
+	close(fd);
+}
+
+void crash_tree(int fd, bool torn) {
+	// Nothing is written back. What is in the files now is what recovery gets.
+	abandon_tree_log(fd, torn);
+	abandon_value_log(fd, torn);
+	discard_buffer_pages(fd, 0);
+	unregister_tree_handle(fd);
+	close(fd);
+}
+
+void advise_sequential_scan(int fd, bool sequential) {
+	tree_handle *handle = get_tree_handle(fd);
+	if (handle == NULL) return;
+
+	handle->sequential_scans += sequential ? 1 : -1;
+	bool was_sequential = sequential ? handle->sequential_scans > 1 : handle->sequential_scans > 0;
+	if (was_sequential) return;
+
+	if (!handle->options.use_mmap) {
+		posix_fadvise(fd, 0, 0, sequential ? POSIX_FADV_SEQUENTIAL : POSIX_FADV_NORMAL);
+		return;
+	}
+	for (int i = 0; i < MMAP_MAX_WINDOWS; i++) {
+		mmap_window *window = &(handle->windows[i]);
+		if (window->addr != NULL) madvise(window->addr, (size_t)MMAP_WINDOW_PAGES * PAGE_SIZE, sequential ? MADV_SEQUENTIAL : MADV_NORMAL);
+	}
+}
+
 void load_header_page(int fd, header_page* dest) {
-	char buffer[PAGE_SIZE];
-	if (pread(fd, buffer, PAGE_SIZE, 0) == -1) exit_with_err_msg("Error on loading header page.");
-	
-	int offset_on_pg = 0;
-	memcpy(&(dest->free_pgn), buffer + offset_on_pg, 8);
-	offset_on_pg += 8;
-	memcpy(&(dest->root_pgn), buffer + offset_on_pg, 8);
-	offset_on_pg += 8;
-	memcpy(&(dest->num_pages), buffer + offset_on_pg, 8);
-	offset_on_pg += 8;
-	memcpy(&(dest->leaf_order), buffer + offset_on_pg, 4);
-	offset_on_pg += 4;
-	memcpy(&(dest->internal_order), buffer + offset_on_pg, 4);
-	offset_on_pg += 4;
+	tree_handle *handle = get_tree_handle(fd);
+	if (handle != NULL) {
+		*dest = handle->header;
+		return;
+	}
+	read_header_image(fd, dest);
 }
 
 void write_header_page(int fd, const header_page* src) {
-	char buffer[PAGE_SIZE];
-	memset(buffer, 0, PAGE_SIZE);
+	tree_handle *handle = get_tree_handle(fd);
+	if (handle == NULL) {
+		write_header_image(fd, src);
+		return;
+	}
 
-	int offset_on_pg = 0;
-	memcpy(buffer + offset_on_pg, &(src->free_pgn), 8);
-	offset_on_pg += 8;
-	memcpy(buffer + offset_on_pg, &(src->root_pgn), 8);
-	offset_on_pg += 8;
-	memcpy(buffer + offset_on_pg, &(src->num_pages), 8);
-	offset_on_pg += 8;
-	memcpy(buffer + offset_on_pg, &(src->leaf_order), 4);
-	offset_on_pg += 4;
-	memcpy(buffer + offset_on_pg, &(src->internal_order), 4);
-	offset_on_pg += 4;
+	// Keep the change in memory. It reaches the file on close, on sync, or every header_flush_interval writes.
+	// A header written by this build also marks an older file as one whose parent fields are no longer kept.
+	handle->header = *src;
+	handle->header.flags |= HEADER_FLAG_NO_PARENT_PGNS;
+	handle->header.page_size = PAGE_SIZE;
+	handle->header_dirty = true;
+	handle->header_writes_since_flush += 1;
+	int interval = handle->options.header_flush_interval;
+	if (interval > 0 && handle->wal == NULL && handle->header_writes_since_flush >= interval) flush_header_page(fd);
+}
+
+void flush_header_page(int fd) {
+	tree_handle *handle = get_tree_handle(fd);
+	if (handle == NULL || !handle->header_dirty) return;
 
-	if (pwrite(fd, buffer, PAGE_SIZE, 0) < PAGE_SIZE) exit_with_err_msg("Error on writing header page.");
+	write_header_image(fd, &(handle->header));
+	handle->header_dirty = false;
+	handle->header_writes_since_flush = 0;
+}
+
+void sync_tree(int fd) {
+	tree_handle *handle = get_tree_handle(fd);
+	if (handle != NULL && handle->wal != NULL) {
+		checkpoint_tree(fd);
+		return;
+	}
+	checkpoint_value_log(fd);
+	flush_header_page(fd);
+	flush_buffer_pool(fd);
+	if (fdatasync(fd) == -1) exit_with_err_msg("Error on syncing file.");
+}
+
+void get_file_manager_stats(file_manager_stats *stats) {
+	*stats = io_stats;
 }
 
 void load_page(int fd, int64_t pgn, page* dest) {
-	char buffer[PAGE_SIZE];
-	if (pread(fd, buffer, PAGE_SIZE, pgn * PAGE_SIZE) == -1) exit_with_err_msg("Error on loading page.");
+	const char *buffer = pin_page(fd, pgn, true);
 	int offset_on_pg = 0;
 	
 	dest->pgn = pgn;
-	memcpy(&(dest->parent_pgn), buffer + offset_on_pg, 8);
-	offset_on_pg += 8;
+	offset_on_pg += 8; // parent page number size(8), not kept any more
 	memcpy(&(dest->is_leaf), buffer + offset_on_pg, 4);
 	offset_on_pg += 4;
 	memcpy(&(dest->num_keys), buffer + offset_on_pg, 4);
@@ -96,25 +208,85 @@ void load_page(int fd, int64_t pgn, page* dest) {
 	if (dest->is_leaf) dest->right_sibling_pgn = last_8byte_of_header;
 	else dest->child_pgns[dest->num_keys] = last_8byte_of_header;
 
+	if (dest->is_leaf && leaf_image_is_slotted(buffer)) {
+		for (int i = 0; i < dest->num_keys; i++) {
+			uint16_t value_length;
+			memcpy(&(dest->keys[i]), buffer + offset_on_pg, 8);
+			memcpy(&value_length, buffer + offset_on_pg + 10, 2);
+			memcpy(dest->records[i].value, leaf_image_value(buffer, i), value_length + 1);
+			offset_on_pg += SLOT_SIZE;
+		}
+		unpin_page(fd, pgn, false);
+		return;
+	}
+	if (dest->is_leaf && leaf_image_is_prefixed(buffer)) {
+		for (int i = 0; i < dest->num_keys; i++) {
+			memcpy(&(dest->keys[i]), buffer + offset_on_pg, 8);
+			if (i > 0) memcpy(dest->records[i].value, dest->records[i - 1].value, (unsigned char)buffer[offset_on_pg + 11]);
+			leaf_image_apply_suffix(buffer, i, dest->records[i].value);
+			offset_on_pg += SLOT_SIZE;
+		}
+		unpin_page(fd, pgn, false);
+		return;
+	}
+	if (dest->is_leaf && leaf_image_is_pax(buffer)) {
+		memcpy(dest->keys, buffer + offset_on_pg, dest->num_keys * 8);
+		for (int i = 0; i < dest->num_keys; i++) {
+			memcpy(dest->records[i].value, leaf_image_value(buffer, i), VALUE_SIZE);
+			dest->records[i].value_offset = -1;
+		}
+		unpin_page(fd, pgn, false);
+		return;
+	}
+	if (dest->is_leaf && leaf_image_has_value_log(buffer)) {
+		for (int i = 0; i < dest->num_keys; i++) {
+			memcpy(&(dest->keys[i]), buffer + offset_on_pg, 8);
+			memcpy(&(dest->records[i].value_offset), buffer + offset_on_pg + 8, 8);
+			dest->records[i].value[0] = '\0';
+			offset_on_pg += VALUE_LOG_LEAF_ENTRY_SIZE;
+		}
+		unpin_page(fd, pgn, false);
+		return;
+	}
+	int width = internal_image_key_width(buffer);
+	if (!dest->is_leaf && width != 0) {
+		int64_t base;
+		memcpy(&base, buffer + PAGE_KEY_BASE_OFFSET, 8);
+		decode_packed_keys(buffer + offset_on_pg, width, base, dest->keys, dest->num_keys);
+		offset_on_pg += dest->num_keys * width;
+		for (int i = 0; i < dest->num_keys; i++) {
+			uint32_t child_pgn;
+			memcpy(&child_pgn, buffer + offset_on_pg, PACKED_CHILD_SIZE);
+			dest->child_pgns[i] = child_pgn;
+			offset_on_pg += PACKED_CHILD_SIZE;
+		}
+		unpin_page(fd, pgn, false);
+		return;
+	}
+
 	for (int i = 0; i < dest->num_keys; i++) {
 		memcpy(&(dest->keys[i]), buffer + offset_on_pg, 8);
 		offset_on_pg += 8;
 		if (dest->is_leaf) {
-			memcpy(dest->records[i].value, buffer + offset_on_pg, 120);
-			offset_on_pg += 120;
+			memcpy(dest->records[i].value, buffer + offset_on_pg, VALUE_SIZE);
+			dest->records[i].value_offset = -1;
+			offset_on_pg += VALUE_SIZE;
 		} else {
 			memcpy(&(dest->child_pgns[i]), buffer + offset_on_pg, 8);
 			offset_on_pg += 8;
 		}
 	}
+	unpin_page(fd, pgn, false);
 }
 
 void write_page(int fd, const page* src) {
-	char buffer[PAGE_SIZE];
+	update_upper_index(fd, src);
+	char *buffer = pin_page(fd, src->pgn, false);
 	memset(buffer, 0, PAGE_SIZE);
 
 	int offset_on_pg = 0;
-	memcpy(buffer + offset_on_pg, &(src->parent_pgn), 8);
+	int64_t no_parent_pgn = -1;
+	memcpy(buffer + offset_on_pg, &no_parent_pgn, 8);
 	offset_on_pg += 8;
 	memcpy(buffer + offset_on_pg, &(src->is_leaf), 4);
 	offset_on_pg += 4;
@@ -127,18 +299,120 @@ void write_page(int fd, const page* src) {
 	memcpy(buffer + offset_on_pg, &last_8byte_of_header, 8);
 	offset_on_pg += 8;
 
+	tree_handle *handle = get_tree_handle(fd);
+	// The parent fields of an older file go stale with its first page write, so that is when the file is marked.
+	// Opening it, e.g. to join it, leaves it as it is.
+	if (handle != NULL && (!(handle->header.flags & HEADER_FLAG_NO_PARENT_PGNS) || handle->header.page_size == 0)) {
+		write_header_page(fd, &(handle->header));
+	}
+	if (src->is_leaf && handle != NULL && (handle->header.flags & HEADER_FLAG_SLOTTED_LEAVES)) {
+		// The heap is rebuilt on every write, so it never has holes.
+		bool prefixed = (handle->header.flags & HEADER_FLAG_PREFIXED_VALUES) != 0;
+		buffer[PAGE_LEAF_FORMAT_OFFSET] = prefixed ? LEAF_FORMAT_PREFIXED : LEAF_FORMAT_SLOTTED;
+		int heap_offset = PAGE_SIZE;
+		for (int i = 0; i < src->num_keys; i++) {
+			const char *value = src->records[i].value;
+			uint16_t value_length = (uint16_t)strlen(value);
+			// The first value of a page is kept whole, so that a page decodes on its own.
+			int shared = (prefixed && i > 0) ? shared_prefix_length(src->records[i - 1].value, value) : 0;
+			heap_offset -= value_length - shared + 1;
+			if (heap_offset < offset_on_pg + SLOT_SIZE) exit_with_err_msg("Error on writing page: the leaf entries do not fit.");
+			uint16_t value_offset = (uint16_t)heap_offset;
+			memcpy(buffer + heap_offset, value + shared, value_length - shared + 1);
+			memcpy(buffer + offset_on_pg, &(src->keys[i]), 8);
+			memcpy(buffer + offset_on_pg + 8, &value_offset, 2);
+			if (prefixed) {
+				buffer[offset_on_pg + 10] = (char)(value_length - shared);
+				buffer[offset_on_pg + 11] = (char)shared;
+			} else {
+				memcpy(buffer + offset_on_pg + 10, &value_length, 2);
+			}
+			offset_on_pg += SLOT_SIZE;
+		}
+		unpin_page(fd, src->pgn, true);
+		return;
+	}
+	if (src->is_leaf && handle != NULL && (handle->header.flags & HEADER_FLAG_VALUE_LOG)) {
+		buffer[PAGE_LEAF_FORMAT_OFFSET] = LEAF_FORMAT_VALUE_LOG;
+		for (int i = 0; i < src->num_keys; i++) {
+			memcpy(buffer + offset_on_pg, &(src->keys[i]), 8);
+			memcpy(buffer + offset_on_pg + 8, &(src->records[i].value_offset), 8);
+			offset_on_pg += VALUE_LOG_LEAF_ENTRY_SIZE;
+		}
+		unpin_page(fd, src->pgn, true);
+		return;
+	}
+	if (src->is_leaf && handle != NULL && (handle->header.flags & HEADER_FLAG_PAX_LEAVES)) {
+		buffer[PAGE_LEAF_FORMAT_OFFSET] = LEAF_FORMAT_PAX;
+		memcpy(buffer + offset_on_pg, src->keys, src->num_keys * 8);
+		for (int i = 0; i < src->num_keys; i++) memcpy(buffer + PAX_VALUES_OFFSET + i * VALUE_SIZE, src->records[i].value, VALUE_SIZE);
+		unpin_page(fd, src->pgn, true);
+		return;
+	}
+	if (!src->is_leaf && handle != NULL && (handle->header.flags & HEADER_FLAG_PACKED_KEYS) && src->num_keys > 0) {
+		// The width is picked again on every write, from the keys the page holds now.
+		int64_t base = src->keys[0];
+		int width = packed_key_width(base, src->keys[src->num_keys - 1]);
+		if (!packed_keys_fit(src->num_keys, base, src->keys[src->num_keys - 1])) {
+			exit_with_err_msg("Error on writing page: the internal entries do not fit.");
+		}
+		buffer[PAGE_KEY_WIDTH_OFFSET] = (char)width;
+		memcpy(buffer + PAGE_KEY_BASE_OFFSET, &base, 8);
+		for (int i = 0; i < src->num_keys; i++) {
+			uint64_t delta = (uint64_t)src->keys[i] - (uint64_t)base;
+			memcpy(buffer + offset_on_pg, &delta, width);
+			offset_on_pg += width;
+		}
+		for (int i = 0; i < src->num_keys; i++) {
+			if ((uint64_t)src->child_pgns[i] > UINT32_MAX) exit_with_err_msg("Error on writing page: a child page number does not fit in a packed page.");
+			uint32_t child_pgn = (uint32_t)src->child_pgns[i];
+			memcpy(buffer + offset_on_pg, &child_pgn, PACKED_CHILD_SIZE);
+			offset_on_pg += PACKED_CHILD_SIZE;
+		}
+		unpin_page(fd, src->pgn, true);
+		return;
+	}
+
 	for (int i = 0; i < src->num_keys; i++) {
 		memcpy(buffer + offset_on_pg, &(src->keys[i]), 8);
 		offset_on_pg += 8;
 		if (src->is_leaf) {
-			memcpy(buffer + offset_on_pg, src->records[i].value, 120);
-			offset_on_pg += 120;
+			memcpy(buffer + offset_on_pg, src->records[i].value, VALUE_SIZE);
+			offset_on_pg += VALUE_SIZE;
 		} else {
 			memcpy(buffer + offset_on_pg, &(src->child_pgns[i]), 8);
 			offset_on_pg += 8;
 		}
 	}
-	if (pwrite(fd, buffer, PAGE_SIZE, src->pgn * PAGE_SIZE) < PAGE_SIZE) exit_with_err_msg("Error on writing page.");
+	unpin_page(fd, src->pgn, true);
+}
+
+int internal_image_search(const char *image, int64_t key) {
+	int num_keys = page_image_num_keys(image);
+	int width = internal_image_key_width(image);
+	if (width == 0) return search_keys(image + PAGE_HEADER_SIZE, INTERNAL_ENTRY_SIZE, num_keys, key);
+
+	// Keys below the base are below every key. The deltas are sorted, so the number of them not greater than
+	// the delta of the key is the child index.
+	int64_t base;
+	memcpy(&base, image + PAGE_KEY_BASE_OFFSET, 8);
+	if (key < base) return 0;
+	return search_deltas(image + PAGE_HEADER_SIZE, width, num_keys, (uint64_t)key - (uint64_t)base);
+}
+
+page *alloc_page_struct(int fd) {
+	header_page header;
+	load_header_page(fd, &header);
+
+	int max_keys = (header.leaf_order > header.internal_order ? header.leaf_order : header.internal_order) - 1;
+	size_t bytes = sizeof(page) + ((size_t)max_keys + header.internal_order) * sizeof(int64_t)
+			+ (size_t)(header.leaf_order - 1) * sizeof(record);
+	page *p = (page *)malloc(bytes);
+	if (p == NULL) exit_with_err_msg("Error on allocating page.");
+	p->keys = (int64_t *)(p + 1);
+	p->child_pgns = p->keys + max_keys;
+	p->records = (record *)(p->child_pgns + header.internal_order);
+	return p;
 }
 
 page *alloc_page(int fd) {
@@ -149,39 +423,644 @@ page *alloc_page(int fd) {
 }
 
 page *alloc_page1(int fd, header_page *header_page) {
-	int64_t cur_free_pgn = header_page->free_pgn;
-	if (cur_free_pgn == -1) {
-		// If there is no free page, make more free page.
-		for (int64_t i = header_page->num_pages; i < header_page->num_pages * 2; i++) {
-			if (pwrite(fd, &cur_free_pgn, 8, i * PAGE_SIZE) < 8) exit_with_err_msg("Error on creating initial free pages.");
-			cur_free_pgn = i;
+	if (header_page->flags & HEADER_FLAG_LEAF_EXTENTS) return alloc_page_near(fd, header_page, false, -1);
+	int64_t new_pgn = alloc_pages(fd, header_page, 1);
+
+	page *new_page = alloc_page_struct(fd);
+	new_page->pgn = new_pgn;
+	return new_page;
+}
+
+page *alloc_page_near(int fd, header_page *header, bool is_leaf, int64_t near_pgn) {
+	if (!(header->flags & HEADER_FLAG_LEAF_EXTENTS)) return alloc_page1(fd, header);
+
+	int64_t new_pgn = alloc_extent_page(fd, header, is_leaf ? EXTENT_KIND_LEAF : EXTENT_KIND_INTERNAL, near_pgn);
+	write_header_page(fd, header);
+
+	page *new_page = alloc_page_struct(fd);
+	new_page->pgn = new_pgn;
+	return new_page;
+}
+
+int64_t alloc_pages(int fd, header_page *header, int count) {
+	int64_t first_pgn;
+	if (!(header->flags & HEADER_FLAG_BITMAP_SPACE)) {
+		if (count != 1) exit_with_err_msg("Error on allocating pages: a free list file cannot allocate a run of pages.");
+		first_pgn = pop_free_list(fd, header);
+	} else {
+		first_pgn = find_free_run(fd, header, count);
+		if (first_pgn == -1) first_pgn = advance_high_water(fd, header, count);
+		mark_pages(fd, first_pgn, count, true);
+	}
+	write_header_page(fd, header);
+	return first_pgn;
+}
+
+int64_t alloc_page_below(int fd, header_page *header, bool is_leaf, int64_t limit_pgn) {
+	if (!(header->flags & HEADER_FLAG_BITMAP_SPACE)) return -1;
+
+	int64_t pgn;
+	if (header->flags & HEADER_FLAG_LEAF_EXTENTS) {
+		int kind = is_leaf ? EXTENT_KIND_LEAF : EXTENT_KIND_INTERNAL;
+		int64_t extent_pgn = find_extent(fd, header, kind, limit_pgn - limit_pgn % EXTENT_PAGES);
+		if (extent_pgn == -1) return -1;
+		set_extent_kind(fd, extent_pgn, kind);
+		pgn = find_free_page_in_extent(fd, extent_pgn, extent_pgn);
+	} else {
+		pgn = find_free_run(fd, header, 1);
+		if (pgn == -1 || pgn >= limit_pgn) return -1;
+	}
+	mark_pages(fd, pgn, 1, true);
+	write_header_page(fd, header);
+	return pgn;
+}
+
+void shrink_tree_file(int fd, header_page *header) {
+	if (!(header->flags & HEADER_FLAG_BITMAP_SPACE)) return;
+
+	int64_t last_pgn = find_last_used_page(fd, header);
+	int64_t high_water_pgn = last_pgn + 1;
+	// A group keeps its metadata pages while any of its pages is below the high-water mark.
+	int64_t group_pgn = last_pgn - last_pgn % BITMAP_GROUP_PAGES;
+	int64_t metadata_end_pgn = group_pgn + BITMAP_PAGE_OFFSET_IN_GROUP + 1;
+	if (header->flags & HEADER_FLAG_LEAF_EXTENTS) {
+		metadata_end_pgn = group_pgn + EXTENT_MAP_PAGE_OFFSET_IN_GROUP + 1;
+		high_water_pgn += (EXTENT_PAGES - high_water_pgn % EXTENT_PAGES) % EXTENT_PAGES;
+	}
+	if (high_water_pgn < metadata_end_pgn) high_water_pgn = metadata_end_pgn;
+	if (high_water_pgn > header->high_water_pgn) high_water_pgn = header->high_water_pgn;
+
+	header->high_water_pgn = high_water_pgn;
+	if (header->free_pgn >= high_water_pgn) header->free_pgn = -1;
+	tree_handle *handle = get_tree_handle(fd);
+	if (header->num_pages > high_water_pgn) {
+		header->num_pages = high_water_pgn;
+		discard_buffer_pages(fd, high_water_pgn);
+		// With a log, the committed tree may still use the pages cut off until the next checkpoint, which truncates the file.
+		if ((handle == NULL || handle->wal == NULL) && ftruncate(fd, high_water_pgn * PAGE_SIZE) == -1) exit_with_err_msg("Error on truncating file.");
+	}
+
+	if (handle != NULL) {
+		for (int i = 0; i <= EXTENT_KIND_INTERNAL; i++) {
+			if (handle->current_extent_pgns[i] >= high_water_pgn) handle->current_extent_pgns[i] = -1;
 		}
-		header_page->num_pages *= 2;
-		header_page->free_pgn = cur_free_pgn;
 	}
+	write_header_page(fd, header);
+}
 
-	int64_t next_pgn;
-	if (pread(fd, &next_pgn, 8, cur_free_pgn * PAGE_SIZE) == -1) exit_with_err_msg("Error on reading next free page number.");
-	header_page->free_pgn = next_pgn;
-	write_header_page(fd, header_page);
+int64_t find_last_used_page(int fd, const header_page *header) {
+	int64_t pgn = header->high_water_pgn - 1;
+	while (pgn >= 0) {
+		int64_t bitmap_pgn = bitmap_pgn_of(pgn);
+		int64_t group_pgn = bitmap_pgn - BITMAP_PAGE_OFFSET_IN_GROUP;
+		const char *bitmap = pin_page(fd, bitmap_pgn, true);
+		for (; pgn >= group_pgn; pgn--) {
+			int bit = (int)(pgn - group_pgn);
+			// Skip whole bytes that are free.
+			if (bit % 8 == 7 && bitmap[bit / 8] == 0) {
+				pgn -= 7;
+				continue;
+			}
+			if (!(bitmap[bit / 8] & (1 << (bit % 8)))) continue;
+			if (group_pgn > 0 && is_space_metadata_page(header, pgn)) continue;
+			break;
+		}
+		unpin_page(fd, bitmap_pgn, false);
+		if (pgn >= group_pgn) return pgn;
+	}
+	return HEADER_PAGE_NUM;
+}
 
-	page *new_page = (page *)malloc(sizeof(page));
-	if (new_page == NULL) exit_with_err_msg("Error on allocating new page.");
-	new_page->pgn = cur_free_pgn;
-	return new_page;
+bool is_space_metadata_page(const header_page *header, int64_t pgn) {
+	if (pgn == HEADER_PAGE_NUM) return true;
+	if (!(header->flags & HEADER_FLAG_BITMAP_SPACE)) return false;
+
+	int64_t offset_in_group = pgn % BITMAP_GROUP_PAGES;
+	if (offset_in_group == BITMAP_PAGE_OFFSET_IN_GROUP) return true;
+	return (header->flags & HEADER_FLAG_LEAF_EXTENTS) && offset_in_group == EXTENT_MAP_PAGE_OFFSET_IN_GROUP;
 }
 
 void free_page(int fd, int64_t pgn) {
+	drop_upper_index_page(fd, pgn);
 	header_page header;
 	load_header_page(fd, &header);
 
+	if (header.flags & HEADER_FLAG_BITMAP_SPACE) {
+		// The page itself is not touched. Only its bit is cleared, and the reuse hint lowered.
+		mark_pages(fd, pgn, 1, false);
+		if (header.free_pgn == -1 || pgn < header.free_pgn) header.free_pgn = pgn;
+		write_header_page(fd, &header);
+		return;
+	}
+
 	int64_t cur_free_pgn = header.free_pgn;
-	if (pwrite(fd, &cur_free_pgn, 8, pgn * PAGE_SIZE) < 8) exit_with_err_msg("Error on writing free page number to freed page.");
+	char *freed_page_image = pin_page(fd, pgn, false);
+	memset(freed_page_image, 0, PAGE_SIZE);
+	memcpy(freed_page_image, &cur_free_pgn, 8);
+	unpin_page(fd, pgn, true);
 
 	header.free_pgn = pgn;
 	write_header_page(fd, &header);
 }
 
+// Helper functions
+tree_handle *get_tree_handle(int fd) {
+	if (fd < 0 || fd >= MAX_TREE_FDS) return NULL;
+	return tree_handles[fd];
+}
+
+void register_tree_handle(int fd, const char *file_path, const tree_options *options) {
+	if (fd >= MAX_TREE_FDS) exit_with_err_msg("Error on registering tree: too many open files.");
+
+	tree_handle *handle = (tree_handle *)calloc(1, sizeof(tree_handle));
+	if (handle == NULL) exit_with_err_msg("Error on allocating tree handle.");
+	handle->fd = fd;
+	handle->path = strdup(file_path);
+	if (handle->path == NULL) exit_with_err_msg("Error on allocating tree handle.");
+	if (options != NULL) handle->options = *options;
+	for (int i = 0; i <= EXTENT_KIND_INTERNAL; i++) handle->current_extent_pgns[i] = -1;
+	read_header_image(fd, &(handle->header));
+	tree_handles[fd] = handle;
+
+	// Pages are written through the mapping, so every page below num_pages must be backed by the file.
+	if (handle->options.use_mmap) extend_tree_file(fd, handle->header.num_pages);
+
+	// Growing a free list file writes partial pages, which O_DIRECT does not allow.
+	int fd_flags = fcntl(fd, F_GETFL);
+	if ((fd_flags & O_DIRECT) && !(handle->header.flags & HEADER_FLAG_BITMAP_SPACE)) {
+		fprintf(stderr, "Warning: '%s' uses a free list, so it is accessed with buffered I/O.\n", file_path);
+		fcntl(fd, F_SETFL, fd_flags & ~O_DIRECT);
+	}
+	handle->options.use_direct_io = (fcntl(fd, F_GETFL) & O_DIRECT) != 0;
+	handle->options.slotted_leaves = (handle->header.flags & HEADER_FLAG_SLOTTED_LEAVES) != 0;
+	handle->options.prefixed_values = (handle->header.flags & HEADER_FLAG_PREFIXED_VALUES) != 0;
+	handle->options.value_log = (handle->header.flags & HEADER_FLAG_VALUE_LOG) != 0;
+	handle->options.packed_keys = (handle->header.flags & HEADER_FLAG_PACKED_KEYS) != 0;
+	handle->options.pax_leaves = (handle->header.flags & HEADER_FLAG_PAX_LEAVES) != 0;
+	if (handle->options.value_log) open_value_log(fd);
+
+	// Mapped pages reach the file whenever the kernel writes them, so a log could not hold them back.
+	if (handle->options.wal_group_commit > 0 && handle->options.use_mmap) {
+		fprintf(stderr, "Warning: '%s' is mapped, so its changes are not logged.\n", file_path);
+		handle->options.wal_group_commit = 0;
+	}
+	if (handle->options.wal_group_commit > 0) open_tree_log(fd, handle->options.wal_group_commit);
+	load_upper_index(fd);
+}
+
+void unregister_tree_handle(int fd) {
+	tree_handle *handle = get_tree_handle(fd);
+	if (handle == NULL) return;
+
+	for (int i = 0; i < MMAP_MAX_WINDOWS; i++) {
+		if (handle->windows[i].addr != NULL) munmap(handle->windows[i].addr, (size_t)MMAP_WINDOW_PAGES * PAGE_SIZE);
+	}
+	close_upper_index(fd);
+	free(handle->path);
+	free(handle->append_hint);
+	free(handle);
+	tree_handles[fd] = NULL;
+}
+
+char *pin_mapped_page(int fd, int64_t pgn) {
+	tree_handle *handle = get_tree_handle(fd);
+	if (handle == NULL || !handle->options.use_mmap) return NULL;
+
+	int64_t first_pgn = pgn - pgn % MMAP_WINDOW_PAGES;
+	mmap_window *window = NULL;
+	mmap_window *victim = NULL;
+	for (int i = 0; i < MMAP_MAX_WINDOWS; i++) {
+		mmap_window *candidate = &(handle->windows[i]);
+		if (candidate->addr != NULL && candidate->first_pgn == first_pgn) {
+			window = candidate;
+			break;
+		}
+		if (candidate->pin_count > 0) continue;
+		if (victim == NULL || candidate->addr == NULL ||
+				(victim->addr != NULL && candidate->last_used < victim->last_used)) victim = candidate;
+	}
+
+	if (window == NULL) {
+		if (victim == NULL) exit_with_err_msg("Error on mapping page: every window is pinned.");
+		if (victim->addr != NULL) munmap(victim->addr, (size_t)MMAP_WINDOW_PAGES * PAGE_SIZE);
+
+		// A window always spans MMAP_WINDOW_PAGES pages, even past the end of the file. The part past
+		// the end becomes usable as soon as the file grows, so growing the file never needs a remap.
+		victim->addr = mmap(NULL, (size_t)MMAP_WINDOW_PAGES * PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+				fd, first_pgn * PAGE_SIZE);
+		if (victim->addr == MAP_FAILED) exit_with_err_msg("Error on mapping page.");
+		victim->first_pgn = first_pgn;
+		victim->pin_count = 0;
+		if (handle->sequential_scans > 0) madvise(victim->addr, (size_t)MMAP_WINDOW_PAGES * PAGE_SIZE, MADV_SEQUENTIAL);
+		window = victim;
+	}
+
+	window->pin_count += 1;
+	window->last_used = ++(handle->window_clock);
+	return window->addr + (pgn - first_pgn) * PAGE_SIZE;
+}
+
+bool unpin_mapped_page(int fd, int64_t pgn) {
+	tree_handle *handle = get_tree_handle(fd);
+	if (handle == NULL || !handle->options.use_mmap) return false;
+
+	int64_t first_pgn = pgn - pgn % MMAP_WINDOW_PAGES;
+	for (int i = 0; i < MMAP_MAX_WINDOWS; i++) {
+		mmap_window *window = &(handle->windows[i]);
+		if (window->addr != NULL && window->first_pgn == first_pgn) {
+			window->pin_count -= 1;
+			return true;
+		}
+	}
+	exit_with_err_msg("Error on unpinning a page that is not mapped.");
+	return false;
+}
+
+void extend_tree_file(int fd, int64_t num_pages) {
+	struct stat file_stat;
+	if (fstat(fd, &file_stat) == -1) exit_with_err_msg("Error on reading file size.");
+	if (file_stat.st_size >= num_pages * PAGE_SIZE) return;
+
+	// Reserve the blocks up front where the file system can, so that growth stays contiguous.
+	if (fallocate(fd, 0, file_stat.st_size, num_pages * PAGE_SIZE - file_stat.st_size) == 0) return;
+	if (ftruncate(fd, num_pages * PAGE_SIZE) == -1) exit_with_err_msg("Error on extending file.");
+}
+
+int open_tree_file(const char *file_path, int flags, bool direct_io) {
+	mode_t mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH;
+	if (!direct_io) return open(file_path, flags, mode);
+
+	// File systems without O_DIRECT support, such as tmpfs, refuse it when the file is opened.
+	int fd = open(file_path, flags | O_DIRECT, mode);
+	if (fd != -1 || errno != EINVAL) return fd;
+	fprintf(stderr, "Warning: O_DIRECT is not supported for '%s'. Using buffered I/O.\n", file_path);
+	return open(file_path, flags, mode);
+}
+
+bool retry_without_direct_io(int fd) {
+	// Some file systems accept O_DIRECT on open but reject the I/O itself.
+	if (errno != EINVAL) return false;
+	int fd_flags = fcntl(fd, F_GETFL);
+	if (fd_flags == -1 || !(fd_flags & O_DIRECT)) return false;
+	if (fcntl(fd, F_SETFL, fd_flags & ~O_DIRECT) == -1) return false;
+
+	fprintf(stderr, "Warning: O_DIRECT I/O failed. Using buffered I/O.\n");
+	tree_handle *handle = get_tree_handle(fd);
+	if (handle != NULL) handle->options.use_direct_io = false;
+	return true;
+}
+
+void read_header_image(int fd, header_page* dest) {
+	_Alignas(PAGE_SIZE) char buffer[PAGE_SIZE]; // O_DIRECT needs aligned buffers.
+	ssize_t read_size = pread(fd, buffer, PAGE_SIZE, 0);
+	if (read_size == -1 && retry_without_direct_io(fd)) read_size = pread(fd, buffer, PAGE_SIZE, 0);
+	if (read_size == -1) exit_with_err_msg("Error on loading header page.");
+	io_stats.header_reads += 1;
+	decode_header_image(buffer, dest);
+}
+
+void write_header_image(int fd, const header_page* src) {
+	_Alignas(PAGE_SIZE) char buffer[PAGE_SIZE]; // O_DIRECT needs aligned buffers.
+	memset(buffer, 0, PAGE_SIZE);
+	encode_header_image(src, buffer);
+
+	ssize_t written = pwrite(fd, buffer, PAGE_SIZE, 0);
+	if (written == -1 && retry_without_direct_io(fd)) written = pwrite(fd, buffer, PAGE_SIZE, 0);
+	if (written < PAGE_SIZE) exit_with_err_msg("Error on writing header page.");
+	io_stats.header_writes += 1;
+}
+
+void decode_header_image(const char *buffer, header_page *dest) {
+	int offset_on_pg = 0;
+	memcpy(&(dest->free_pgn), buffer + offset_on_pg, 8);
+	offset_on_pg += 8;
+	memcpy(&(dest->root_pgn), buffer + offset_on_pg, 8);
+	offset_on_pg += 8;
+	memcpy(&(dest->num_pages), buffer + offset_on_pg, 8);
+	offset_on_pg += 8;
+	memcpy(&(dest->leaf_order), buffer + offset_on_pg, 4);
+	offset_on_pg += 4;
+	memcpy(&(dest->internal_order), buffer + offset_on_pg, 4);
+	offset_on_pg += 4;
+	memcpy(&(dest->flags), buffer + offset_on_pg, 4);
+	offset_on_pg += 4;
+	memcpy(&(dest->page_size), buffer + offset_on_pg, 4);
+	offset_on_pg += 4;
+	memcpy(&(dest->high_water_pgn), buffer + offset_on_pg, 8);
+	offset_on_pg += 8;
+	memcpy(&(dest->value_log_tail), buffer + offset_on_pg, 8);
+	offset_on_pg += 8;
+	memcpy(&(dest->value_log_head), buffer + offset_on_pg, 8);
+	offset_on_pg += 8;
+}
+
+void encode_header_image(const header_page *src, char *buffer) {
+	int offset_on_pg = 0;
+	memcpy(buffer + offset_on_pg, &(src->free_pgn), 8);
+	offset_on_pg += 8;
+	memcpy(buffer + offset_on_pg, &(src->root_pgn), 8);
+	offset_on_pg += 8;
+	memcpy(buffer + offset_on_pg, &(src->num_pages), 8);
+	offset_on_pg += 8;
+	memcpy(buffer + offset_on_pg, &(src->leaf_order), 4);
+	offset_on_pg += 4;
+	memcpy(buffer + offset_on_pg, &(src->internal_order), 4);
+	offset_on_pg += 4;
+	memcpy(buffer + offset_on_pg, &(src->flags), 4);
+	offset_on_pg += 4;
+	memcpy(buffer + offset_on_pg, &(src->page_size), 4);
+	offset_on_pg += 4;
+	memcpy(buffer + offset_on_pg, &(src->high_water_pgn), 8);
+	offset_on_pg += 8;
+	memcpy(buffer + offset_on_pg, &(src->value_log_tail), 8);
+	offset_on_pg += 8;
+	memcpy(buffer + offset_on_pg, &(src->value_log_head), 8);
+	offset_on_pg += 8;
+}
+
+void decode_packed_keys(const char *deltas, int width, int64_t base, int64_t *keys, int num_keys) {
+	int i = 0;
+#ifdef __SSE2__
+	// Deltas are widened to 64 bits by interleaving them with zeros, then added to the base two at a time.
+	__m128i bases = _mm_set1_epi64x(base);
+	__m128i zero = _mm_setzero_si128();
+	if (width == 2) {
+		for (; i + 8 <= num_keys; i += 8) {
+			__m128i chunk = _mm_loadu_si128((const __m128i *)(deltas + i * 2));
+			__m128i low = _mm_unpacklo_epi16(chunk, zero);
+			__m128i high = _mm_unpackhi_epi16(chunk, zero);
+			_mm_storeu_si128((__m128i *)(keys + i), _mm_add_epi64(bases, _mm_unpacklo_epi32(low, zero)));
+			_mm_storeu_si128((__m128i *)(keys + i + 2), _mm_add_epi64(bases, _mm_unpackhi_epi32(low, zero)));
+			_mm_storeu_si128((__m128i *)(keys + i + 4), _mm_add_epi64(bases, _mm_unpacklo_epi32(high, zero)));
+			_mm_storeu_si128((__m128i *)(keys + i + 6), _mm_add_epi64(bases, _mm_unpackhi_epi32(high, zero)));
+		}
+	} else if (width == 4) {
+		for (; i + 4 <= num_keys; i += 4) {
+			__m128i chunk = _mm_loadu_si128((const __m128i *)(deltas + i * 4));
+			_mm_storeu_si128((__m128i *)(keys + i), _mm_add_epi64(bases, _mm_unpacklo_epi32(chunk, zero)));
+			_mm_storeu_si128((__m128i *)(keys + i + 2), _mm_add_epi64(bases, _mm_unpackhi_epi32(chunk, zero)));
+		}
+	}
+#endif
+	for (; i < num_keys; i++) {
+		uint64_t delta = 0;
+		memcpy(&delta, deltas + i * width, width);
+		keys[i] = (int64_t)((uint64_t)base + delta);
+	}
+}
+
+void read_page_image(int fd, int64_t pgn, char *dest) {
+	ssize_t read_size = pread(fd, dest, PAGE_SIZE, pgn * PAGE_SIZE);
+	if (read_size == -1 && retry_without_direct_io(fd)) read_size = pread(fd, dest, PAGE_SIZE, pgn * PAGE_SIZE);
+	if (read_size == -1) exit_with_err_msg("Error on loading page.");
+}
+
+void write_page_image(int fd, int64_t pgn, const char *src) {
+	ssize_t written = pwrite(fd, src, PAGE_SIZE, pgn * PAGE_SIZE);
+	if (written == -1 && retry_without_direct_io(fd)) written = pwrite(fd, src, PAGE_SIZE, pgn * PAGE_SIZE);
+	if (written < PAGE_SIZE) exit_with_err_msg("Error on writing page.");
+}
+
+void write_page_images(int fd, int64_t first_pgn, const char *const *srcs, int count) {
+	// Consecutive pages from scattered buffers go out in a single system call.
+	struct iovec iov[count];
+	for (int i = 0; i < count; i++) {
+		iov[i].iov_base = (void *)srcs[i];
+		iov[i].iov_len = PAGE_SIZE;
+	}
+	ssize_t written = pwritev(fd, iov, count, first_pgn * PAGE_SIZE);
+	if (written == -1 && retry_without_direct_io(fd)) written = pwritev(fd, iov, count, first_pgn * PAGE_SIZE);
+	if (written < (ssize_t)count * PAGE_SIZE) exit_with_err_msg("Error on writing pages.");
+}
+
+int64_t pop_free_list(int fd, header_page *header) {
+	int64_t cur_free_pgn = header->free_pgn;
+	if (cur_free_pgn == -1) {
+		// If there is no free page, make more free page. Pages past num_pages are never cached, so they are written directly.
+		for (int64_t i = header->num_pages; i < header->num_pages * 2; i++) {
+			if (pwrite(fd, &cur_free_pgn, 8, i * PAGE_SIZE) < 8) exit_with_err_msg("Error on creating initial free pages.");
+			cur_free_pgn = i;
+		}
+		header->num_pages *= 2;
+		header->free_pgn = cur_free_pgn;
+
+		// The links are not logged, so they must be on disk before a logged header points at them.
+		tree_handle *handle = get_tree_handle(fd);
+		if (handle != NULL && handle->wal != NULL && fdatasync(fd) == -1) exit_with_err_msg("Error on syncing file.");
+		if (handle != NULL && handle->options.use_mmap) extend_tree_file(fd, header->num_pages);
+	}
+
+	int64_t next_pgn;
+	const char *free_page_image = pin_page(fd, cur_free_pgn, true);
+	memcpy(&next_pgn, free_page_image, 8);
+	unpin_page(fd, cur_free_pgn, false);
+	header->free_pgn = next_pgn;
+	return cur_free_pgn;
+}
+
+int64_t find_free_run(int fd, header_page *header, int count) {
+	if (header->free_pgn == -1) return -1;
+
+	int64_t run_start = -1;
+	int run_length = 0;
+	int64_t first_free_pgn = -1;
+	int64_t pgn = header->free_pgn;
+	while (pgn < header->high_water_pgn && run_length < count) {
+		int64_t bitmap_pgn = bitmap_pgn_of(pgn);
+		int64_t group_end = bitmap_pgn - BITMAP_PAGE_OFFSET_IN_GROUP + BITMAP_GROUP_PAGES;
+		if (group_end > header->high_water_pgn) group_end = header->high_water_pgn;
+
+		const char *bitmap = pin_page(fd, bitmap_pgn, true);
+		for (; pgn < group_end && run_length < count; pgn++) {
+			int bit = (int)(pgn % BITMAP_GROUP_PAGES);
+			// Skip whole bytes that are fully allocated.
+			if (bit % 8 == 0 && pgn + 8 <= group_end && (unsigned char)bitmap[bit / 8] == 0xFF) {
+				run_length = 0;
+				pgn += 7;
+				continue;
+			}
+			if (bitmap[bit / 8] & (1 << (bit % 8))) {
+				run_length = 0;
+				continue;
+			}
+			if (first_free_pgn == -1) first_free_pgn = pgn;
+			if (run_length == 0) run_start = pgn;
+			run_length += 1;
+		}
+		unpin_page(fd, bitmap_pgn, false);
+	}
+
+	// Keep the hint at the lowest free page seen, or drop it if nothing below the high-water mark is free.
+	header->free_pgn = first_free_pgn;
+	if (run_length < count) return -1;
+	if (first_free_pgn == run_start) header->free_pgn = run_start + count < header->high_water_pgn ? run_start + count : -1;
+	return run_start;
+}
+
+int64_t advance_high_water(int fd, header_page *header, int count) {
+	bool use_extents = header->flags & HEADER_FLAG_LEAF_EXTENTS;
+	int64_t first_pgn = header->high_water_pgn;
+	while (true) {
+		// A run spans at most two groups, and the bitmap of the group of first_pgn is set up already
+		// unless first_pgn is the first page of a new group, which then is the group of the last page too.
+		int64_t bitmap_pgn = bitmap_pgn_of(first_pgn + count - 1);
+		if (bitmap_pgn < header->high_water_pgn) break;
+
+		// Set up the metadata pages of the new group and start the run after them, or after the first
+		// extent of the group with extents. Pages skipped on the way stay free below the high-water mark.
+		int64_t group_pgn = bitmap_pgn - BITMAP_PAGE_OFFSET_IN_GROUP;
+		int64_t next_pgn = group_pgn + (use_extents ? EXTENT_PAGES : BITMAP_PAGE_OFFSET_IN_GROUP + 1);
+		while (next_pgn > header->num_pages) header->num_pages *= 2;
+		extend_tree_file(fd, header->num_pages);
+		init_group_pages(fd, header, bitmap_pgn);
+		if (header->free_pgn == -1 || first_pgn < header->free_pgn) header->free_pgn = first_pgn;
+		header->high_water_pgn = next_pgn;
+		first_pgn = next_pgn;
+	}
+
+	// With extents the high-water mark stays on an extent boundary, leaving the rest of the last extent free.
+	header->high_water_pgn = first_pgn + count;
+	if (use_extents && header->high_water_pgn % EXTENT_PAGES != 0) {
+		if (header->free_pgn == -1 || header->high_water_pgn < header->free_pgn) header->free_pgn = header->high_water_pgn;
+		header->high_water_pgn += EXTENT_PAGES - header->high_water_pgn % EXTENT_PAGES;
+	}
+	if (header->high_water_pgn > header->num_pages) {
+		while (header->high_water_pgn > header->num_pages) header->num_pages *= 2;
+		extend_tree_file(fd, header->num_pages);
+	}
+	return first_pgn;
+}
+
+int64_t init_group_pages(int fd, const header_page *header, int64_t bitmap_pgn) {
+	int64_t next_pgn = bitmap_pgn + 1;
+	char *bitmap = pin_page(fd, bitmap_pgn, false);
+	memset(bitmap, 0, PAGE_SIZE);
+	int bit = (int)(bitmap_pgn % BITMAP_GROUP_PAGES);
+	bitmap[bit / 8] |= (1 << (bit % 8));
+
+	if (header->flags & HEADER_FLAG_LEAF_EXTENTS) {
+		int64_t extent_map_pgn = bitmap_pgn - BITMAP_PAGE_OFFSET_IN_GROUP + EXTENT_MAP_PAGE_OFFSET_IN_GROUP;
+		bit = (int)(extent_map_pgn % BITMAP_GROUP_PAGES);
+		bitmap[bit / 8] |= (1 << (bit % 8));
+
+		char *extent_map = pin_page(fd, extent_map_pgn, false);
+		memset(extent_map, EXTENT_KIND_NONE, PAGE_SIZE);
+		extent_map[0] = EXTENT_KIND_INTERNAL;
+		unpin_page(fd, extent_map_pgn, true);
+		next_pgn = extent_map_pgn + 1;
+	}
+	unpin_page(fd, bitmap_pgn, true);
+	return next_pgn;
+}
+
+int64_t alloc_extent_page(int fd, header_page *header, int kind, int64_t near_pgn) {
+	tree_handle *handle = get_tree_handle(fd);
+	if (handle == NULL) exit_with_err_msg("Error on allocating page: the tree is not open.");
+
+	// Right after the page to follow first, so that leaf chains run forward within their extents.
+	int64_t pgn = -1;
+	if (near_pgn != -1) pgn = find_free_page_in_extent(fd, near_pgn - near_pgn % EXTENT_PAGES, near_pgn + 1);
+	int64_t extent_pgn = handle->current_extent_pgns[kind];
+	if (pgn == -1 && extent_pgn != -1) pgn = find_free_page_in_extent(fd, extent_pgn, extent_pgn);
+	if (pgn == -1) {
+		extent_pgn = claim_extent(fd, header, kind);
+		handle->current_extent_pgns[kind] = extent_pgn;
+		pgn = find_free_page_in_extent(fd, extent_pgn, extent_pgn);
+	}
+	mark_pages(fd, pgn, 1, true);
+	return pgn;
+}
+
+int64_t find_free_page_in_extent(int fd, int64_t extent_pgn, int64_t from_pgn) {
+	int64_t bitmap_pgn = bitmap_pgn_of(extent_pgn);
+	const char *bitmap = pin_page(fd, bitmap_pgn, true);
+	uint64_t used = extent_used_bits(bitmap, extent_pgn % BITMAP_GROUP_PAGES);
+	unpin_page(fd, bitmap_pgn, false);
+
+	uint64_t candidates = ~used & EXTENT_ALL_USED;
+	int first_bit = (int)(from_pgn - extent_pgn);
+	if (first_bit >= EXTENT_PAGES) return -1;
+	candidates &= ~0ULL << first_bit;
+	if (candidates == 0) return -1;
+	return extent_pgn + __builtin_ctzll(candidates);
+}
+
+int64_t claim_extent(int fd, header_page *header, int kind) {
+	int64_t extent_pgn = find_extent(fd, header, kind, header->high_water_pgn);
+	if (extent_pgn == -1) extent_pgn = advance_high_water(fd, header, EXTENT_PAGES);
+	set_extent_kind(fd, extent_pgn, kind);
+	return extent_pgn;
+}
+
+int64_t find_extent(int fd, header_page *header, int kind, int64_t limit_pgn) {
+	// Below limit_pgn, prefer an extent of the same kind that has room, then an empty extent.
+	int64_t found_pgn = -1;
+	int64_t empty_pgn = -1;
+	int64_t first_free_pgn = -1;
+	int64_t extent_pgn = header->free_pgn == -1 ? header->high_water_pgn : header->free_pgn - header->free_pgn % EXTENT_PAGES;
+	if (limit_pgn > header->high_water_pgn) limit_pgn = header->high_water_pgn;
+	while (extent_pgn < limit_pgn && found_pgn == -1) {
+		int64_t bitmap_pgn = bitmap_pgn_of(extent_pgn);
+		int64_t group_pgn = bitmap_pgn - BITMAP_PAGE_OFFSET_IN_GROUP;
+		int64_t extent_map_pgn = group_pgn + EXTENT_MAP_PAGE_OFFSET_IN_GROUP;
+		int64_t group_end = group_pgn + BITMAP_GROUP_PAGES;
+		if (group_end > limit_pgn) group_end = limit_pgn;
+
+		const char *bitmap = pin_page(fd, bitmap_pgn, true);
+		const char *extent_map = pin_page(fd, extent_map_pgn, true);
+		for (; extent_pgn < group_end; extent_pgn += EXTENT_PAGES) {
+			uint64_t used = extent_used_bits(bitmap, extent_pgn - group_pgn);
+			if (used == EXTENT_ALL_USED) continue;
+			if (first_free_pgn == -1) first_free_pgn = extent_pgn;
+			if (used == 0) {
+				if (empty_pgn == -1) empty_pgn = extent_pgn;
+			} else if (extent_map[(extent_pgn - group_pgn) / EXTENT_PAGES] == kind) {
+				found_pgn = extent_pgn;
+				break;
+			}
+		}
+		unpin_page(fd, extent_map_pgn, false);
+		unpin_page(fd, bitmap_pgn, false);
+	}
+
+	// Every extent below first_free_pgn is full, so it stays a valid hint. Past limit_pgn nothing is known.
+	if (first_free_pgn != -1 || limit_pgn == header->high_water_pgn) header->free_pgn = first_free_pgn;
+	return found_pgn != -1 ? found_pgn : empty_pgn;
+}
+
+void set_extent_kind(int fd, int64_t extent_pgn, int kind) {
+	int64_t group_pgn = extent_pgn - extent_pgn % BITMAP_GROUP_PAGES;
+	int64_t extent_map_pgn = group_pgn + EXTENT_MAP_PAGE_OFFSET_IN_GROUP;
+	char *extent_map = pin_page(fd, extent_map_pgn, true);
+	extent_map[(extent_pgn - group_pgn) / EXTENT_PAGES] = (char)kind;
+	unpin_page(fd, extent_map_pgn, true);
+}
+
+void mark_pages(int fd, int64_t first_pgn, int count, bool used) {
+	int64_t pgn = first_pgn;
+	while (pgn < first_pgn + count) {
+		int64_t bitmap_pgn = bitmap_pgn_of(pgn);
+		char *bitmap = pin_page(fd, bitmap_pgn, true);
+		for (; pgn < first_pgn + count && bitmap_pgn_of(pgn) == bitmap_pgn; pgn++) {
+			int bit = (int)(pgn % BITMAP_GROUP_PAGES);
+			if (used) bitmap[bit / 8] |= (1 << (bit % 8));
+			else bitmap[bit / 8] &= ~(1 << (bit % 8));
+		}
+		unpin_page(fd, bitmap_pgn, true);
+	}
+}
+
+uint64_t extent_used_bits(const char *bitmap, int64_t offset_in_group) {
+	// Extents are aligned within their group, so the bits of an extent are whole bytes of the bitmap, at most a 64-bit word.
+	uint64_t used = 0;
+	memcpy(&used, bitmap + offset_in_group / 8, EXTENT_PAGES / 8);
+	return used;
+}
+
+int64_t bitmap_pgn_of(int64_t pgn) {
+	return pgn - pgn % BITMAP_GROUP_PAGES + BITMAP_PAGE_OFFSET_IN_GROUP;
+}
+
 void exit_with_err_msg(const char* err_msg) {
 	perror(err_msg);
 	exit(EXIT_FAILURE);
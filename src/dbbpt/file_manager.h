@@ -3,6 +3,8 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <string.h>
+#include "key_search.h"
 #ifdef _WIN32
 #define bool char
 #define false 0
@@ -13,15 +15,118 @@
 // Constants
 #define MIN_LEAF_ORDER 3
 #define MIN_INTERNAL_ORDER 3
-#define MAX_LEAF_ORDER 32
-#define MAX_INTERNAL_ORDER 249
-#define DEFAULT_LEAF_ORDER 32
-#define DEFAULT_INTERNAL_ORDER 249
+#define MAX_LEAF_ORDER ((PAGE_SIZE - PAGE_HEADER_SIZE) / LEAF_ENTRY_SIZE + 1) // 32 with 4 KiB pages.
+#define MAX_INTERNAL_ORDER ((PAGE_SIZE - PAGE_HEADER_SIZE) / INTERNAL_ENTRY_SIZE + 1) // 249 with 4 KiB pages.
+#define DEFAULT_LEAF_ORDER MAX_LEAF_ORDER
+#define DEFAULT_INTERNAL_ORDER MAX_INTERNAL_ORDER
 
 #define INIT_PAGE_COUNT 4
 
-#define PAGE_SIZE 4096
+// Constants for the bitmap space manager. Every group of BITMAP_GROUP_PAGES pages keeps its
+// allocation bitmap in its second page, so the bitmap of the first group follows the header page.
+#define HEADER_FLAG_BITMAP_SPACE 0x1
+#define BITMAP_GROUP_PAGES (PAGE_SIZE * 8)
+#define BITMAP_PAGE_OFFSET_IN_GROUP 1
+
+// Constants for leaf extents. With HEADER_FLAG_LEAF_EXTENTS, pages are handed out from aligned extents
+// that hold either leaves or internal pages, and each group keeps the kind of its extents, one byte per
+// extent, in the page after its bitmap page. The first extent of a group holds its metadata pages.
+#define HEADER_FLAG_LEAF_EXTENTS 0x2
+#define EXTENT_BYTES (256 * 1024)
+// 64 with 4 KiB pages. At least 8, so that the extent map of a group, one byte per extent, fits in one page.
+#define EXTENT_PAGES (EXTENT_BYTES / PAGE_SIZE > 8 ? EXTENT_BYTES / PAGE_SIZE : 8)
+#define EXTENT_ALL_USED (EXTENT_PAGES == 64 ? ~0ULL : (1ULL << (EXTENT_PAGES % 64)) - 1) // The bits of a full extent.
+#define EXTENT_MAP_PAGE_OFFSET_IN_GROUP 2
+#define EXTENT_KIND_NONE 0
+#define EXTENT_KIND_LEAF 1
+#define EXTENT_KIND_INTERNAL 2
+
+// Constants for slotted leaves. With HEADER_FLAG_SLOTTED_LEAVES, leaves keep a directory of SLOT_SIZE
+// slots after the page header, sorted by key, and the values, NUL terminated, in a heap that grows down
+// from the end of the page. Leaves are split and merged by bytes instead of by leaf_order.
+#define HEADER_FLAG_SLOTTED_LEAVES 0x4
+#define SLOT_SIZE 12 // key(8) + value offset(2) + value length(2)
+#define SLOTTED_LEAF_SPACE (PAGE_SIZE - PAGE_HEADER_SIZE)
+#define MAX_SLOTTED_LEAF_ENTRIES (SLOTTED_LEAF_SPACE / (SLOT_SIZE + 1)) // Every value takes at least its NUL.
+#define SLOTTED_LEAF_ORDER (MAX_SLOTTED_LEAF_ENTRIES + 1) // The leaf_order recorded for trees with slotted leaves.
+#define MAX_SLOTTED_ENTRY_SIZE (SLOT_SIZE + VALUE_SIZE)
+// Leaves other than the root hold at least this many bytes. A split or a redistribution of two leaves that
+// do not fit in one page always leaves both halves above it.
+#define MIN_SLOTTED_LEAF_BYTES ((SLOTTED_LEAF_SPACE - MAX_SLOTTED_ENTRY_SIZE) / 2)
+
+// Constants for prefixed leaves. With HEADER_FLAG_PREFIXED_VALUES as well as HEADER_FLAG_SLOTTED_LEAVES, each
+// value but the first of a leaf keeps only the suffix it does not share with the value before it, and its slot
+// holds the suffix length and the shared length in the two bytes a slotted leaf keeps its value length in.
+#define HEADER_FLAG_PREFIXED_VALUES 0x20
+
+// Constants for value log trees. With HEADER_FLAG_VALUE_LOG, values are appended to a log next to the
+// tree file, and leaves keep VALUE_LOG_LEAF_ENTRY_SIZE entries of a key and the offset of its value there.
+#define HEADER_FLAG_VALUE_LOG 0x8
+#define VALUE_LOG_LEAF_ENTRY_SIZE 16 // key(8) + value offset(8)
+#define VALUE_LOG_LEAF_ORDER ((PAGE_SIZE - PAGE_HEADER_SIZE) / VALUE_LOG_LEAF_ENTRY_SIZE + 1) // The leaf_order recorded for value log trees.
+
+// Constant for trees without parent pointers. Pages used to keep the page number of their parent, which every
+// split and merge had to rewrite in all the children it moved. With HEADER_FLAG_NO_PARENT_PGNS, the write path
+// climbs the pages it descended through instead, and the parent field of a page is written as -1. Files without
+// the flag are read the same way, since the field is never read, and are given the flag with their first write.
+#define HEADER_FLAG_NO_PARENT_PGNS 0x40
+
+// Constants for PAX leaves. With HEADER_FLAG_PAX_LEAVES, fixed leaves keep all their keys together after the page
+// header and their values in a region of their own after room for MAX_LEAF_ORDER - 1 keys, instead of interleaving
+// each key with its value. A search or a key-only pass over a leaf then reads 248 bytes of keys with 4 KiB pages, not
+// the whole page.
+// Slotted, prefixed and value log leaves keep their own layouts.
+#define HEADER_FLAG_PAX_LEAVES 0x80
+#define PAX_VALUES_OFFSET (PAGE_HEADER_SIZE + (MAX_LEAF_ORDER - 1) * 8)
+
+// Constants for packed internal pages. With HEADER_FLAG_PACKED_KEYS, internal pages keep their keys as deltas
+// from their first key, 2, 4 or 8 bytes wide as the key range of the page needs, followed by 4-byte child page
+// numbers. Pages are split by bytes as well as by internal_order, which is fixed so that either half of a split
+// fits whatever its key range, and pages other than the root keep at least MIN_PACKED_INTERNAL_KEYS keys.
+#define HEADER_FLAG_PACKED_KEYS 0x10
+#define PACKED_CHILD_SIZE 4
+#define PACKED_INTERNAL_SPACE (PAGE_SIZE - PAGE_HEADER_SIZE)
+#define MAX_WIDE_PACKED_KEYS (PACKED_INTERNAL_SPACE / (8 + PACKED_CHILD_SIZE)) // Keys a page holds with 8-byte deltas.
+#define PACKED_INTERNAL_ORDER (2 * MAX_WIDE_PACKED_KEYS + 1) // The internal_order recorded for trees with packed internal pages.
+#define MIN_PACKED_INTERNAL_KEYS (MAX_WIDE_PACKED_KEYS / 2)
+#define MAX_PAGE_KEYS (PACKED_INTERNAL_ORDER - 1) // The most keys a packed internal page holds.
+
+#define MAX_TREE_FDS 1024
+
+// Constants for the mmap backend. Each tree maps at most MMAP_MAX_WINDOWS windows at a time.
+#define MMAP_WINDOW_PAGES 512 // 2 MiB
+#define MMAP_MAX_WINDOWS 8
+
+// The page size is fixed when the program is built, with -DDBBPT_PAGE_SIZE=<bytes>, and recorded in the header of
+// each new file. A file is only opened by a build with the same page size.
+#ifndef DBBPT_PAGE_SIZE
+#define DBBPT_PAGE_SIZE 4096
+#endif
+#if DBBPT_PAGE_SIZE < 4096 || DBBPT_PAGE_SIZE > 65536 || (DBBPT_PAGE_SIZE & (DBBPT_PAGE_SIZE - 1)) != 0
+#error "DBBPT_PAGE_SIZE must be a power of two from 4096 to 65536."
+#endif
+#define PAGE_SIZE DBBPT_PAGE_SIZE
+#define LEGACY_PAGE_SIZE 4096 // The page size of files written before the header recorded it.
 #define HEADER_PAGE_NUM 0
+#define HEADER_IMAGE_SIZE 64 // Bytes of the header page that hold fields. The rest of the page is zero.
+
+// On-disk layout of a page image
+#define PAGE_PARENT_PGN_OFFSET 0 // The parent page, in files without HEADER_FLAG_NO_PARENT_PGNS. Written as -1 otherwise.
+#define PAGE_IS_LEAF_OFFSET 8
+#define PAGE_NUM_KEYS_OFFSET 12
+#define PAGE_LEAF_FORMAT_OFFSET 16 // One byte in the reserved part of the header: one of the LEAF_FORMAT_* values.
+#define PAGE_KEY_WIDTH_OFFSET 17 // One byte: the delta width of a packed internal page, or 0 for INTERNAL_ENTRY_SIZE entries.
+#define PAGE_KEY_BASE_OFFSET 24 // The first key of a packed internal page, which its deltas are taken from.
+#define PAGE_LAST_PGN_OFFSET 120 // Right sibling of a leaf page, or the rightmost child of an internal page.
+#define PAGE_HEADER_SIZE 128
+#define LEAF_ENTRY_SIZE 128
+#define INTERNAL_ENTRY_SIZE 16
+#define LEAF_FORMAT_FIXED 0 // LEAF_ENTRY_SIZE entries of a key and a 120-byte value.
+#define LEAF_FORMAT_SLOTTED 1
+#define LEAF_FORMAT_VALUE_LOG 2
+#define LEAF_FORMAT_PREFIXED 3 // Slots of a key, a suffix offset, a suffix length and a shared prefix length.
+#define LEAF_FORMAT_PAX 4 // An array of keys, and an array of 120-byte values from PAX_VALUES_OFFSET.
+#define VALUE_SIZE 120 // A value of up to 119 chars and its NUL.
 
 
 // Type definitions
@@ -30,21 +135,21 @@ typedef uint64_t pagenum_t;
 
 // Structures
 typedef struct record {
-	char value[120];
+	char value[VALUE_SIZE]; // Empty in the leaves of a value log tree, whose values are read through value_offset.
+	int64_t value_offset; // The offset of the value in the value log, for a tree with HEADER_FLAG_VALUE_LOG.
 } record;
 
 typedef struct page {
 	int64_t pgn;
 
-	int64_t parent_pgn;
 	bool is_leaf;
 	int num_keys;
-	int64_t keys[248];
+	int64_t *keys; // As many as a leaf or an internal page of the tree holds, whichever is more. See alloc_page_struct().
 
-	record records[31]; // for leaf page
+	record *records; // leaf_order - 1 of them, for leaf page. A slotted or value log tree records a larger leaf_order.
 	int64_t right_sibling_pgn; // for leaf page
 
-	int64_t child_pgns[249]; // for internal page
+	int64_t *child_pgns; // internal_order of them, for internal page
 
 	int64_t next_pgn; // for free page
 } page;
@@ -58,9 +163,209 @@ typedef struct header_page {
 	int leaf_order;
 	// A maximum number of children in the internal node. The number of keys in the internal node is (internal_order - 1)
 	int internal_order;
+
+	// HEADER_FLAG_* bits. Files written before these fields existed read as 0.
+	int flags;
+	// The PAGE_SIZE of the build that created the file, or 0 for a file written before it was recorded.
+	int page_size;
+	// With HEADER_FLAG_BITMAP_SPACE, pages at or above this page number have never been allocated,
+	// and free_pgn is only a hint: the lowest page number that may be free below the high-water mark.
+	int64_t high_water_pgn;
+
+	// With HEADER_FLAG_VALUE_LOG, the value log holds live values from value_log_tail on; the space before
+	// it has been garbage collected. Entries up to value_log_head were synced when the header was last written.
+	int64_t value_log_tail;
+	int64_t value_log_head;
 } header_page;
 
 
+typedef struct tree_options {
+	bool use_mmap; // Access pages through windowed mappings instead of pread/pwrite and the buffer pool.
+	bool use_direct_io; // Open the file with O_DIRECT, so that pages are cached by the buffer pool only. Ignored with use_mmap.
+	bool slotted_leaves; // Create the tree with slotted leaves. Set on open if the tree has them.
+	bool prefixed_values; // Create the tree with slotted leaves that keep values without the prefix shared with the value before. Set on open if the tree has them.
+	bool value_log; // Create the tree with its values in a value log. Set on open if the tree has one. Overrides slotted_leaves.
+	bool packed_keys; // Create the tree with packed internal pages. Set on open if the tree has them.
+	bool pax_leaves; // Create the tree with fixed leaves that keep keys and values apart. Ignored with slotted, prefixed or value log leaves. Set on open if the tree has them.
+	int header_flush_interval; // Write the cached header page back every this many header updates. 0 for only on close and sync.
+	int wal_group_commit; // Log changes to the file path + ".wal", syncing the log once per this many commits. 0 for no log. Ignored with use_mmap.
+} tree_options;
+
+struct wal_log;
+struct value_log;
+
+typedef struct mmap_window {
+	char *addr; // NULL if the window is not mapped.
+	int64_t first_pgn;
+	int pin_count;
+	uint64_t last_used;
+} mmap_window;
+
+// The state kept for each open database file, indexed by its file descriptor.
+typedef struct tree_handle {
+	int fd;
+	char *path; // The path the file was opened with.
+	tree_options options;
+	header_page header; // The cached header page. Changes are deferred while header_dirty is set.
+	bool header_dirty;
+	int header_writes_since_flush;
+	int sequential_scans; // The number of leaf scans in progress.
+	mmap_window windows[MMAP_MAX_WINDOWS];
+	uint64_t window_clock;
+	int64_t current_extent_pgns[EXTENT_KIND_INTERNAL + 1]; // The extent pages of each kind are taken from, or -1.
+	struct wal_log *wal; // The write-ahead log, or NULL if changes are not logged.
+	struct value_log *vlog; // The value log, or NULL if values are stored in the leaves.
+	struct append_hint *append_hint; // The rightmost leaf db_insert remembers, or NULL until the first insert.
+	struct upper_index *upper_index; // The internal pages, held in memory for descents.
+} tree_handle;
+
+
+typedef struct file_manager_stats {
+	int64_t header_reads;
+	int64_t header_writes;
+} file_manager_stats;
+
+
+// Page image accessors
+// These read fields straight from a page image pinned in the buffer pool, without decoding it into a page.
+static inline bool page_image_is_leaf(const char *image) {
+	return image[PAGE_IS_LEAF_OFFSET] != 0;
+}
+
+static inline int page_image_num_keys(const char *image) {
+	int num_keys;
+	memcpy(&num_keys, image + PAGE_NUM_KEYS_OFFSET, 4);
+	return num_keys;
+}
+
+static inline int64_t page_image_last_pgn(const char *image) {
+	int64_t pgn;
+	memcpy(&pgn, image + PAGE_LAST_PGN_OFFSET, 8);
+	return pgn;
+}
+
+static inline bool leaf_image_is_slotted(const char *image) {
+	return image[PAGE_LEAF_FORMAT_OFFSET] == LEAF_FORMAT_SLOTTED;
+}
+
+static inline bool leaf_image_is_prefixed(const char *image) {
+	return image[PAGE_LEAF_FORMAT_OFFSET] == LEAF_FORMAT_PREFIXED;
+}
+
+static inline bool leaf_image_has_value_log(const char *image) {
+	return image[PAGE_LEAF_FORMAT_OFFSET] == LEAF_FORMAT_VALUE_LOG;
+}
+
+static inline bool leaf_image_is_pax(const char *image) {
+	return image[PAGE_LEAF_FORMAT_OFFSET] == LEAF_FORMAT_PAX;
+}
+
+// The bytes from one key of a leaf image to the next. Every leaf format starts its entries with the key.
+static inline int leaf_image_key_stride(const char *image) {
+	if (leaf_image_is_slotted(image) || leaf_image_is_prefixed(image)) return SLOT_SIZE;
+	if (leaf_image_has_value_log(image)) return VALUE_LOG_LEAF_ENTRY_SIZE;
+	if (leaf_image_is_pax(image)) return 8;
+	return LEAF_ENTRY_SIZE;
+}
+
+static inline int64_t leaf_image_key(const char *image, int index) {
+	int64_t key;
+	memcpy(&key, image + PAGE_HEADER_SIZE + index * leaf_image_key_stride(image), 8);
+	return key;
+}
+
+// The index of `key` in a leaf image, or -1.
+static inline int leaf_image_find(const char *image, int64_t key) {
+	return find_key(image + PAGE_HEADER_SIZE, leaf_image_key_stride(image), page_image_num_keys(image), key);
+}
+
+// The index of `key` in the keys of a page struct, or -1.
+static inline int page_find_key(const page *p, int64_t key) {
+	return find_key((const char *)p->keys, 8, p->num_keys, key);
+}
+
+// Not for leaves of a value log tree or prefixed leaves, whose values are read with read_leaf_value().
+static inline const char *leaf_image_value(const char *image, int index) {
+	if (leaf_image_is_pax(image)) return image + PAX_VALUES_OFFSET + index * VALUE_SIZE;
+	if (!leaf_image_is_slotted(image)) return image + PAGE_HEADER_SIZE + index * LEAF_ENTRY_SIZE + 8;
+	uint16_t value_offset;
+	memcpy(&value_offset, image + PAGE_HEADER_SIZE + index * SLOT_SIZE + 8, 2);
+	return image + value_offset;
+}
+
+// Rebuild value `index` of a prefixed leaf in `buffer`, which holds value `index - 1` already unless `index` is 0.
+static inline void leaf_image_apply_suffix(const char *image, int index, char *buffer) {
+	const char *slot = image + PAGE_HEADER_SIZE + index * SLOT_SIZE;
+	uint16_t suffix_offset;
+	memcpy(&suffix_offset, slot + 8, 2);
+	memcpy(buffer + (unsigned char)slot[11], image + suffix_offset, (unsigned char)slot[10] + 1);
+}
+
+// The length of the prefix two values share.
+static inline int shared_prefix_length(const char *value1, const char *value2) {
+	int length = 0;
+	while (value1[length] != '\0' && value1[length] == value2[length]) length += 1;
+	return length;
+}
+
+static inline int64_t leaf_image_value_offset(const char *image, int index) {
+	int64_t value_offset;
+	memcpy(&value_offset, image + PAGE_HEADER_SIZE + index * VALUE_LOG_LEAF_ENTRY_SIZE + 8, 8);
+	return value_offset;
+}
+
+static inline void copy_record(record *dest, const record *src) {
+	strcpy(dest->value, src->value);
+	dest->value_offset = src->value_offset;
+}
+
+static inline int internal_image_key_width(const char *image) {
+	return (unsigned char)image[PAGE_KEY_WIDTH_OFFSET];
+}
+
+static inline int64_t internal_image_key(const char *image, int index) {
+	int64_t key;
+	int width = internal_image_key_width(image);
+	if (width == 0) {
+		memcpy(&key, image + PAGE_HEADER_SIZE + index * INTERNAL_ENTRY_SIZE, 8);
+		return key;
+	}
+	uint64_t delta = 0;
+	memcpy(&key, image + PAGE_KEY_BASE_OFFSET, 8);
+	memcpy(&delta, image + PAGE_HEADER_SIZE + index * width, width); // Little-endian, like the rest of the image.
+	return (int64_t)((uint64_t)key + delta);
+}
+
+static inline int64_t internal_image_child(const char *image, int index) {
+	// The rightmost child is kept in the page header instead of in an entry.
+	int num_keys = page_image_num_keys(image);
+	if (index == num_keys) return page_image_last_pgn(image);
+	int width = internal_image_key_width(image);
+	if (width == 0) {
+		int64_t pgn;
+		memcpy(&pgn, image + PAGE_HEADER_SIZE + index * INTERNAL_ENTRY_SIZE + 8, 8);
+		return pgn;
+	}
+	uint32_t pgn;
+	memcpy(&pgn, image + PAGE_HEADER_SIZE + num_keys * width + index * PACKED_CHILD_SIZE, PACKED_CHILD_SIZE);
+	return pgn;
+}
+
+// The delta width a packed internal page needs for keys from min_key to max_key.
+static inline int packed_key_width(int64_t min_key, int64_t max_key) {
+	uint64_t range = (uint64_t)max_key - (uint64_t)min_key;
+	if (range <= UINT16_MAX) return 2;
+	if (range <= UINT32_MAX) return 4;
+	return 8;
+}
+
+// Whether `num_keys` keys from min_key to max_key and their children fit in a packed internal page.
+static inline bool packed_keys_fit(int num_keys, int64_t min_key, int64_t max_key) {
+	if (num_keys <= MAX_WIDE_PACKED_KEYS) return true;
+	return num_keys <= MAX_PAGE_KEYS && num_keys * (packed_key_width(min_key, max_key) + PACKED_CHILD_SIZE) <= PACKED_INTERNAL_SPACE;
+}
+
+
 // APIs
 /**
  * @brief Open a database file or create a new one if it doesn't exist.
@@ -75,10 +380,67 @@ typedef struct header_page {
  */
 int open_or_create_tree(const char *file_path, int leaf_order, int internal_order);
 
+/**
+ * @brief Open a database file or create a new one if it doesn't exist, with the given options.
+ * @param file_path[in] The path to the database file.
+ * @param leaf_order[in] The leaf order of the B+ tree.
+ * @param internal_order[in] The internal order of the B+ tree.
+ * @param options[in] The options of this open. NULL for the defaults.
+ * @return The file descriptor of the database file. Return -1 if failed.
+ *
+ * A log left behind by a crash is replayed before an existing file is opened, whatever the options.
+ */
+int open_or_create_tree1(const char *file_path, int leaf_order, int internal_order, const tree_options *options);
+
+/**
+ * @brief Close a database file opened with `open_or_create_tree()`.
+ * @param fd[in] The file descriptor of the database file.
+ *
+ * Dirty pages of the file are written back and dropped from the buffer pool before the
+ * descriptor is closed, so that a later file reusing the descriptor never sees them.
+ */
+void close_tree(int fd);
+
+/**
+ * @brief Drop an open database file as if the process had crashed, for recovery tests.
+ * @param fd[in] The file descriptor of the database file.
+ * @param torn[in] Cut the last writes of its write-ahead log and value log in half.
+ *
+ * Cached pages, the cached header, and log records and values still in memory are lost. Opening the
+ * file again recovers it from its log, if it has one.
+ */
+void crash_tree(int fd, bool torn);
+
+/**
+ * @brief Write back the cached header page and every dirty page of a database file, and sync it.
+ * @param fd[in] The file descriptor of the database file.
+ *
+ * For a tree with a write-ahead log this is a checkpoint, which empties the log as well.
+ */
+void sync_tree(int fd);
+
+/**
+ * @brief Get the I/O counters of the file manager.
+ * @param stats[out] The destination to store the counters.
+ */
+void get_file_manager_stats(file_manager_stats *stats);
+
+/**
+ * @brief Tell the file manager that a scan along the leaf chain starts or ends.
+ * @param fd[in] The file descriptor of the database file.
+ * @param sequential[in] True when a scan starts, false when it ends.
+ *
+ * While a scan is in progress, mapped windows of an mmap tree are advised with MADV_SEQUENTIAL,
+ * and the file of any other tree with POSIX_FADV_SEQUENTIAL.
+ */
+void advise_sequential_scan(int fd, bool sequential);
+
 /**
  * @brief Load the header page from the database file.
  * @param fd[in] The file descriptor of the database file.
  * @param dest[out] The destination to store the header page.
+ *
+ * The header of an open tree is read once when it is opened and served from memory afterwards.
  */
 void load_header_page(int fd, header_page* dest);
 
@@ -86,14 +448,31 @@ void load_header_page(int fd, header_page* dest);
  * @brief Write the header page to the database file.
  * @param fd[in] The file descriptor of the database file.
  * @param src[in] The header page to write.
+ *
+ * For an open tree only the cached copy is updated and marked dirty. It is written to the file on
+ * `close_tree()`, on `sync_tree()`, or every `header_flush_interval` writes if that option is set.
+ * A tree with a write-ahead log writes it only at checkpoints, since the log holds the changes until then.
  */
 void write_header_page(int fd, const header_page* src);
 
+/**
+ * @brief Allocate a page struct whose arrays are sized to the orders of a tree.
+ * @param fd[in] The file descriptor of the database file.
+ * @return The page struct, which the caller frees with free(). Its fields are not initialized.
+ *
+ * Packed, slotted and value log trees record larger orders than the others, so only their pages get room
+ * for the keys and records their pages hold. The arrays follow the struct in the same allocation.
+ * If memory allocation fails, then kill the process using the `exit_with_err_msg()` function.
+ */
+page *alloc_page_struct(int fd);
+
 /**
  * @brief Load a page from the database file.
  * @param fd[in] The file descriptor of the database file.
  * @param pgn[in] The page number of the page to load.
  * @param dest[out] The destination to store the page.
+ *
+ * The page image is taken from the buffer pool, and read from the file only on a miss.
  */
 void load_page(int fd, int64_t pgn, page* dest);
 
@@ -101,9 +480,23 @@ void load_page(int fd, int64_t pgn, page* dest);
  * @brief Write a page to the database file.
  * @param fd[in] The file descriptor of the database file.
  * @param src[in] The page to write. Return NULL if failed.
+ *
+ * The page image is stored in the buffer pool and marked dirty. It reaches the file when its frame
+ * is evicted or when the file is flushed or closed.
  */
 void write_page(int fd, const page* src);
 
+/**
+ * @brief Find the child of a pinned internal page image to descend into for a key.
+ * @param image[in] The internal page image.
+ * @param key[in] The key to search for.
+ * @return The index of the child, which is the number of keys of the page not greater than `key`.
+ *
+ * The keys of a page that is not packed are searched with `search_keys()`, and the deltas of a packed page
+ * with `search_deltas()` against the delta of `key`, without decoding them.
+ */
+int internal_image_search(const char *image, int64_t key);
+
 /**
  * @brief Allocate a new page.
  * @param fd[in] The file descriptor of the database file.
@@ -125,6 +518,73 @@ page *alloc_page(int fd);
  */
 page *alloc_page1(int fd, header_page* header);
 
+/**
+ * @brief Allocate a new leaf or internal page, placing it after `near_pgn` when possible.
+ * @param fd[in] The file descriptor of the database file.
+ * @param header[in] The header page. Updated and written back.
+ * @param is_leaf[in] Whether the new page will be a leaf page.
+ * @param near_pgn[in] The page the new page should follow, such as the left sibling of a new leaf, or -1.
+ * @return The new page.
+ *
+ * With HEADER_FLAG_LEAF_EXTENTS, leaves and internal pages are taken from separate extents, and the
+ * first free page after `near_pgn` in its extent is used first, so split leaves stay next to their
+ * left siblings. Other files fall back to alloc_page1.
+ */
+page *alloc_page_near(int fd, header_page *header, bool is_leaf, int64_t near_pgn);
+
+/**
+ * @brief Allocate `count` pages with contiguous page numbers.
+ * @param fd[in] The file descriptor of the database file.
+ * @param header[in] The header page. Updated and written back.
+ * @param count[in] The number of pages. Between 1 and BITMAP_GROUP_PAGES - 2.
+ * @return The page number of the first allocated page.
+ *
+ * Free runs below the high-water mark are reused first. Otherwise the run is taken at the
+ * high-water mark, and the file grows with fallocate (or ftruncate) when it passes num_pages.
+ * Fresh pages are not touched, so the allocation itself does no page I/O. Files that still use
+ * the linked free list can only allocate one page at a time. Runs ignore extent kinds.
+ */
+int64_t alloc_pages(int fd, header_page *header, int count);
+
+/**
+ * @brief Allocate a page below `limit_pgn`, e.g. to move a page towards the front of the file.
+ * @param fd[in] The file descriptor of the database file.
+ * @param header[in] The header page. Updated and written back.
+ * @param is_leaf[in] Whether the page will be a leaf page.
+ * @param limit_pgn[in] The allocated page number must be lower than this.
+ * @return The allocated page number, or -1 if there is no such free page. The file never grows.
+ *
+ * Only for files with HEADER_FLAG_BITMAP_SPACE. With extents, the page is taken from an extent of
+ * the right kind, or from an empty extent, that lies wholly below `limit_pgn`.
+ */
+int64_t alloc_page_below(int fd, header_page *header, bool is_leaf, int64_t limit_pgn);
+
+/**
+ * @brief Lower the high-water mark to just past the last allocated page and truncate the file there.
+ * @param fd[in] The file descriptor of the database file.
+ * @param header[in] The header page. Updated and written back.
+ *
+ * Does nothing for files that still use the linked free list. Cached images of the cut pages are
+ * discarded, and a group left with only its metadata pages is dropped as a whole.
+ */
+void shrink_tree_file(int fd, header_page *header);
+
+/**
+ * @brief Return the last allocated page that is not a space metadata page of a group after the first.
+ * @param fd[in] The file descriptor of the database file.
+ * @param header[in] The header page. Must use HEADER_FLAG_BITMAP_SPACE.
+ * @return The page number. The metadata pages of the first group are never free, so there always is one.
+ */
+int64_t find_last_used_page(int fd, const header_page *header);
+
+/**
+ * @brief Check whether a page is the header page, or a bitmap or extent map page of its group.
+ * @param header[in] The header page.
+ * @param pgn[in] The page number.
+ * @return Whether the page holds file metadata rather than tree nodes.
+ */
+bool is_space_metadata_page(const header_page *header, int64_t pgn);
+
 /**
  * @brief Free a page.
  * @param fd[in] The file descriptor of the database file.
@@ -134,6 +594,35 @@ void free_page(int fd, int64_t pgn);
 
 
 // Helper functions
+void flush_header_page(int fd);
+void read_header_image(int fd, header_page* dest);
+void write_header_image(int fd, const header_page* src);
+void decode_header_image(const char *buffer, header_page *dest);
+void encode_header_image(const header_page *src, char *buffer);
+tree_handle *get_tree_handle(int fd);
+void register_tree_handle(int fd, const char *file_path, const tree_options *options);
+void unregister_tree_handle(int fd);
+char *pin_mapped_page(int fd, int64_t pgn);
+bool unpin_mapped_page(int fd, int64_t pgn);
+void extend_tree_file(int fd, int64_t num_pages);
+int open_tree_file(const char *file_path, int flags, bool direct_io);
+bool retry_without_direct_io(int fd);
+int64_t pop_free_list(int fd, header_page *header);
+int64_t find_free_run(int fd, header_page *header, int count);
+int64_t advance_high_water(int fd, header_page *header, int count);
+int64_t init_group_pages(int fd, const header_page *header, int64_t bitmap_pgn);
+int64_t alloc_extent_page(int fd, header_page *header, int kind, int64_t near_pgn);
+int64_t find_free_page_in_extent(int fd, int64_t extent_pgn, int64_t from_pgn);
+int64_t claim_extent(int fd, header_page *header, int kind);
+int64_t find_extent(int fd, header_page *header, int kind, int64_t limit_pgn);
+void set_extent_kind(int fd, int64_t extent_pgn, int kind);
+void mark_pages(int fd, int64_t first_pgn, int count, bool used);
+uint64_t extent_used_bits(const char *bitmap, int64_t offset_in_group);
+int64_t bitmap_pgn_of(int64_t pgn);
+void decode_packed_keys(const char *deltas, int width, int64_t base, int64_t *keys, int num_keys);
+void read_page_image(int fd, int64_t pgn, char *dest);
+void write_page_image(int fd, int64_t pgn, const char *src);
+void write_page_images(int fd, int64_t first_pgn, const char *const *srcs, int count);
 void exit_with_err_msg(const char* err_msg);
 
 #endif /* __FILE_MANAGER_H__ */
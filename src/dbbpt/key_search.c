@@ -0,0 +1,283 @@
+#include "key_search.h"
+
+#include <string.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_X86_KERNELS 1
+#endif
+
+
+// GLOBALS.
+key_search_fn key_search = resolve_key_search; // Picks the kernel on the first search.
+delta_search_fn delta_search = resolve_delta_search;
+key_search_kernel active_kernel = KEY_SEARCH_KERNELS;
+const key_search_fn key_search_kernels[KEY_SEARCH_KERNELS] = {
+	search_keys_linear, search_keys_branchless, search_keys_sse42, search_keys_avx2,
+};
+const delta_search_fn delta_search_kernels[KEY_SEARCH_KERNELS] = {
+	search_deltas_linear, search_deltas_branchless, search_deltas_sse42, search_deltas_avx2,
+};
+
+
+static inline int64_t load_key(const char *keys, int stride, int index) {
+	int64_t key;
+	memcpy(&key, keys + (int64_t)index * stride, 8);
+	return key;
+}
+
+static inline uint64_t load_delta(const char *deltas, int width, int index) {
+	// One constant-size load per width, so that the compiler does not call memcpy() for a variable size.
+	if (width == 2) {
+		uint16_t delta;
+		memcpy(&delta, deltas + (int64_t)index * 2, 2);
+		return delta;
+	}
+	if (width == 4) {
+		uint32_t delta;
+		memcpy(&delta, deltas + (int64_t)index * 4, 4);
+		return delta;
+	}
+	uint64_t delta;
+	memcpy(&delta, deltas + (int64_t)index * 8, 8);
+	return delta;
+}
+
+int search_keys(const char *keys, int stride, int num_keys, int64_t key) {
+	return key_search(keys, stride, num_keys, key);
+}
+
+int find_key(const char *keys, int stride, int num_keys, int64_t key) {
+	int index = key_search(keys, stride, num_keys, key) - 1;
+	return index >= 0 && load_key(keys, stride, index) == key ? index : -1;
+}
+
+int count_keys_below(const char *keys, int stride, int num_keys, int64_t key) {
+	if (key == INT64_MIN) return 0;
+	return key_search(keys, stride, num_keys, key - 1);
+}
+
+int search_deltas(const char *deltas, int width, int num_deltas, uint64_t target) {
+	if (width < 8 && (target >> (width * 8)) != 0) return num_deltas;
+	return delta_search(deltas, width, num_deltas, target);
+}
+
+bool select_key_search_kernel(key_search_kernel kernel) {
+	if (!key_search_kernel_supported(kernel)) return false;
+	active_kernel = kernel;
+	key_search = key_search_kernels[kernel];
+	delta_search = delta_search_kernels[kernel];
+	return true;
+}
+
+bool key_search_kernel_supported(key_search_kernel kernel) {
+	if (kernel < 0 || kernel >= KEY_SEARCH_KERNELS) return false;
+	if (kernel != KEY_SEARCH_SSE42 && kernel != KEY_SEARCH_AVX2) return true;
+#ifdef HAVE_X86_KERNELS
+	__builtin_cpu_init();
+	return kernel == KEY_SEARCH_AVX2 ? __builtin_cpu_supports("avx2") : __builtin_cpu_supports("sse4.2");
+#else
+	return false;
+#endif
+}
+
+key_search_kernel get_key_search_kernel(void) {
+	if (active_kernel == KEY_SEARCH_KERNELS) resolve_key_search(NULL, 8, 0, 0);
+	return active_kernel;
+}
+
+const char *get_key_search_kernel_name(key_search_kernel kernel) {
+	switch (kernel) {
+		case KEY_SEARCH_LINEAR: return "linear";
+		case KEY_SEARCH_BRANCHLESS: return "branchless";
+		case KEY_SEARCH_SSE42: return "sse4.2";
+		case KEY_SEARCH_AVX2: return "avx2";
+		default: return "none";
+	}
+}
+
+// Helper functions
+int resolve_key_search(const char *keys, int stride, int num_keys, int64_t key) {
+	if (!select_key_search_kernel(KEY_SEARCH_AVX2) && !select_key_search_kernel(KEY_SEARCH_SSE42)) {
+		select_key_search_kernel(KEY_SEARCH_BRANCHLESS);
+	}
+	return key_search(keys, stride, num_keys, key);
+}
+
+int resolve_delta_search(const char *deltas, int width, int num_deltas, uint64_t target) {
+	resolve_key_search(NULL, 8, 0, 0);
+	return delta_search(deltas, width, num_deltas, target);
+}
+
+int search_keys_linear(const char *keys, int stride, int num_keys, int64_t key) {
+	int index = 0;
+	while (index < num_keys && load_key(keys, stride, index) <= key) index += 1;
+	return index;
+}
+
+int search_keys_branchless(const char *keys, int stride, int num_keys, int64_t key) {
+	if (num_keys == 0) return 0;
+	int base = narrow_key_range(keys, stride, &num_keys, key, 1);
+	return base + (load_key(keys, stride, base) <= key);
+}
+
+int narrow_key_range(const char *keys, int stride, int *num_keys, int64_t key, int window) {
+	// The answer stays within [base, base + n]. Each step keeps the half it is in, and the choice is a
+	// conditional move, so that random keys do not mispredict a branch at every level.
+	int base = 0;
+	int n = *num_keys;
+	while (n > window) {
+		int half = n / 2;
+		base = load_key(keys, stride, base + half) <= key ? base + half : base;
+		n -= half;
+	}
+	*num_keys = n;
+	return base;
+}
+
+int search_deltas_linear(const char *deltas, int width, int num_deltas, uint64_t target) {
+	int index = 0;
+	while (index < num_deltas && load_delta(deltas, width, index) <= target) index += 1;
+	return index;
+}
+
+int search_deltas_branchless(const char *deltas, int width, int num_deltas, uint64_t target) {
+	if (num_deltas == 0) return 0;
+	int base = narrow_delta_range(deltas, width, &num_deltas, target, 1);
+	return base + (load_delta(deltas, width, base) <= target);
+}
+
+int narrow_delta_range(const char *deltas, int width, int *num_deltas, uint64_t target, int window) {
+	// As narrow_key_range(), with an unsigned compare.
+	int base = 0;
+	int n = *num_deltas;
+	while (n > window) {
+		int half = n / 2;
+		base = load_delta(deltas, width, base + half) <= target ? base + half : base;
+		n -= half;
+	}
+	*num_deltas = n;
+	return base;
+}
+
+#ifdef HAVE_X86_KERNELS
+__attribute__((target("sse4.2")))
+int search_keys_sse42(const char *keys, int stride, int num_keys, int64_t key) {
+	if (stride != 8) return search_keys_branchless(keys, stride, num_keys, key);
+	int base = narrow_key_range(keys, stride, &num_keys, key, KEY_SEARCH_SIMD_WINDOW);
+
+	// The keys are sorted, so the first lane greater than `key` is the answer.
+	const char *window = keys + (int64_t)base * 8;
+	__m128i targets = _mm_set1_epi64x(key);
+	int index = 0;
+	for (; index + 2 <= num_keys; index += 2) {
+		__m128i chunk = _mm_loadu_si128((const __m128i *)(window + index * 8));
+		int mask = _mm_movemask_pd(_mm_castsi128_pd(_mm_cmpgt_epi64(chunk, targets)));
+		if (mask != 0) return base + index + __builtin_ctz(mask);
+	}
+	if (index < num_keys && load_key(window, 8, index) <= key) index += 1;
+	return base + index;
+}
+
+__attribute__((target("avx2")))
+int search_keys_avx2(const char *keys, int stride, int num_keys, int64_t key) {
+	if (stride != 8) return search_keys_branchless(keys, stride, num_keys, key);
+	int base = narrow_key_range(keys, stride, &num_keys, key, KEY_SEARCH_SIMD_WINDOW);
+
+	const char *window = keys + (int64_t)base * 8;
+	__m256i targets = _mm256_set1_epi64x(key);
+	int index = 0;
+	for (; index + 4 <= num_keys; index += 4) {
+		__m256i chunk = _mm256_loadu_si256((const __m256i *)(window + index * 8));
+		int mask = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(chunk, targets)));
+		if (mask != 0) return base + index + __builtin_ctz(mask);
+	}
+	while (index < num_keys && load_key(window, 8, index) <= key) index += 1;
+	return base + index;
+}
+
+// SSE and AVX2 only compare signed integers. Flipping the sign bits of both sides makes the compare unsigned,
+// and 16-bit deltas use a saturating subtraction instead, which is zero exactly where delta <= target.
+__attribute__((target("sse4.2")))
+int search_deltas_sse42(const char *deltas, int width, int num_deltas, uint64_t target) {
+	int base = narrow_delta_range(deltas, width, &num_deltas, target, KEY_SEARCH_SIMD_WINDOW);
+
+	const char *window = deltas + (int64_t)base * width;
+	int index = 0;
+	if (width == 2) {
+		__m128i targets = _mm_set1_epi16((short)target);
+		for (; index + 8 <= num_deltas; index += 8) {
+			__m128i chunk = _mm_loadu_si128((const __m128i *)(window + index * 2));
+			int mask = _mm_movemask_epi8(_mm_cmpeq_epi16(_mm_subs_epu16(chunk, targets), _mm_setzero_si128()));
+			if (mask != 0xFFFF) return base + index + __builtin_popcount(mask) / 2;
+		}
+	} else if (width == 4) {
+		__m128i sign = _mm_set1_epi32((int)0x80000000U);
+		__m128i targets = _mm_xor_si128(_mm_set1_epi32((int)(uint32_t)target), sign);
+		for (; index + 4 <= num_deltas; index += 4) {
+			__m128i chunk = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(window + index * 4)), sign);
+			int mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(chunk, targets)));
+			if (mask != 0) return base + index + __builtin_ctz(mask);
+		}
+	} else {
+		__m128i sign = _mm_set1_epi64x(INT64_MIN);
+		__m128i targets = _mm_xor_si128(_mm_set1_epi64x((int64_t)target), sign);
+		for (; index + 2 <= num_deltas; index += 2) {
+			__m128i chunk = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(window + index * 8)), sign);
+			int mask = _mm_movemask_pd(_mm_castsi128_pd(_mm_cmpgt_epi64(chunk, targets)));
+			if (mask != 0) return base + index + __builtin_ctz(mask);
+		}
+	}
+	while (index < num_deltas && load_delta(window, width, index) <= target) index += 1;
+	return base + index;
+}
+
+__attribute__((target("avx2")))
+int search_deltas_avx2(const char *deltas, int width, int num_deltas, uint64_t target) {
+	int base = narrow_delta_range(deltas, width, &num_deltas, target, KEY_SEARCH_SIMD_WINDOW);
+
+	const char *window = deltas + (int64_t)base * width;
+	int index = 0;
+	if (width == 2) {
+		__m256i targets = _mm256_set1_epi16((short)target);
+		for (; index + 16 <= num_deltas; index += 16) {
+			__m256i chunk = _mm256_loadu_si256((const __m256i *)(window + index * 2));
+			unsigned int mask = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi16(_mm256_subs_epu16(chunk, targets), _mm256_setzero_si256()));
+			if (mask != 0xFFFFFFFFU) return base + index + __builtin_popcount(mask) / 2;
+		}
+	} else if (width == 4) {
+		__m256i sign = _mm256_set1_epi32((int)0x80000000U);
+		__m256i targets = _mm256_xor_si256(_mm256_set1_epi32((int)(uint32_t)target), sign);
+		for (; index + 8 <= num_deltas; index += 8) {
+			__m256i chunk = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(window + index * 4)), sign);
+			int mask = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(chunk, targets)));
+			if (mask != 0) return base + index + __builtin_ctz(mask);
+		}
+	} else {
+		__m256i sign = _mm256_set1_epi64x(INT64_MIN);
+		__m256i targets = _mm256_xor_si256(_mm256_set1_epi64x((int64_t)target), sign);
+		for (; index + 4 <= num_deltas; index += 4) {
+			__m256i chunk = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(window + index * 8)), sign);
+			int mask = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(chunk, targets)));
+			if (mask != 0) return base + index + __builtin_ctz(mask);
+		}
+	}
+	while (index < num_deltas && load_delta(window, width, index) <= target) index += 1;
+	return base + index;
+}
+#else
+int search_keys_sse42(const char *keys, int stride, int num_keys, int64_t key) {
+	return search_keys_branchless(keys, stride, num_keys, key);
+}
+
+int search_keys_avx2(const char *keys, int stride, int num_keys, int64_t key) {
+	return search_keys_branchless(keys, stride, num_keys, key);
+}
+
+int search_deltas_sse42(const char *deltas, int width, int num_deltas, uint64_t target) {
+	return search_deltas_branchless(deltas, width, num_deltas, target);
+}
+
+int search_deltas_avx2(const char *deltas, int width, int num_deltas, uint64_t target) {
+	return search_deltas_branchless(deltas, width, num_deltas, target);
+}
+#endif
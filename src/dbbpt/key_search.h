@@ -0,0 +1,113 @@
+#ifndef __KEY_SEARCH_H__
+#define __KEY_SEARCH_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#ifdef _WIN32
+#define bool char
+#define false 0
+#define true 1
+#endif
+
+
+// Constants
+#define KEY_SEARCH_SIMD_WINDOW 16 // Keys left by the binary search for the SIMD kernels to compare at once.
+
+
+// Structures
+typedef enum key_search_kernel {
+	KEY_SEARCH_LINEAR, // One key at a time from the front, as the page code used to search.
+	KEY_SEARCH_BRANCHLESS, // Binary search whose halving step is a conditional move instead of a branch.
+	KEY_SEARCH_SSE42, // Branchless down to KEY_SEARCH_SIMD_WINDOW keys, then 2 keys, or 8, 4 or 2 deltas, per compare.
+	KEY_SEARCH_AVX2, // Branchless down to KEY_SEARCH_SIMD_WINDOW keys, then 4 keys, or 16, 8 or 4 deltas, per compare.
+	KEY_SEARCH_KERNELS, // The number of kernels.
+} key_search_kernel;
+
+typedef int (*key_search_fn)(const char *keys, int stride, int num_keys, int64_t key);
+typedef int (*delta_search_fn)(const char *deltas, int width, int num_deltas, uint64_t target);
+
+
+// APIs
+/**
+ * @brief Count the keys of a sorted array that are not greater than `key`.
+ * @param keys[in] The first key. Keys are 8-byte integers `stride` bytes apart, and need not be aligned.
+ * @param stride[in] The bytes from one key to the next, e.g. 8 for the keys of a page struct or of a PAX leaf.
+ * @param num_keys[in] The number of keys.
+ * @param key[in] The key to search for.
+ * @return The index of the first key greater than `key`, or `num_keys`. For an internal page this is the
+ * child to descend into.
+ *
+ * The fastest kernel the CPU supports is picked on the first call. The SIMD kernels only apply to keys
+ * stored back to back. Keys that are interleaved with other fields are searched by the branchless kernel.
+ */
+int search_keys(const char *keys, int stride, int num_keys, int64_t key);
+
+/**
+ * @brief Find a key in a sorted array.
+ * @return The index of the key, or -1 if it is not in the array. The other parameters are those of `search_keys()`.
+ */
+int find_key(const char *keys, int stride, int num_keys, int64_t key);
+
+/**
+ * @brief Count the keys of a sorted array that are less than `key`, i.e. the index a new `key` is inserted at.
+ * @return The number of keys less than `key`. The other parameters are those of `search_keys()`.
+ */
+int count_keys_below(const char *keys, int stride, int num_keys, int64_t key);
+
+/**
+ * @brief Count the deltas of a sorted array that are not greater than `target`.
+ * @param deltas[in] The first delta. Deltas are unsigned little-endian integers of `width` bytes, stored back
+ * to back, as in a packed internal page.
+ * @param width[in] The bytes of a delta: 2, 4 or 8.
+ * @param num_deltas[in] The number of deltas.
+ * @param target[in] The delta to search for. It may be too large for `width` bytes, and is then above every delta.
+ * @return The index of the first delta greater than `target`, or `num_deltas`.
+ *
+ * The same kernel as `search_keys()` is used, with unsigned compares. All widths are stored back to back,
+ * so the SIMD kernels always apply.
+ */
+int search_deltas(const char *deltas, int width, int num_deltas, uint64_t target);
+
+/**
+ * @brief Make `search_keys()` and `search_deltas()` use the given kernel, e.g. to compare kernels in a benchmark.
+ * @param kernel[in] The kernel to use.
+ * @return false if the CPU does not support the kernel. The kernel in use does not change then.
+ */
+bool select_key_search_kernel(key_search_kernel kernel);
+
+/**
+ * @brief Check whether the CPU supports a kernel.
+ * @param kernel[in] The kernel to check.
+ * @return Whether the kernel can be selected.
+ */
+bool key_search_kernel_supported(key_search_kernel kernel);
+
+/**
+ * @brief Get the kernel `search_keys()` uses, picking it if no search was made yet.
+ * @return The kernel in use.
+ */
+key_search_kernel get_key_search_kernel(void);
+
+/**
+ * @brief Get the name of a kernel, for statistics.
+ * @param kernel[in] The kernel.
+ * @return "linear", "branchless", "sse4.2" or "avx2".
+ */
+const char *get_key_search_kernel_name(key_search_kernel kernel);
+
+
+// Helper functions
+int resolve_key_search(const char *keys, int stride, int num_keys, int64_t key);
+int search_keys_linear(const char *keys, int stride, int num_keys, int64_t key);
+int search_keys_branchless(const char *keys, int stride, int num_keys, int64_t key);
+int search_keys_sse42(const char *keys, int stride, int num_keys, int64_t key);
+int search_keys_avx2(const char *keys, int stride, int num_keys, int64_t key);
+int narrow_key_range(const char *keys, int stride, int *num_keys, int64_t key, int window);
+int resolve_delta_search(const char *deltas, int width, int num_deltas, uint64_t target);
+int search_deltas_linear(const char *deltas, int width, int num_deltas, uint64_t target);
+int search_deltas_branchless(const char *deltas, int width, int num_deltas, uint64_t target);
+int search_deltas_sse42(const char *deltas, int width, int num_deltas, uint64_t target);
+int search_deltas_avx2(const char *deltas, int width, int num_deltas, uint64_t target);
+int narrow_delta_range(const char *deltas, int width, int *num_deltas, uint64_t target, int window);
+
+#endif /* __KEY_SEARCH_H__ */
@@ -1,4 +1,10 @@
 #include "file_manager.h"
+#include "buffer_pool.h"
+#include "async_io.h"
+#include "wal.h"
+#include "value_log.h"
+#include "key_search.h"
+#include "upper_index.h"
 #include "dbbpt.h"
 
 #include <string.h>
@@ -32,11 +38,15 @@ typedef struct  int_pair_queue {
 // Command processing functions
 void process_command(char* command_line, bool need_echo, bool need_response, bool need_help);
 void process_commands(FILE* stream, bool need_echo, bool need_response);
+void parse_tree_options(const char* command_line, tree_options* options);
+void run_online_compaction(bool need_response);
 
 // Printing tree functions
 void print_tree(int fd);
 void print_leaves(int fd);
 void find_and_print(int fd, int64_t key, bool verbose);
+void print_stats(int fd);
+void print_tree_stats(int fd);
 
 // Utility functions.
 int_pair *make_int_pair(int first, int second);
@@ -53,12 +63,14 @@ void usage_2(void);
 int_pair_queue print_queue = { NULL, NULL };
 bool verbose_output = false;
 int tree_fd = -1;
+bool online_compaction = false; // Whether pages are being moved towards the front between commands.
 
 
 // MAIN.
 int main(int argc, char ** argv) {
 	verbose_output = false;
 	tree_fd = -1;
+	init_buffer_pool(argc > 1 ? atoi(argv[1]) : DEFAULT_BUFFER_POOL_FRAMES);
 
 	license_notice();
 	usage_1();
@@ -91,7 +103,9 @@ int main(int argc, char ** argv) {
 			continue;
 		}
 		process_command(buffer, false, true, true);
+		run_online_compaction(true);
 	}
+	if (tree_fd != -1) close_tree(tree_fd);
 	printf("\n");
 
 	return EXIT_SUCCESS;
@@ -110,6 +124,30 @@ void process_commands(FILE* stream, bool need_echo, bool need_response) {
 			buffer[len + 1] = '\0';
 		}
 		process_command(buffer, need_echo, need_response, false);
+		run_online_compaction(need_response);
+	}
+}
+
+void parse_tree_options(const char* command_line, tree_options* options) {
+	memset(options, 0, sizeof(tree_options));
+
+	// Options are the words after the path of an 'o' command, in any order after the optional orders.
+	char word[64];
+	int offset = 0;
+	int consumed = 0;
+	for (int i = 0; sscanf(command_line + offset, "%63s%n", word, &consumed) == 1; i++) {
+		offset += consumed;
+		if (i < 2) continue;
+		if (strcmp(word, "mmap") == 0) options->use_mmap = true;
+		if (strcmp(word, "direct") == 0) options->use_direct_io = true;
+		if (strcmp(word, "slotted") == 0) options->slotted_leaves = true;
+		if (strcmp(word, "vlog") == 0) options->value_log = true;
+		if (strcmp(word, "prefix") == 0) options->prefixed_values = true;
+		if (strcmp(word, "packed") == 0) options->packed_keys = true;
+		if (strcmp(word, "pax") == 0) options->pax_leaves = true;
+		sscanf(word, "header_flush=%d", &(options->header_flush_interval));
+		if (strcmp(word, "wal") == 0) options->wal_group_commit = WAL_DEFAULT_GROUP_COMMIT;
+		if (sscanf(word, "wal=%d", &(options->wal_group_commit)) == 1 && options->wal_group_commit < 1) options->wal_group_commit = 1;
 	}
 }
 
@@ -133,7 +171,9 @@ void process_command(char* command_line, bool need_echo, bool need_response, boo
 		int internal_order = DEFAULT_INTERNAL_ORDER;
 		int count = sscanf(command_line, "o %s %d %d", filepath, &leaf_order, &internal_order);
 		if (count >= 1) {
-			tree_fd = open_or_create_tree(filepath, leaf_order, internal_order);
+			tree_options options;
+			parse_tree_options(command_line, &options);
+			tree_fd = open_or_create_tree1(filepath, leaf_order, internal_order, &options);
 			if (need_response && tree_fd != -1) printf("File '%s' opened.\n", filepath);
 		} else if (need_help) {
 			usage_2();
@@ -143,8 +183,9 @@ void process_command(char* command_line, bool need_echo, bool need_response, boo
 
 	if (instruction == 'c') {
 		if (tree_fd != -1) {
-			close(tree_fd);
+			close_tree(tree_fd);
 			tree_fd = -1;
+			online_compaction = false;
 			if (need_response) printf("Database file closed.\n");
 		} else {
 			if (need_response) printf("No database file is open.\n");
@@ -161,8 +202,13 @@ void process_command(char* command_line, bool need_echo, bool need_response, boo
 		char filepath1[256] = {0};
 		char filepath2[256] = {0};
 		char output_filepath[256] = {0};
-		int count = sscanf(command_line, "j %s %s %s", filepath1, filepath2, output_filepath);
-		if (count == 3) {
+		int64_t delta = 0;
+		int count = sscanf(command_line, "j %s %s %s %ld", filepath1, filepath2, output_filepath, &delta);
+		if (count >= 3) {
+			if (count == 4 && delta < 0) {
+				if (need_response) printf("Error: The band width must not be negative.\n");
+				return;
+			}
 			int fd1 = open_or_create_tree(filepath1, DEFAULT_LEAF_ORDER, DEFAULT_INTERNAL_ORDER);
 			if (fd1 == -1) {
 				if (need_response) printf("Error: Could not open file '%s'.\n", filepath1);
@@ -172,19 +218,216 @@ void process_command(char* command_line, bool need_echo, bool need_response, boo
 			int fd2 = open_or_create_tree(filepath2, DEFAULT_LEAF_ORDER, DEFAULT_INTERNAL_ORDER);
 			if (fd2 == -1) {
 				if (need_response) printf("Error: Could not open file '%s'.\n", filepath2);
-				close(fd1);
+				close_tree(fd1);
 				return;
 			}
-			db_join(fd1, fd2, output_filepath);
-			close(fd1);
-			close(fd2);
+			band_window_stats stats;
+			if (count == 4) db_join_band(fd1, fd2, delta, output_filepath, &stats);
+			else db_join(fd1, fd2, output_filepath);
+			close_tree(fd1);
+			close_tree(fd2);
 			if (need_response) printf("Files '%s' and '%s' joined into '%s'.\n", filepath1, filepath2, output_filepath);
+			if (need_response && count == 4) {
+				printf("Band window: peak %d of %d entries (%ld of %ld bytes), %ld overflow rescans.\n",
+						stats.peak_entries, stats.capacity, stats.peak_bytes, stats.allocated_bytes, stats.overflow_scans);
+			}
+		} else if (need_help) {
+			usage_2();
+		}
+		return;
+	}
+
+	if (instruction == 'm') {
+		if (tree_fd != -1) {
+			if (need_response) printf("A database file is already open. Please close it first with 'c'.\n");
+			return;
+		}
+
+		char job_filepath[256] = {0};
+		if (sscanf(command_line, "m %s", job_filepath) == 1) {
+			FILE *job_fp = fopen(job_filepath, "r");
+			if (job_fp == NULL) {
+				if (need_response) printf("Error: Could not open job file '%s'.\n", job_filepath);
+				return;
+			}
+
+			int num_jobs = 0;
+			int capacity = 16;
+			join_job *jobs = (join_job *)malloc(capacity * sizeof(join_job));
+			if (jobs == NULL) exit_with_err_msg("Error on allocating join jobs.");
+
+			char job_line[BUFFER_SIZE];
+			while (fgets(job_line, BUFFER_SIZE, job_fp) != NULL) {
+				if (num_jobs == capacity) {
+					capacity *= 2;
+					jobs = (join_job *)realloc(jobs, capacity * sizeof(join_job));
+					if (jobs == NULL) exit_with_err_msg("Error on allocating join jobs.");
+				}
+				join_job *job = &jobs[num_jobs];
+				if (sscanf(job_line, " j %255s %255s %255s", job->tree_path1, job->tree_path2, job->output_path) == 3) {
+					num_jobs += 1;
+				}
+			}
+			fclose(job_fp);
+
+			db_join_many(jobs, num_jobs);
+			free(jobs);
+			if (need_response) printf("%d join jobs in '%s' finished.\n", num_jobs, job_filepath);
+		} else if (need_help) {
+			usage_2();
+		}
+		return;
+	}
+
+	if (instruction == 'r') {
+		if (tree_fd != -1) {
+			if (need_response) printf("A database file is already open. Please close it first with 'c'.\n");
+			return;
+		}
+
+		char filepath[256] = {0};
+		char stream_filepath[256] = {0};
+		char output_filepath[256] = {0};
+		char format[16] = {0};
+		int count = sscanf(command_line, "r %s %s %s %15s", filepath, stream_filepath, output_filepath, format);
+		if (count >= 3) {
+			int fd = open_or_create_tree(filepath, DEFAULT_LEAF_ORDER, DEFAULT_INTERNAL_ORDER);
+			if (fd == -1) {
+				if (need_response) printf("Error: Could not open file '%s'.\n", filepath);
+				return;
+			}
+			bool binary = (count == 4 && strcmp(format, "bin") == 0);
+			bool joined = db_join_stream(fd, stream_filepath, binary, output_filepath);
+			close_tree(fd);
+			if (need_response && joined) printf("File '%s' and stream '%s' joined into '%s'.\n", filepath, stream_filepath, output_filepath);
+		} else if (need_help) {
+			usage_2();
+		}
+		return;
+	}
+
+	if (instruction == 'y') {
+		if (tree_fd != -1) {
+			sync_tree(tree_fd);
+			if (need_response) printf("Database file synced.\n");
+		} else {
+			if (need_response) printf("No database file is open.\n");
+		}
+		return;
+	}
+
+	if (instruction == 'z') {
+		if (tree_fd == -1) {
+			if (need_response) printf("No database file is open.\n");
+			return;
+		}
+
+		char mode[16] = {0};
+		sscanf(command_line, "z %15s", mode);
+		bool torn = strcmp(mode, "torn") == 0;
+		if (mode[0] != '\0' && !torn) {
+			// The command after 'z' gets as far as its commit before the crash.
+			char *inner_command = strchr(command_line, 'z') + 1;
+			inner_command += strspn(inner_command, " \t");
+			fail_next_commit(tree_fd);
+			process_command(inner_command, false, false, false);
+			if (tree_fd == -1) return;
+		}
+		crash_tree(tree_fd, torn);
+		tree_fd = -1;
+		online_compaction = false;
+		if (need_response) printf("Database file dropped as if the process crashed.\n");
+		return;
+	}
+
+	if (instruction == 'k') {
+		if (tree_fd == -1) {
+			if (need_response) printf("No database file is open.\n");
+			return;
+		}
+
+		header_page header;
+		load_header_page(tree_fd, &header);
+		int64_t old_num_pages = header.num_pages;
+		char mode[16] = {0};
+		int fill_percent = DEFAULT_FILL_PERCENT;
+		if (sscanf(command_line, "k %15s", mode) == 1 && strcmp(mode, "online") == 0) {
+			if (!(header.flags & HEADER_FLAG_BITMAP_SPACE)) {
+				if (need_response) printf("Online compaction needs a file with bitmap space management. Use 'k' instead.\n");
+				return;
+			}
+			online_compaction = true;
+			if (need_response) printf("Online compaction started.\n");
+			return;
+		}
+
+		sscanf(command_line, "k %d", &fill_percent);
+		online_compaction = false;
+		tree_fd = db_compact(tree_fd, fill_percent);
+		load_header_page(tree_fd, &header);
+		if (need_response) printf("Database file compacted from %ld to %ld pages.\n", old_num_pages, header.num_pages);
+		return;
+	}
+
+	if (instruction == 'b') {
+		if (tree_fd == -1) {
+			if (need_response) printf("No database file is open.\n");
+			return;
+		}
+
+		char stream_filepath[256] = {0};
+		char args[2][16] = {{0}};
+		int count = sscanf(command_line, "b %255s %15s %15s", stream_filepath, args[0], args[1]);
+		if (count >= 1) {
+			int fill_percent = DEFAULT_FILL_PERCENT;
+			bool binary = false;
+			for (int i = 0; i < count - 1; i++) {
+				if (strcmp(args[i], "bin") == 0) binary = true;
+				else fill_percent = atoi(args[i]);
+			}
+			int64_t num_loaded;
+			bool loaded = db_bulk_load(tree_fd, stream_filepath, binary, fill_percent, &num_loaded);
+			if (need_response && loaded) printf("%ld entries loaded from '%s'.\n", num_loaded, stream_filepath);
+			if (need_response && !loaded && num_loaded > 0) printf("%ld entries loaded before the error.\n", num_loaded);
 		} else if (need_help) {
 			usage_2();
 		}
 		return;
 	}
 
+	if (instruction == 'g') {
+		if (tree_fd == -1) {
+			if (need_response) printf("No database file is open.\n");
+			return;
+		}
+
+		value_log_collection result;
+		if (!db_collect_value_log(tree_fd, &result)) {
+			if (need_response) printf("The database file has no value log.\n");
+			return;
+		}
+		if (need_response) {
+			printf("Value log collected: %ld of %ld values moved, %.1f KiB released.\n",
+					result.moved_values, result.scanned_values, result.released_bytes / 1024.0);
+		}
+		return;
+	}
+
+	if (instruction == 's') {
+		// Walking the tree pins every page it counts, so it only runs when asked for.
+		char mode[16] = {0};
+		if (sscanf(command_line, "s %15s", mode) == 1 && strcmp(mode, "tree") == 0) {
+			if (tree_fd == -1) {
+				if (need_response) printf("No database file is open.\n");
+				return;
+			}
+			print_tree_stats(tree_fd);
+			return;
+		}
+		print_stats(tree_fd);
+		return;
+	}
+
 	if (instruction == 'v') {
 		verbose_output = !verbose_output;
 		if (need_response && verbose_output) printf("Verbose output enabled.\n");
@@ -237,6 +480,17 @@ void process_command(char* command_line, bool need_echo, bool need_response, boo
 	}
 }
 
+void run_online_compaction(bool need_response) {
+	if (!online_compaction || tree_fd == -1) return;
+
+	online_compaction = db_compact_step(tree_fd, COMPACTION_STEP_PAGES);
+	if (!online_compaction && need_response) {
+		header_page header;
+		load_header_page(tree_fd, &header);
+		printf("Online compaction finished at %ld pages.\n", header.num_pages);
+	}
+}
+
 // Printing tree functions
 void print_tree(int fd) {
 	header_page header;
@@ -250,6 +504,7 @@ void print_tree(int fd) {
 	print_queue.head = NULL;
 	print_queue.tail = NULL;
 
+	page *cur_page = alloc_page_struct(fd);
 	int64_t old_rank = 0;
 	int_pair *cur = make_int_pair(header.root_pgn, 0);
 	enqueue(cur);
@@ -264,18 +519,18 @@ void print_tree(int fd) {
 			printf("\n");
 		}
 
-		page cur_page;
-		load_page(fd, cur_pgn, &cur_page);
+		load_page(fd, cur_pgn, cur_page);
 		if (verbose_output) printf("page %ld: ", cur_pgn);
-		for (int i = 0; i < cur_page.num_keys; i++) {
-			printf("%ld ", cur_page.keys[i]);
-			if (!cur_page.is_leaf) {
-				enqueue(make_int_pair(cur_page.child_pgns[i], cur_rank + 1));
+		for (int i = 0; i < cur_page->num_keys; i++) {
+			printf("%ld ", cur_page->keys[i]);
+			if (!cur_page->is_leaf) {
+				enqueue(make_int_pair(cur_page->child_pgns[i], cur_rank + 1));
 			}
 		}
-		if (!cur_page.is_leaf) enqueue(make_int_pair(cur_page.child_pgns[cur_page.num_keys], cur_rank + 1));
+		if (!cur_page->is_leaf) enqueue(make_int_pair(cur_page->child_pgns[cur_page->num_keys], cur_rank + 1));
 		printf("| ");
 	}
+	free(cur_page);
 	printf("\n");
 }
 
@@ -288,33 +543,105 @@ void print_leaves(int fd) {
 		return;
 	}
 
-	page cur_page;
 	int64_t cur_pgn = header.root_pgn;
-
-	while (true) {
-		load_page(fd, cur_pgn, &cur_page);
-		if (cur_page.is_leaf) break;
-		cur_pgn = cur_page.child_pgns[0];
+	const char *cur_image = pin_page(fd, cur_pgn, true);
+	while (!page_image_is_leaf(cur_image)) {
+		int64_t child_pgn = internal_image_child(cur_image, 0);
+		unpin_page(fd, cur_pgn, false);
+		cur_pgn = child_pgn;
+		cur_image = pin_page(fd, cur_pgn, true);
 	}
 
+	char value[VALUE_SIZE];
 	while (true) {
-		for (int i = 0; i < cur_page.num_keys; i++) {
-			printf("(%ld, %s) ", cur_page.keys[i], cur_page.records[i].value);
+		int num_keys = page_image_num_keys(cur_image);
+		bool is_prefixed = leaf_image_is_prefixed(cur_image);
+		for (int i = 0; i < num_keys; i++) {
+			// A prefixed value is decoded from the one before it, so the walk applies one suffix per entry.
+			if (is_prefixed) leaf_image_apply_suffix(cur_image, i, value);
+			printf("(%ld, %s) ", leaf_image_key(cur_image, i), is_prefixed ? value : read_leaf_value(fd, cur_image, i, value));
 		}
-		if (cur_page.right_sibling_pgn < 0) break;
-		cur_pgn = cur_page.right_sibling_pgn;
-		load_page(fd, cur_pgn, &cur_page);
+		int64_t right_sibling_pgn = page_image_last_pgn(cur_image);
+		unpin_page(fd, cur_pgn, false);
+		if (right_sibling_pgn < 0) break;
+		cur_pgn = right_sibling_pgn;
+		cur_image = pin_page(fd, cur_pgn, true);
 	}
 	printf("\n");
 }
 
+void print_stats(int fd) {
+	buffer_pool_stats stats;
+	get_buffer_pool_stats(&stats);
+
+	int64_t accesses = stats.hits + stats.misses;
+	printf("Buffer pool: %d frames of %d KiB (%d KiB), %ld hits, %ld misses (hit ratio %.2f%%), %ld evictions, %ld write-backs.\n",
+			stats.num_frames, PAGE_SIZE / 1024, stats.num_frames * (PAGE_SIZE / 1024), stats.hits, stats.misses,
+			accesses == 0 ? 0.0 : 100.0 * stats.hits / accesses, stats.evictions, stats.write_backs);
+
+	printf("Write-back: %ld pages in %ld batches and %ld vectored writes (%.1f KiB per write, %.2f writes per batch).\n",
+			stats.write_backs, stats.flushes, stats.write_calls,
+			stats.write_calls == 0 ? 0.0 : (double)stats.write_backs * (PAGE_SIZE / 1024) / stats.write_calls,
+			stats.flushes == 0 ? 0.0 : (double)stats.write_calls / stats.flushes);
+
+	printf("Asynchronous I/O: %s backend, %ld pages read ahead, %ld of them pinned (%.2f%% used).\n",
+			get_async_io_backend_name(), stats.read_aheads, stats.read_ahead_hits,
+			stats.read_aheads == 0 ? 0.0 : 100.0 * stats.read_ahead_hits / stats.read_aheads);
+
+	printf("Key search: %s kernel.\n", get_key_search_kernel_name(get_key_search_kernel()));
+
+	upper_index_stats index_stats;
+	get_upper_index_stats(fd, &index_stats);
+	printf("Upper index: %ld internal pages resident in %.1f KiB, %ld page updates.\n",
+			index_stats.resident_pages, index_stats.allocated_bytes / 1024.0, index_stats.page_updates);
+
+	file_manager_stats io_stats;
+	get_file_manager_stats(&io_stats);
+	printf("Header page: %ld reads, %ld writes.\n", io_stats.header_reads, io_stats.header_writes);
+
+	if (fd == -1) return;
+	wal_stats log_stats;
+	if (get_wal_stats(fd, &log_stats)) {
+		printf("Log: %ld commits, %ld syncs (%.1f commits per sync), %ld pages and %ld undo images in %.1f KiB, %ld checkpoints.\n",
+				log_stats.commits, log_stats.forces, log_stats.forces == 0 ? 0.0 : (double)log_stats.commits / log_stats.forces,
+				log_stats.logged_pages, log_stats.undo_pages, log_stats.logged_bytes / 1024.0, log_stats.checkpoints);
+	}
+
+	value_log_stats vlog_stats;
+	if (get_value_log_stats(fd, &vlog_stats)) {
+		header_page header;
+		load_header_page(fd, &header);
+		printf("Value log: %.1f KiB from tail to end, %ld values appended, %ld reads with %ld block reads, %ld collections released %.1f KiB.\n",
+				(get_value_log_end(fd) - header.value_log_tail) / 1024.0, vlog_stats.appended_values,
+				vlog_stats.value_reads, vlog_stats.block_reads, vlog_stats.collections, vlog_stats.released_bytes / 1024.0);
+	}
+}
+
+void print_tree_stats(int fd) {
+	internal_page_stats internal_stats;
+	db_internal_page_stats(fd, &internal_stats);
+	printf("Internal pages: %ld on %d levels above the leaves (%.1f keys per page, %.1f bytes per entry).\n",
+			internal_stats.num_pages, internal_stats.height == 0 ? 0 : internal_stats.height - 1,
+			internal_stats.num_pages == 0 ? 0.0 : (double)internal_stats.num_keys / internal_stats.num_pages,
+			internal_stats.num_keys == 0 ? 0.0 : (double)internal_stats.entry_bytes / internal_stats.num_keys);
+
+	leaf_chain_stats chain_stats;
+	db_leaf_chain_stats(fd, &chain_stats);
+	printf("Leaf chain: %ld leaves (%.1f entries per leaf), %ld of %ld sibling hops to the next page (%.2f%% sequential).\n",
+			chain_stats.num_leaves, chain_stats.num_leaves == 0 ? 0.0 : (double)chain_stats.num_entries / chain_stats.num_leaves,
+			chain_stats.sequential_hops, chain_stats.sibling_hops,
+			chain_stats.sibling_hops == 0 ? 100.0 : 100.0 * chain_stats.sequential_hops / chain_stats.sibling_hops);
+	if (chain_stats.stored_value_bytes > 0) {
+		printf("Leaf values: %.1f KiB stored in %.1f KiB of leaf heaps (%.2fx compression).\n",
+				chain_stats.value_bytes / 1024.0, chain_stats.stored_value_bytes / 1024.0,
+				(double)chain_stats.value_bytes / chain_stats.stored_value_bytes);
+	}
+}
+
 void find_and_print(int fd, int64_t key, bool verbose) {
-	page *leaf = NULL;
-	record *r = db_find(fd, key, verbose, &leaf);
+	record *r = db_find(fd, key, verbose, NULL);
 	if (r == NULL) printf("Not found.\n");
 	else printf("(%ld, %s)\n", key, r->value);
-
-	if (leaf != NULL) free(leaf);
 }
 
 // Utility functions for printing tree functions
@@ -364,9 +691,26 @@ void usage_1(void) {
 
 void usage_2(void) {
 	printf("Enter any of the following commands after the prompt > :\n"
-	       "\to <path> [l_ord] [i_ord] -- Open a database file. Create it if not exists. 'l_ord' and 'i_ord' are optional.\n"
+	       "\to <path> [l_ord] [i_ord] [mmap] [direct] [slotted] [prefix] [vlog] [packed] [pax] [wal[=<n>]] -- Open a database file. Create it if not exists. 'l_ord' and 'i_ord' are optional.\n"
+	       "\t\tmmap -- Access pages through memory-mapped windows instead of pread/pwrite.\n"
+	       "\t\tdirect -- Open the file with O_DIRECT so that only the buffer pool caches pages. Ignored with mmap.\n"
+	       "\t\tslotted -- Create the file with slotted leaves that store values by their length, split by bytes. 'l_ord' is ignored.\n"
+	       "\t\tprefix -- Create the file with slotted leaves that keep each value as the suffix it does not share with the value before it. 'l_ord' is ignored.\n"
+	       "\t\tvlog -- Create the file with its values in the append-only log <path>.vlog and only value offsets in the leaves. 'l_ord' is ignored.\n"
+	       "\t\tpacked -- Create the file with internal pages that store keys as small deltas from their first key, split by bytes. 'i_ord' is ignored.\n"
+	       "\t\tpax -- Create the file with fixed leaves that keep their keys together ahead of their values. Ignored with slotted, prefix and vlog.\n"
+	       "\t\theader_flush=<n> -- Write the cached header page back every <n> updates instead of only on close and sync.\n"
+	       "\t\twal[=<n>] -- Log every change to <path>.wal and sync the log once per <n> commits (default 32), so that a crash loses at most that many. Ignored with mmap.\n"
 	       "\tc -- Close the current database file.\n"
-		   "\tj <tree_path1> <tree_path2> <out_path> -- Join two database files into a new output file.\n"
+	       "\ty -- Write back the cached pages of the current database file and sync it.\n"
+	       "\tz [torn | <command>] -- Drop the current database file as if the process crashed, without writing anything back. With 'torn', cut the last log writes in half. With a command, e.g. 'z i 5 five', crash just before that command commits, after its pages were written back.\n"
+	       "\tk [fill] -- Rewrite the current database file with its leaves in key order and <fill> percent full (default 100), and truncate it.\n"
+	       "\tb <stream_path> [fill] [bin] -- Load a sorted stream of 'key value' lines, or of packed int64 keys with 'bin', into the empty current database file bottom-up, <fill> percent full (default 100).\n"
+	       "\tg -- Garbage collect the value log of the current database file.\n"
+	       "\tk online -- Move pages from the end of the current database file to the front a few at a time after each command, and truncate it.\n"
+		   "\tj <tree_path1> <tree_path2> <out_path> [delta] -- Join two database files into a new output file. With 'delta', pair keys within +-delta of each other.\n"
+		   "\tm <job_path> -- Run the 'j' jobs listed in a file, sharing scans of common input trees.\n"
+		   "\tr <tree_path> <stream_path> <out_path> [bin] -- Join a database file with a sorted stream of 'key value' lines, or of packed int64 keys with 'bin'.\n"
 	       "\ti <k> <v> -- Insert <k> (an integer) as key and <v> as value.\n"
 	       "\ti <k> <v> -- Insert the value <v> (a string up to 119 chars) as the value of key <k> (an integer).\n"
 	       "\te <filepath> [echo] [resp] -- Execute commands from a file. 'echo' and 'resp' are optional (0 for false, 1 for true, default is 0).\n"
@@ -376,6 +720,7 @@ void usage_2(void) {
 	       "\tx -- Destroy the whole tree.  Start again with an empty tree of the same order.\n"
 	       "\tt -- Print the B+ tree.\n"
 	       "\tl -- Print the keys of the leaves (bottom row of the tree).\n"
+	       "\ts [tree] -- Print the buffer pool and I/O statistics. With 'tree', walk the current database file for its page fill and leaf chain order instead.\n"
 	       "\tv -- Toggle output of pointer addresses (\"verbose\") in tree and leaves.\n"
 	       "\tq -- Quit. (Or use Ctl-D or Ctl-C.)\n"
 	       "\t? -- Print this help message.\n");
@@ -0,0 +1,207 @@
+#include "upper_index.h"
+#include "buffer_pool.h"
+#include "dbbpt.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+void load_upper_index(int fd) {
+	tree_handle *handle = get_tree_handle(fd);
+	if (handle == NULL || handle->upper_index != NULL) return;
+
+	upper_index *index = (upper_index *)calloc(1, sizeof(upper_index));
+	if (index == NULL) exit_with_err_msg("Error on allocating upper index.");
+	int max_keys = handle->header.internal_order - 1;
+	index->node_stride = (max_keys + UPPER_INDEX_LINE_KEYS) / UPPER_INDEX_LINE_KEYS * UPPER_INDEX_LINE_KEYS;
+	handle->upper_index = index;
+
+	int64_t root_pgn = handle->header.root_pgn;
+	if (root_pgn <= 0) return;
+
+	// Every path is as long as the leftmost one, so the height tells which children are leaves without reading them.
+	int height = 0;
+	int64_t pgn = root_pgn;
+	const char *image = pin_page(fd, pgn, true);
+	while (!page_image_is_leaf(image)) {
+		int64_t child_pgn = internal_image_child(image, 0);
+		unpin_page(fd, pgn, false);
+		height += 1;
+		pgn = child_pgn;
+		image = pin_page(fd, pgn, true);
+	}
+	unpin_page(fd, pgn, false);
+	if (height > 0) load_upper_pages(fd, root_pgn, height);
+	index->stats.page_updates = 0;
+}
+
+void close_upper_index(int fd) {
+	tree_handle *handle = get_tree_handle(fd);
+	if (handle == NULL || handle->upper_index == NULL) return;
+
+	upper_index *index = handle->upper_index;
+	free(index->keys);
+	free(index->children);
+	free(index->num_keys);
+	free(index->node_pgns);
+	free(index->free_nodes);
+	free(index->node_of_pgn);
+	free(index);
+	handle->upper_index = NULL;
+}
+
+void update_upper_index(int fd, const page *p) {
+	tree_handle *handle = get_tree_handle(fd);
+	if (handle == NULL || handle->upper_index == NULL) return;
+
+	upper_index *index = handle->upper_index;
+	int node = p->pgn < index->map_pgns ? index->node_of_pgn[p->pgn] : -1;
+	if (p->is_leaf) {
+		if (node >= 0) free_upper_node(index, node);
+		return;
+	}
+	if (p->num_keys >= index->node_stride) exit_with_err_msg("Error on updating upper index: the page holds too many keys.");
+
+	// The page is laid out again from scratch. That costs as much as the write itself, and keeps no holes.
+	if (node < 0) node = alloc_upper_node(index, p->pgn);
+	index->num_keys[node] = p->num_keys;
+	fill_upper_node(index, node, p, 1, 0);
+	index->children[(int64_t)node * index->node_stride] = p->child_pgns[p->num_keys];
+	index->stats.page_updates += 1;
+}
+
+void drop_upper_index_page(int fd, int64_t pgn) {
+	tree_handle *handle = get_tree_handle(fd);
+	if (handle == NULL || handle->upper_index == NULL) return;
+
+	upper_index *index = handle->upper_index;
+	if (pgn < index->map_pgns && index->node_of_pgn[pgn] >= 0) free_upper_node(index, index->node_of_pgn[pgn]);
+}
+
+int64_t search_upper_index(int fd, int64_t root_pgn, int64_t key, descent_path *path) {
+	tree_handle *handle = get_tree_handle(fd);
+	if (handle == NULL || handle->upper_index == NULL) return -1;
+
+	// Only internal pages have nodes, so the first page without one is the leaf.
+	const upper_index *index = handle->upper_index;
+	int64_t pgn = root_pgn;
+	int node = pgn < index->map_pgns ? index->node_of_pgn[pgn] : -1;
+	while (node >= 0) {
+		if (path != NULL) {
+			if (path->depth == MAX_TREE_HEIGHT) exit_with_err_msg("Error on finding leaf: the tree is too deep.");
+			path->pgns[path->depth++] = pgn;
+		}
+
+		// Each step goes to keys[2 * j] or keys[2 * j + 1] by a comparison, not a branch. The nodes 3 levels
+		// down share a cache line, which is fetched while the levels in between are compared.
+		const int64_t *keys = index->keys + (int64_t)node * index->node_stride;
+		unsigned int j = 1;
+		unsigned int num_keys = (unsigned int)index->num_keys[node];
+		while (j <= num_keys) {
+			__builtin_prefetch(keys + UPPER_INDEX_LINE_KEYS * j);
+			j = 2 * j + (keys[j] <= key);
+		}
+		// The trailing 1 bits are the steps right after the last step left, whose key is the first one greater.
+		j >>= __builtin_ffs(~j);
+		pgn = index->children[(int64_t)node * index->node_stride + j];
+		node = pgn < index->map_pgns ? index->node_of_pgn[pgn] : -1;
+	}
+	return pgn;
+}
+
+void get_upper_index_stats(int fd, upper_index_stats *stats) {
+	memset(stats, 0, sizeof(upper_index_stats));
+	tree_handle *handle = get_tree_handle(fd);
+	if (handle == NULL || handle->upper_index == NULL) return;
+
+	const upper_index *index = handle->upper_index;
+	*stats = index->stats;
+	stats->allocated_bytes = (int64_t)index->num_nodes * (2 * index->node_stride * 8 + 8 + 2 * sizeof(int))
+			+ index->map_pgns * sizeof(int);
+}
+
+// Helper functions
+int alloc_upper_node(upper_index *index, int64_t pgn) {
+	if (index->num_free_nodes == 0) grow_upper_nodes(index);
+	if (pgn >= index->map_pgns) grow_upper_pgn_map(index, pgn);
+
+	int node = index->free_nodes[--index->num_free_nodes];
+	index->node_pgns[node] = pgn;
+	index->node_of_pgn[pgn] = node;
+	index->stats.resident_pages += 1;
+	return node;
+}
+
+void free_upper_node(upper_index *index, int node) {
+	index->node_of_pgn[index->node_pgns[node]] = -1;
+	index->num_keys[node] = -1;
+	index->free_nodes[index->num_free_nodes++] = node;
+	index->stats.resident_pages -= 1;
+}
+
+void grow_upper_nodes(upper_index *index) {
+	int old_nodes = index->num_nodes;
+	int new_nodes = old_nodes == 0 ? UPPER_INDEX_MIN_NODES : 2 * old_nodes;
+	size_t old_bytes = (size_t)old_nodes * index->node_stride * 8;
+	size_t new_bytes = (size_t)new_nodes * index->node_stride * 8;
+
+	// The arrays are copied rather than reallocated, since realloc() does not keep the alignment.
+	int64_t *keys = (int64_t *)alloc_aligned(new_bytes);
+	int64_t *children = (int64_t *)alloc_aligned(new_bytes);
+	if (old_nodes > 0) {
+		memcpy(keys, index->keys, old_bytes);
+		memcpy(children, index->children, old_bytes);
+	}
+	free(index->keys);
+	free(index->children);
+	index->keys = keys;
+	index->children = children;
+
+	index->num_keys = (int *)realloc(index->num_keys, new_nodes * sizeof(int));
+	index->node_pgns = (int64_t *)realloc(index->node_pgns, new_nodes * sizeof(int64_t));
+	index->free_nodes = (int *)realloc(index->free_nodes, new_nodes * sizeof(int));
+	if (index->num_keys == NULL || index->node_pgns == NULL || index->free_nodes == NULL) {
+		exit_with_err_msg("Error on allocating upper index.");
+	}
+	// Pushed from the top, so that the lowest slots are taken first.
+	for (int node = new_nodes - 1; node >= old_nodes; node--) {
+		index->num_keys[node] = -1;
+		index->free_nodes[index->num_free_nodes++] = node;
+	}
+	index->num_nodes = new_nodes;
+}
+
+void grow_upper_pgn_map(upper_index *index, int64_t pgn) {
+	int64_t map_pgns = index->map_pgns == 0 ? 1024 : index->map_pgns;
+	while (map_pgns <= pgn) map_pgns *= 2;
+	index->node_of_pgn = (int *)realloc(index->node_of_pgn, map_pgns * sizeof(int));
+	if (index->node_of_pgn == NULL) exit_with_err_msg("Error on allocating upper index.");
+	for (int64_t i = index->map_pgns; i < map_pgns; i++) index->node_of_pgn[i] = -1;
+	index->map_pgns = map_pgns;
+}
+
+int fill_upper_node(upper_index *index, int node, const page *p, int slot, int rank) {
+	// An in-order walk of the implicit tree hands out the keys in key order.
+	if (slot > p->num_keys) return rank;
+	rank = fill_upper_node(index, node, p, 2 * slot, rank);
+	index->keys[(int64_t)node * index->node_stride + slot] = p->keys[rank];
+	index->children[(int64_t)node * index->node_stride + slot] = p->child_pgns[rank];
+	return fill_upper_node(index, node, p, 2 * slot + 1, rank + 1);
+}
+
+void load_upper_pages(int fd, int64_t pgn, int height) {
+	page *p = alloc_page_struct(fd);
+	load_page(fd, pgn, p);
+	update_upper_index(fd, p);
+	if (height > 1) {
+		for (int i = 0; i <= p->num_keys; i++) load_upper_pages(fd, p->child_pgns[i], height - 1);
+	}
+	free(p);
+}
+
+void *alloc_aligned(size_t size) {
+	void *memory;
+	if (posix_memalign(&memory, UPPER_INDEX_ALIGNMENT, size) != 0) exit_with_err_msg("Error on allocating upper index.");
+	return memory;
+}
@@ -0,0 +1,104 @@
+#ifndef __UPPER_INDEX_H__
+#define __UPPER_INDEX_H__
+
+#include "file_manager.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#ifdef _WIN32
+#define bool char
+#define false 0
+#define true 1
+#endif
+
+
+// Constants
+#define UPPER_INDEX_ALIGNMENT 64 // Every node starts on a cache line, so that its first levels share one.
+#define UPPER_INDEX_LINE_KEYS (UPPER_INDEX_ALIGNMENT / 8) // Keys in a cache line, i.e. the children 3 levels below a key.
+#define UPPER_INDEX_MIN_NODES 16 // Node slots allocated at first. The pool doubles whenever it runs out.
+
+
+// Structures
+typedef struct upper_index_stats {
+	int64_t resident_pages; // Internal pages held in the index.
+	int64_t allocated_bytes; // Bytes of the node pool and of the page number map.
+	int64_t page_updates; // Internal pages written, and copied into the index, since the tree was opened.
+} upper_index_stats;
+
+// Every internal page of an open tree, held in memory so that a descent only reads the leaf it ends at.
+// A page becomes a node of node_stride keys and as many children, in separate arrays. The keys of a node
+// are in Eytzinger order: keys[1] is the middle key, and keys[2 * j] and keys[2 * j + 1] are the middles of
+// the halves left and right of keys[j]. children[j] is the child left of keys[j], and children[0] the last
+// child, so the search ends at the child without going back to key order.
+typedef struct upper_index {
+	int node_stride; // The most keys a page holds plus one, rounded up to a cache line.
+	int num_nodes; // Node slots allocated.
+	int64_t *keys; // node_stride keys per node, from keys[node * node_stride + 1]. Aligned to UPPER_INDEX_ALIGNMENT.
+	int64_t *children; // node_stride child page numbers per node. Aligned to UPPER_INDEX_ALIGNMENT.
+	int *num_keys; // The keys of each node, or -1 if the slot is free.
+	int64_t *node_pgns; // The page each node holds.
+	int *free_nodes; // The free slots, used as a stack.
+	int num_free_nodes;
+	int *node_of_pgn; // The node of each page number below map_pgns, or -1 if the page is not an internal page.
+	int64_t map_pgns;
+	upper_index_stats stats;
+} upper_index;
+
+struct descent_path;
+
+
+// APIs
+/**
+ * @brief Read the internal pages of a tree into its upper index. This is done when the tree is opened.
+ * @param fd[in] The file descriptor of the database file.
+ */
+void load_upper_index(int fd);
+
+/**
+ * @brief Free the upper index of a tree. This is done when the tree is closed.
+ * @param fd[in] The file descriptor of the database file.
+ */
+void close_upper_index(int fd);
+
+/**
+ * @brief Copy a page that is being written into the upper index, or drop it if it is now a leaf.
+ * @param fd[in] The file descriptor of the database file.
+ * @param p[in] The page. write_page() calls this for every page, so splits, merges and moves keep the index current.
+ */
+void update_upper_index(int fd, const page *p);
+
+/**
+ * @brief Drop a page that is being freed from the upper index.
+ * @param fd[in] The file descriptor of the database file.
+ * @param pgn[in] The page number.
+ */
+void drop_upper_index_page(int fd, int64_t pgn);
+
+/**
+ * @brief Descend from the root to the leaf that may hold a key, in memory.
+ * @param fd[in] The file descriptor of the database file.
+ * @param root_pgn[in] The root page number. It must not be -1.
+ * @param key[in] The key to search for.
+ * @param path[out] If not NULL, the internal pages passed through, as find_leaf_pgn() records them.
+ * @return The page number of the leaf, or -1 if the tree has no upper index.
+ */
+int64_t search_upper_index(int fd, int64_t root_pgn, int64_t key, struct descent_path *path);
+
+/**
+ * @brief Get the statistics of the upper index of a tree.
+ * @param fd[in] The file descriptor of the database file.
+ * @param stats[out] The statistics, all zero if the tree has no upper index.
+ */
+void get_upper_index_stats(int fd, upper_index_stats *stats);
+
+
+// Helper functions
+int alloc_upper_node(upper_index *index, int64_t pgn);
+void free_upper_node(upper_index *index, int node);
+void grow_upper_nodes(upper_index *index);
+void grow_upper_pgn_map(upper_index *index, int64_t pgn);
+int fill_upper_node(upper_index *index, int node, const page *p, int slot, int rank);
+void load_upper_pages(int fd, int64_t pgn, int height);
+void *alloc_aligned(size_t size);
+
+#endif /* __UPPER_INDEX_H__ */
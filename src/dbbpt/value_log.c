@@ -0,0 +1,278 @@
+#define _GNU_SOURCE
+#include "value_log.h"
+#include "wal.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+void open_value_log(int fd) {
+	tree_handle *handle = get_tree_handle(fd);
+	if (handle == NULL || handle->vlog != NULL || !(handle->header.flags & HEADER_FLAG_VALUE_LOG)) return;
+
+	value_log *vlog = (value_log *)calloc(1, sizeof(value_log));
+	if (vlog == NULL) exit_with_err_msg("Error on allocating value log.");
+	vlog->path = make_value_log_path(handle->path);
+	vlog->fd = open(vlog->path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	if (vlog->fd == -1) exit_with_err_msg("Error on opening value log file.");
+	vlog->buffer = (char *)malloc(VALUE_LOG_BUFFER_SIZE);
+	vlog->read_block = (char *)malloc(VALUE_LOG_READ_BLOCK_SIZE);
+	if (vlog->buffer == NULL || vlog->read_block == NULL) exit_with_err_msg("Error on allocating value log.");
+
+	struct stat file_stat;
+	if (fstat(vlog->fd, &file_stat) == -1) exit_with_err_msg("Error on reading value log size.");
+	if (file_stat.st_size < handle->header.value_log_head) exit_with_err_msg("Error on opening value log: it lost synced values.");
+	vlog->end_offset = file_stat.st_size;
+	vlog->buffer_offset = vlog->end_offset;
+	vlog->synced_offset = vlog->end_offset;
+	handle->vlog = vlog;
+
+	// Values after the recorded head were appended since the last sync. Keep them up to the first torn entry.
+	int64_t offset = handle->header.value_log_head;
+	int64_t key;
+	char value[VALUE_SIZE];
+	while (offset < vlog->end_offset) {
+		int64_t next_offset = read_value_log_entry(fd, offset, &key, value);
+		if (next_offset < 0) break;
+		offset = next_offset;
+	}
+	if (offset < vlog->end_offset) {
+		if (ftruncate(vlog->fd, offset) == -1) exit_with_err_msg("Error on truncating value log file.");
+		printf("Cut %ld torn bytes from '%s'.\n", vlog->end_offset - offset, vlog->path);
+		vlog->end_offset = offset;
+		vlog->buffer_offset = offset;
+		vlog->synced_offset = offset;
+		vlog->read_block_length = 0;
+	}
+}
+
+void close_value_log(int fd) {
+	value_log *vlog = get_value_log(fd);
+	if (vlog == NULL) return;
+
+	checkpoint_value_log(fd);
+	close(vlog->fd);
+	free(vlog->path);
+	free(vlog->buffer);
+	free(vlog->read_block);
+	free(vlog);
+	get_tree_handle(fd)->vlog = NULL;
+}
+
+void abandon_value_log(int fd, bool torn) {
+	value_log *vlog = get_value_log(fd);
+	if (vlog == NULL) return;
+
+	if (torn) {
+		vlog->end_offset = vlog->buffer_offset + (vlog->end_offset - vlog->buffer_offset) / 2;
+		write_value_log_buffer(vlog);
+	}
+	close(vlog->fd);
+	free(vlog->path);
+	free(vlog->buffer);
+	free(vlog->read_block);
+	free(vlog);
+	get_tree_handle(fd)->vlog = NULL;
+}
+
+void remove_value_log(const char *file_path) {
+	char *vlog_path = make_value_log_path(file_path);
+	unlink(vlog_path);
+	free(vlog_path);
+}
+
+void sync_value_log(int fd) {
+	value_log *vlog = get_value_log(fd);
+	if (vlog == NULL || vlog->synced_offset == vlog->end_offset) return;
+
+	write_value_log_buffer(vlog);
+	if (fdatasync(vlog->fd) == -1) exit_with_err_msg("Error on syncing value log file.");
+	vlog->synced_offset = vlog->end_offset;
+}
+
+void checkpoint_value_log(int fd) {
+	value_log *vlog = get_value_log(fd);
+	if (vlog == NULL) return;
+
+	sync_value_log(fd);
+	header_page header;
+	load_header_page(fd, &header);
+	if (header.value_log_head == vlog->end_offset) return;
+	header.value_log_head = vlog->end_offset;
+	write_header_page(fd, &header);
+}
+
+void store_leaf_value(int fd, int64_t key, const char *value, record *dest) {
+	value_log *vlog = get_value_log(fd);
+	if (vlog == NULL) {
+		strcpy(dest->value, value);
+		dest->value_offset = -1;
+		return;
+	}
+
+	value_log_entry entry;
+	memset(&entry, 0, sizeof(value_log_entry));
+	entry.key = key;
+	entry.length = (uint32_t)strlen(value);
+	entry.checksum = compute_value_checksum(&entry, value);
+
+	dest->value[0] = '\0';
+	dest->value_offset = vlog->end_offset;
+	append_value_log_bytes(vlog, (const char *)&entry, sizeof(value_log_entry));
+	append_value_log_bytes(vlog, value, entry.length);
+	vlog->stats.appended_values += 1;
+	vlog->stats.appended_bytes += sizeof(value_log_entry) + entry.length;
+}
+
+const char *read_leaf_value(int fd, const char *image, int index, char *buffer) {
+	if (leaf_image_is_prefixed(image)) {
+		for (int i = 0; i <= index; i++) leaf_image_apply_suffix(image, i, buffer);
+		return buffer;
+	}
+	if (!leaf_image_has_value_log(image)) return leaf_image_value(image, index);
+
+	value_log *vlog = get_value_log(fd);
+	if (vlog == NULL) exit_with_err_msg("Error on reading value: the tree has no value log open.");
+	read_value(vlog, leaf_image_value_offset(image, index), buffer);
+	return buffer;
+}
+
+int64_t read_value_log_entry(int fd, int64_t offset, int64_t *key, char *value) {
+	value_log *vlog = get_value_log(fd);
+	if (vlog == NULL) return -1;
+
+	value_log_entry entry;
+	if (!read_value_log_bytes(vlog, offset, (char *)&entry, sizeof(value_log_entry))) return -1;
+	if (entry.length >= VALUE_SIZE) return -1;
+	if (!read_value_log_bytes(vlog, offset + sizeof(value_log_entry), value, entry.length)) return -1;
+	value[entry.length] = '\0';
+	if (compute_value_checksum(&entry, value) != entry.checksum) return -1;
+
+	*key = entry.key;
+	return offset + sizeof(value_log_entry) + entry.length;
+}
+
+int64_t get_value_log_end(int fd) {
+	value_log *vlog = get_value_log(fd);
+	return vlog == NULL ? -1 : vlog->end_offset;
+}
+
+void release_value_log_space(int fd, int64_t offset) {
+	value_log *vlog = get_value_log(fd);
+	if (vlog == NULL) return;
+
+	// The new tail has to be durable before the space goes, or a crash would leave a tail pointing into a hole.
+	header_page header;
+	load_header_page(fd, &header);
+	int64_t old_tail = header.value_log_tail;
+	if (offset <= old_tail) return;
+	header.value_log_tail = offset;
+	write_header_page(fd, &header);
+	sync_tree(fd);
+
+	// Only whole blocks go. A file system without hole punching keeps the space, which is harmless.
+	int64_t first = old_tail - old_tail % PAGE_SIZE;
+	int64_t last = offset - offset % PAGE_SIZE;
+	if (last > first) fallocate(vlog->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, first, last - first);
+	vlog->read_block_length = 0;
+	vlog->stats.collections += 1;
+	vlog->stats.released_bytes += offset - old_tail;
+}
+
+bool get_value_log_stats(int fd, value_log_stats *stats) {
+	value_log *vlog = get_value_log(fd);
+	if (vlog == NULL) return false;
+	*stats = vlog->stats;
+	return true;
+}
+
+// Helper functions
+value_log *get_value_log(int fd) {
+	tree_handle *handle = get_tree_handle(fd);
+	return handle == NULL ? NULL : handle->vlog;
+}
+
+void read_value(value_log *vlog, int64_t offset, char *dest) {
+	value_log_entry entry;
+	if (!read_value_log_bytes(vlog, offset, (char *)&entry, sizeof(value_log_entry)) || entry.length >= VALUE_SIZE ||
+			!read_value_log_bytes(vlog, offset + sizeof(value_log_entry), dest, entry.length)) {
+		exit_with_err_msg("Error on reading value log: bad value offset.");
+	}
+	dest[entry.length] = '\0';
+	vlog->stats.value_reads += 1;
+}
+
+bool read_value_log_bytes(value_log *vlog, int64_t offset, char *dest, int length) {
+	if (offset < 0 || offset + length > vlog->end_offset) return false;
+
+	while (length > 0) {
+		// The end of the log may still be in the append buffer.
+		if (offset >= vlog->buffer_offset) {
+			memcpy(dest, vlog->buffer + (offset - vlog->buffer_offset), length);
+			return true;
+		}
+
+		bool in_block = vlog->read_block_length > 0 && offset >= vlog->read_block_offset &&
+		                offset < vlog->read_block_offset + vlog->read_block_length;
+		if (!in_block) {
+			ssize_t read_size = pread(vlog->fd, vlog->read_block, VALUE_LOG_READ_BLOCK_SIZE, offset);
+			if (read_size <= 0) exit_with_err_msg("Error on reading value log file.");
+			vlog->read_block_offset = offset;
+			vlog->read_block_length = (int)read_size;
+			vlog->stats.block_reads += 1;
+		}
+		int64_t available = vlog->read_block_offset + vlog->read_block_length - offset;
+		if (offset + available > vlog->buffer_offset) available = vlog->buffer_offset - offset;
+		int chunk = length < available ? length : (int)available;
+		memcpy(dest, vlog->read_block + (offset - vlog->read_block_offset), chunk);
+		dest += chunk;
+		offset += chunk;
+		length -= chunk;
+	}
+	return true;
+}
+
+void append_value_log_bytes(value_log *vlog, const char *bytes, size_t length) {
+	while (length > 0) {
+		size_t used = (size_t)(vlog->end_offset - vlog->buffer_offset);
+		if (used == VALUE_LOG_BUFFER_SIZE) {
+			write_value_log_buffer(vlog);
+			used = 0;
+		}
+		size_t chunk = VALUE_LOG_BUFFER_SIZE - used < length ? VALUE_LOG_BUFFER_SIZE - used : length;
+		memcpy(vlog->buffer + used, bytes, chunk);
+		vlog->end_offset += chunk;
+		bytes += chunk;
+		length -= chunk;
+	}
+}
+
+void write_value_log_buffer(value_log *vlog) {
+	size_t used = (size_t)(vlog->end_offset - vlog->buffer_offset);
+	size_t written = 0;
+	while (written < used) {
+		ssize_t result = pwrite(vlog->fd, vlog->buffer + written, used - written, vlog->buffer_offset + written);
+		if (result <= 0) exit_with_err_msg("Error on writing value log file.");
+		written += result;
+	}
+	vlog->buffer_offset = vlog->end_offset;
+}
+
+uint32_t compute_value_checksum(const value_log_entry *entry, const char *value) {
+	value_log_entry copy = *entry;
+	copy.checksum = 0;
+	uint32_t crc = update_checksum(0xFFFFFFFFU, &copy, sizeof(value_log_entry));
+	crc = update_checksum(crc, value, entry->length);
+	return crc ^ 0xFFFFFFFFU;
+}
+
+char *make_value_log_path(const char *file_path) {
+	char *vlog_path = (char *)malloc(strlen(file_path) + sizeof(VALUE_LOG_FILE_SUFFIX));
+	if (vlog_path == NULL) exit_with_err_msg("Error on allocating value log file path.");
+	sprintf(vlog_path, "%s%s", file_path, VALUE_LOG_FILE_SUFFIX);
+	return vlog_path;
+}
@@ -0,0 +1,164 @@
+#ifndef __VALUE_LOG_H__
+#define __VALUE_LOG_H__
+
+#include "file_manager.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#ifdef _WIN32
+#define bool char
+#define false 0
+#define true 1
+#endif
+
+
+// Constants
+#define VALUE_LOG_FILE_SUFFIX ".vlog"
+#define VALUE_LOG_BUFFER_SIZE (64 * 1024) // Appended values are gathered here and written out sequentially.
+#define VALUE_LOG_READ_BLOCK_SIZE PAGE_SIZE // Values are read in blocks of this size, so that a scan of values written in key order reads each block once.
+
+
+// Structures
+// An entry of the value log is this header followed by `length` bytes of the value, without its NUL.
+typedef struct value_log_entry {
+	int64_t key; // The key the value was stored under, for garbage collection.
+	uint32_t length;
+	uint32_t checksum; // CRC-32 of this header, with the checksum zeroed, and the value. Detects torn writes at the end.
+} value_log_entry;
+
+typedef struct value_log_stats {
+	int64_t appended_values;
+	int64_t appended_bytes;
+	int64_t value_reads;
+	int64_t block_reads; // Blocks read from the file, by value reads and by garbage collection.
+	int64_t collections;
+	int64_t released_bytes; // Log bytes garbage collection has given back.
+} value_log_stats;
+
+// The value log of one open tree. Offsets are byte offsets in the log file, which only grows; garbage
+// collection punches holes in it instead of moving entries, so the offsets kept in the leaves stay valid.
+typedef struct value_log {
+	int fd;
+	char *path;
+	char *buffer; // VALUE_LOG_BUFFER_SIZE bytes, holding the entries from buffer_offset to end_offset.
+	int64_t buffer_offset;
+	int64_t end_offset;
+	int64_t synced_offset; // Everything below it is in the log file and synced.
+	char *read_block; // VALUE_LOG_READ_BLOCK_SIZE bytes of the file from read_block_offset, or none if the length is 0.
+	int64_t read_block_offset;
+	int read_block_length;
+	value_log_stats stats;
+} value_log;
+
+
+// APIs
+/**
+ * @brief Open the value log of a tree whose header has HEADER_FLAG_VALUE_LOG.
+ * @param fd[in] The file descriptor of the database file.
+ *
+ * The log is `path` + VALUE_LOG_FILE_SUFFIX. Entries after the value_log_head of the header are
+ * checked, and the log is cut at the first torn one that a crash left behind.
+ */
+void open_value_log(int fd);
+
+/**
+ * @brief Sync the value log of a tree and close it.
+ * @param fd[in] The file descriptor of the database file. Nothing happens if the tree has no value log.
+ */
+void close_value_log(int fd);
+
+/**
+ * @brief Drop the value log of a tree the way a crash would.
+ * @param fd[in] The file descriptor of the database file. Nothing happens if the tree has no value log.
+ * @param torn[in] Write the first half of the values not yet written, as a write cut short by the crash would.
+ */
+void abandon_value_log(int fd, bool torn);
+
+/**
+ * @brief Remove the value log of a tree file, e.g. one left behind by a file that is being created again.
+ * @param file_path[in] The path of the database file.
+ */
+void remove_value_log(const char *file_path);
+
+/**
+ * @brief Write the appended values of a tree to its value log and sync it.
+ * @param fd[in] The file descriptor of the database file. Nothing happens if the tree has no value log.
+ *
+ * Leaves that refer to a value must not reach the file or the write-ahead log before the value, so this
+ * runs before every force of the write-ahead log and before every write-back of buffer pool pages, on
+ * eviction as well as on sync. It returns at once when no value was appended since the last sync.
+ */
+void sync_value_log(int fd);
+
+/**
+ * @brief Sync the value log of a tree and record its end as value_log_head in the header.
+ * @param fd[in] The file descriptor of the database file. Nothing happens if the tree has no value log.
+ */
+void checkpoint_value_log(int fd);
+
+/**
+ * @brief Fill the record of a new or updated leaf entry.
+ * @param fd[in] The file descriptor of the database file.
+ * @param key[in] The key of the entry.
+ * @param value[in] The value of the entry.
+ * @param dest[out] The record. For a tree with a value log, the value is appended to the log and the
+ *                  record keeps its offset. Otherwise the record keeps the value itself.
+ */
+void store_leaf_value(int fd, int64_t key, const char *value, record *dest);
+
+/**
+ * @brief Get the value of an entry of a pinned leaf image.
+ * @param fd[in] The file descriptor of the database file.
+ * @param image[in] The leaf page image.
+ * @param index[in] The index of the entry.
+ * @param buffer[out] VALUE_SIZE bytes to read a value from the value log into.
+ * @return The value, either in the image or in `buffer`.
+ */
+const char *read_leaf_value(int fd, const char *image, int index, char *buffer);
+
+/**
+ * @brief Read an entry of the value log.
+ * @param fd[in] The file descriptor of the database file.
+ * @param offset[in] The offset of the entry.
+ * @param key[out] The key the value was stored under.
+ * @param value[out] VALUE_SIZE bytes to store the value.
+ * @return The offset of the next entry, or -1 if there is no valid entry at `offset`.
+ */
+int64_t read_value_log_entry(int fd, int64_t offset, int64_t *key, char *value);
+
+/**
+ * @brief Get the end of the value log of a tree, where the next value will be appended.
+ * @param fd[in] The file descriptor of the database file.
+ * @return The offset, or -1 if the tree has no value log.
+ */
+int64_t get_value_log_end(int fd);
+
+/**
+ * @brief Give back the space of the value log before `offset`, once nothing refers to it any more.
+ * @param fd[in] The file descriptor of the database file.
+ * @param offset[in] The new value_log_tail. Nothing before it may be read afterwards.
+ *
+ * The tail is recorded in the header, and the whole blocks between the old and the new tail are
+ * punched out of the file, which keeps its size.
+ */
+void release_value_log_space(int fd, int64_t offset);
+
+/**
+ * @brief Get the value log counters of a tree.
+ * @param fd[in] The file descriptor of the database file.
+ * @param stats[out] The destination to store the counters.
+ * @return false if the tree has no value log.
+ */
+bool get_value_log_stats(int fd, value_log_stats *stats);
+
+
+// Helper functions
+value_log *get_value_log(int fd);
+void read_value(value_log *vlog, int64_t offset, char *dest);
+bool read_value_log_bytes(value_log *vlog, int64_t offset, char *dest, int length);
+void append_value_log_bytes(value_log *vlog, const char *bytes, size_t length);
+void write_value_log_buffer(value_log *vlog);
+uint32_t compute_value_checksum(const value_log_entry *entry, const char *value);
+char *make_value_log_path(const char *file_path);
+
+#endif /* __VALUE_LOG_H__ */
@@ -0,0 +1,353 @@
+#include "wal.h"
+#include "buffer_pool.h"
+#include "value_log.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+// GLOBALS.
+uint32_t log_crc_table[256];
+bool log_crc_table_ready = false;
+
+
+int recover_tree_log(int fd, const char *file_path) {
+	char *log_path = make_log_path(file_path);
+	int log_fd = open(log_path, O_RDWR);
+	if (log_fd == -1) {
+		free(log_path);
+		return 0;
+	}
+
+	void *payload_buffer;
+	if (posix_memalign(&payload_buffer, PAGE_SIZE, PAGE_SIZE) != 0) exit_with_err_msg("Error on allocating recovery buffer.");
+	char *payload = (char *)payload_buffer;
+
+	// Find the end of the last commit. The records after it belong to an unfinished mini-transaction.
+	wal_record_header record;
+	int64_t offset = 0;
+	int64_t committed_end = 0;
+	int num_commits = 0;
+	while (read_log_record(log_fd, offset, &record, payload)) {
+		offset += sizeof(wal_record_header) + record.length;
+		if (record.type == WAL_RECORD_COMMIT) {
+			committed_end = offset;
+			num_commits += 1;
+		}
+	}
+	int64_t log_end = offset;
+
+	// Undo the pages the unfinished one wrote back early. Newest first, so that a page written back
+	// twice ends at its image from before the mini-transaction.
+	int num_undos = 0;
+	int64_t *undo_offsets = NULL;
+	for (offset = committed_end; offset < log_end; offset += sizeof(wal_record_header) + record.length) {
+		read_log_record(log_fd, offset, &record, payload);
+		if (record.type != WAL_RECORD_UNDO) continue;
+		undo_offsets = (int64_t *)realloc(undo_offsets, (num_undos + 1) * sizeof(int64_t));
+		if (undo_offsets == NULL) exit_with_err_msg("Error on allocating recovery buffer.");
+		undo_offsets[num_undos++] = offset;
+	}
+	for (int i = num_undos - 1; i >= 0; i--) {
+		read_log_record(log_fd, undo_offsets[i], &record, payload);
+		apply_log_record(fd, &record, payload);
+	}
+	free(undo_offsets);
+
+	// Then redo the committed ones in log order. An undone page that was committed before gets its committed image back.
+	for (offset = 0; offset < committed_end; offset += sizeof(wal_record_header) + record.length) {
+		read_log_record(log_fd, offset, &record, payload);
+		if (record.type == WAL_RECORD_PAGE || record.type == WAL_RECORD_HEADER) apply_log_record(fd, &record, payload);
+	}
+
+	if (num_commits > 0 || num_undos > 0) {
+		if (fdatasync(fd) == -1) exit_with_err_msg("Error on syncing recovered file.");
+		printf("Recovered %d operations from '%s'.\n", num_commits, log_path);
+	}
+	close(log_fd);
+	unlink(log_path);
+	free(log_path);
+	free(payload);
+	return num_commits;
+}
+
+void open_tree_log(int fd, int group_commit) {
+	tree_handle *handle = get_tree_handle(fd);
+	if (handle == NULL || handle->wal != NULL) return;
+
+	wal_log *log = (wal_log *)calloc(1, sizeof(wal_log));
+	if (log == NULL) exit_with_err_msg("Error on allocating log.");
+	log->path = make_log_path(handle->path);
+	log->fd = open(log->path, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	if (log->fd == -1) exit_with_err_msg("Error on opening log file.");
+	log->buffer = (char *)malloc(WAL_BUFFER_SIZE);
+	if (log->buffer == NULL) exit_with_err_msg("Error on allocating log.");
+	log->group_commit = group_commit < 1 ? 1 : group_commit;
+	encode_header_image(&(handle->header), log->logged_header);
+	handle->wal = log;
+}
+
+void close_tree_log(int fd) {
+	wal_log *log = get_tree_log(fd);
+	if (log == NULL) return;
+
+	close(log->fd);
+	unlink(log->path);
+	free(log->path);
+	free(log->buffer);
+	free(log->transaction_pgns);
+	free(log);
+	get_tree_handle(fd)->wal = NULL;
+}
+
+void abandon_tree_log(int fd, bool torn) {
+	wal_log *log = get_tree_log(fd);
+	if (log == NULL) return;
+
+	if (torn) {
+		log->appended_lsn = log->buffer_lsn + (log->appended_lsn - log->buffer_lsn) / 2;
+		write_log_buffer(log);
+	}
+	close(log->fd);
+	free(log->path);
+	free(log->buffer);
+	free(log->transaction_pgns);
+	free(log);
+	get_tree_handle(fd)->wal = NULL;
+}
+
+void checkpoint_tree(int fd) {
+	wal_log *log = get_tree_log(fd);
+	if (log == NULL) return;
+
+	// Pages may only reach the file after their log records, so the log goes first.
+	force_tree_log(fd, log->appended_lsn);
+	checkpoint_value_log(fd);
+	flush_header_page(fd);
+	flush_buffer_pool(fd);
+	// Pages cut off by a shrink since the last checkpoint are not needed by recovery any more.
+	struct stat file_stat;
+	off_t file_size = (off_t)get_tree_handle(fd)->header.num_pages * PAGE_SIZE;
+	if (fstat(fd, &file_stat) == -1) exit_with_err_msg("Error on reading file size.");
+	if (file_stat.st_size > file_size && ftruncate(fd, file_size) == -1) exit_with_err_msg("Error on truncating file.");
+	if (fdatasync(fd) == -1) exit_with_err_msg("Error on syncing file.");
+
+	if (ftruncate(log->fd, 0) == -1 || fdatasync(log->fd) == -1) exit_with_err_msg("Error on truncating log file.");
+	log->checkpoint_lsn = log->appended_lsn;
+	log->buffer_lsn = log->appended_lsn;
+	log->durable_lsn = log->appended_lsn;
+	log->commits_since_force = 0;
+	encode_header_image(&(get_tree_handle(fd)->header), log->logged_header);
+	log->stats.checkpoints += 1;
+}
+
+void rename_tree_log(int fd, const char *file_path) {
+	wal_log *log = get_tree_log(fd);
+	if (log == NULL) return;
+
+	char *new_path = make_log_path(file_path);
+	if (rename(log->path, new_path) == -1) exit_with_err_msg("Error on renaming log file.");
+	free(log->path);
+	log->path = new_path;
+}
+
+void begin_mini_transaction(int fd) {
+	wal_log *log = get_tree_log(fd);
+	if (log == NULL) return;
+	log->in_transaction = true;
+	log->num_transaction_pgns = 0;
+}
+
+void commit_mini_transaction(int fd) {
+	wal_log *log = get_tree_log(fd);
+	if (log == NULL || !log->in_transaction) return;
+	if (log->fail_commit) {
+		// The pages reach the file the way evictions would take them, and the commit never does.
+		flush_buffer_pool(fd);
+		return;
+	}
+	log->in_transaction = false;
+	tree_handle *handle = get_tree_handle(fd);
+
+	_Alignas(PAGE_SIZE) char image[PAGE_SIZE];
+	for (int i = 0; i < log->num_transaction_pgns; i++) {
+		int64_t pgn = log->transaction_pgns[i];
+		// Pages cut off by a shrink hold nothing worth redoing.
+		if (pgn >= handle->header.num_pages) continue;
+
+		// A page written back early is no longer cached, but the file has its final image.
+		const char *cached = get_cached_page(fd, pgn);
+		if (cached == NULL) read_page_image(fd, pgn, image);
+		int64_t lsn = append_log_record(log, WAL_RECORD_PAGE, pgn, cached != NULL ? cached : image, PAGE_SIZE);
+		set_page_lsn(fd, pgn, lsn);
+		log->stats.logged_pages += 1;
+	}
+
+	char header_image[HEADER_IMAGE_SIZE];
+	encode_header_image(&(handle->header), header_image);
+	bool header_changed = memcmp(header_image, log->logged_header, HEADER_IMAGE_SIZE) != 0;
+	if (header_changed) {
+		append_log_record(log, WAL_RECORD_HEADER, -1, header_image, HEADER_IMAGE_SIZE);
+		memcpy(log->logged_header, header_image, HEADER_IMAGE_SIZE);
+	}
+	if (log->num_transaction_pgns == 0 && !header_changed) return;
+
+	append_log_record(log, WAL_RECORD_COMMIT, -1, NULL, 0);
+	log->stats.commits += 1;
+	log->commits_since_force += 1;
+	if (log->commits_since_force >= log->group_commit) force_tree_log(fd, log->appended_lsn);
+	if (log->appended_lsn - log->checkpoint_lsn >= WAL_CHECKPOINT_BYTES) checkpoint_tree(fd);
+}
+
+void fail_next_commit(int fd) {
+	wal_log *log = get_tree_log(fd);
+	if (log != NULL) log->fail_commit = true;
+}
+
+bool get_wal_stats(int fd, wal_stats *stats) {
+	wal_log *log = get_tree_log(fd);
+	if (log == NULL) return false;
+	*stats = log->stats;
+	return true;
+}
+
+// Helper functions
+wal_log *get_tree_log(int fd) {
+	tree_handle *handle = get_tree_handle(fd);
+	return handle == NULL ? NULL : handle->wal;
+}
+
+bool note_transaction_page(int fd, int64_t pgn) {
+	wal_log *log = get_tree_log(fd);
+	if (log == NULL || !log->in_transaction) return false;
+
+	// A page written back early and dirtied again is already listed.
+	for (int i = 0; i < log->num_transaction_pgns; i++) {
+		if (log->transaction_pgns[i] == pgn) return true;
+	}
+	if (log->num_transaction_pgns == log->transaction_pgns_capacity) {
+		log->transaction_pgns_capacity = log->transaction_pgns_capacity == 0 ? 64 : log->transaction_pgns_capacity * 2;
+		log->transaction_pgns = (int64_t *)realloc(log->transaction_pgns, log->transaction_pgns_capacity * sizeof(int64_t));
+		if (log->transaction_pgns == NULL) exit_with_err_msg("Error on allocating log.");
+	}
+	log->transaction_pgns[log->num_transaction_pgns++] = pgn;
+	return true;
+}
+
+int64_t log_undo_image(int fd, int64_t pgn) {
+	wal_log *log = get_tree_log(fd);
+	if (log == NULL) return 0;
+
+	// The file still has the page as it was before the mini-transaction, unless it was written back
+	// early before. Recovery applies the oldest UNDO record of a page last. The caller forces the log
+	// up to the returned LSN before it overwrites the page.
+	_Alignas(PAGE_SIZE) char image[PAGE_SIZE];
+	read_page_image(fd, pgn, image);
+	log->stats.undo_pages += 1;
+	return append_log_record(log, WAL_RECORD_UNDO, pgn, image, PAGE_SIZE);
+}
+
+void force_tree_log(int fd, int64_t lsn) {
+	wal_log *log = get_tree_log(fd);
+	if (log == NULL || lsn <= log->durable_lsn) return;
+
+	// The leaves in the log may refer to values that have to be durable first.
+	sync_value_log(fd);
+	write_log_buffer(log);
+	if (fdatasync(log->fd) == -1) exit_with_err_msg("Error on syncing log file.");
+	log->durable_lsn = log->appended_lsn;
+	log->commits_since_force = 0;
+	log->stats.forces += 1;
+}
+
+int64_t append_log_record(wal_log *log, uint32_t type, int64_t pgn, const char *payload, uint32_t length) {
+	wal_record_header record;
+	memset(&record, 0, sizeof(wal_record_header));
+	record.type = type;
+	record.length = length;
+	record.pgn = pgn;
+	record.checksum = compute_log_checksum(&record, payload);
+
+	append_log_bytes(log, (const char *)&record, sizeof(wal_record_header));
+	if (length > 0) append_log_bytes(log, payload, length);
+	log->stats.logged_bytes += sizeof(wal_record_header) + length;
+	return log->appended_lsn;
+}
+
+void append_log_bytes(wal_log *log, const char *bytes, size_t length) {
+	while (length > 0) {
+		size_t used = (size_t)(log->appended_lsn - log->buffer_lsn);
+		if (used == WAL_BUFFER_SIZE) {
+			write_log_buffer(log);
+			used = 0;
+		}
+		size_t chunk = WAL_BUFFER_SIZE - used < length ? WAL_BUFFER_SIZE - used : length;
+		memcpy(log->buffer + used, bytes, chunk);
+		log->appended_lsn += chunk;
+		bytes += chunk;
+		length -= chunk;
+	}
+}
+
+void write_log_buffer(wal_log *log) {
+	size_t used = (size_t)(log->appended_lsn - log->buffer_lsn);
+	off_t offset = (off_t)(log->buffer_lsn - log->checkpoint_lsn);
+	size_t written = 0;
+	while (written < used) {
+		ssize_t result = pwrite(log->fd, log->buffer + written, used - written, offset + written);
+		if (result <= 0) exit_with_err_msg("Error on writing log file.");
+		written += result;
+	}
+	log->buffer_lsn = log->appended_lsn;
+}
+
+uint32_t compute_log_checksum(const wal_record_header *record, const char *payload) {
+	wal_record_header copy = *record;
+	copy.checksum = 0;
+	uint32_t crc = update_checksum(0xFFFFFFFFU, &copy, sizeof(wal_record_header));
+	crc = update_checksum(crc, payload, record->length);
+	return crc ^ 0xFFFFFFFFU;
+}
+
+uint32_t update_checksum(uint32_t crc, const void *bytes, size_t length) {
+	if (!log_crc_table_ready) {
+		for (uint32_t i = 0; i < 256; i++) {
+			uint32_t entry = i;
+			for (int bit = 0; bit < 8; bit++) entry = (entry & 1) ? 0xEDB88320U ^ (entry >> 1) : entry >> 1;
+			log_crc_table[i] = entry;
+		}
+		log_crc_table_ready = true;
+	}
+
+	const unsigned char *cur = (const unsigned char *)bytes;
+	for (size_t i = 0; i < length; i++) crc = log_crc_table[(crc ^ cur[i]) & 0xFF] ^ (crc >> 8);
+	return crc;
+}
+
+bool read_log_record(int log_fd, int64_t offset, wal_record_header *record, char *payload) {
+	if (pread(log_fd, record, sizeof(wal_record_header), offset) != (ssize_t)sizeof(wal_record_header)) return false;
+	if (record->type < WAL_RECORD_PAGE || record->type > WAL_RECORD_COMMIT || record->length > PAGE_SIZE) return false;
+	if (record->length > 0 && pread(log_fd, payload, record->length, offset + sizeof(wal_record_header)) != (ssize_t)record->length) return false;
+	return compute_log_checksum(record, payload) == record->checksum;
+}
+
+void apply_log_record(int fd, const wal_record_header *record, const char *payload) {
+	if (record->type == WAL_RECORD_HEADER) {
+		header_page header;
+		decode_header_image(payload, &header);
+		write_header_image(fd, &header);
+		return;
+	}
+	write_page_image(fd, record->pgn, payload);
+}
+
+char *make_log_path(const char *file_path) {
+	char *log_path = (char *)malloc(strlen(file_path) + sizeof(WAL_FILE_SUFFIX));
+	if (log_path == NULL) exit_with_err_msg("Error on allocating log file path.");
+	sprintf(log_path, "%s%s", file_path, WAL_FILE_SUFFIX);
+	return log_path;
+}
@@ -0,0 +1,165 @@
+#ifndef __WAL_H__
+#define __WAL_H__
+
+#include "file_manager.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#ifdef _WIN32
+#define bool char
+#define false 0
+#define true 1
+#endif
+
+
+// Constants
+#define WAL_FILE_SUFFIX ".wal"
+#define WAL_BUFFER_SIZE (256 * 1024) // Log records are gathered here and written out sequentially.
+#define WAL_DEFAULT_GROUP_COMMIT 32 // Commits that share one fdatasync of the log, unless `wal=<n>` says otherwise.
+#define WAL_CHECKPOINT_BYTES (32 * 1024 * 1024) // Log size that triggers a checkpoint after a commit.
+
+// Log record types. A record is a wal_record_header followed by `length` bytes of payload.
+#define WAL_RECORD_PAGE 1 // The image of a page after the mini-transaction, for redo.
+#define WAL_RECORD_HEADER 2 // The HEADER_IMAGE_SIZE encoded bytes of the header page after the mini-transaction.
+#define WAL_RECORD_UNDO 3 // The image of a page before the mini-transaction, logged before the page is written back early.
+#define WAL_RECORD_COMMIT 4 // The end of a mini-transaction. Its records are applied only if this one is in the log.
+
+
+// Structures
+typedef struct wal_record_header {
+	uint32_t type;
+	uint32_t length; // Payload bytes.
+	int64_t pgn; // The page of a PAGE or UNDO record, or -1.
+	uint32_t checksum; // CRC-32 of this header, with the checksum zeroed, and the payload. Detects torn writes at the tail.
+	uint32_t reserved;
+} wal_record_header;
+
+typedef struct wal_stats {
+	int64_t commits;
+	int64_t forces; // fdatasync calls on the log.
+	int64_t logged_pages; // PAGE records.
+	int64_t undo_pages; // UNDO records, i.e. pages of an open mini-transaction evicted from the pool.
+	int64_t logged_bytes;
+	int64_t checkpoints;
+} wal_stats;
+
+// The log of one open tree. LSNs count bytes appended since the tree was opened and never go back;
+// the log file holds the bytes from checkpoint_lsn on.
+typedef struct wal_log {
+	int fd;
+	char *path;
+	char *buffer; // WAL_BUFFER_SIZE bytes, holding the log from buffer_lsn to appended_lsn.
+	int64_t buffer_lsn;
+	int64_t appended_lsn;
+	int64_t durable_lsn; // Everything below it is in the log file and synced.
+	int64_t checkpoint_lsn;
+	int group_commit;
+	int commits_since_force;
+
+	bool in_transaction;
+	bool fail_commit; // The open mini-transaction ends as if the process died just before its COMMIT record. For crash tests.
+	int64_t *transaction_pgns; // Pages dirtied by the open mini-transaction, each once.
+	int num_transaction_pgns;
+	int transaction_pgns_capacity;
+	char logged_header[HEADER_IMAGE_SIZE]; // The header as of the last HEADER record or checkpoint.
+	wal_stats stats;
+} wal_log;
+
+
+// APIs
+/**
+ * @brief Replay the log of a tree file left behind by a crash, before the file is opened.
+ * @param fd[in] The file descriptor of the database file.
+ * @param file_path[in] The path of the database file. The log is `file_path` + WAL_FILE_SUFFIX.
+ * @return The number of committed mini-transactions replayed. 0 if there is no log.
+ *
+ * The pages of committed mini-transactions are written to the file in log order. Pages that an
+ * unfinished mini-transaction had written back early are restored from its UNDO records first.
+ * A record with a bad checksum ends the log. The file is synced and the log emptied afterwards.
+ */
+int recover_tree_log(int fd, const char *file_path);
+
+/**
+ * @brief Start logging the changes of an open tree.
+ * @param fd[in] The file descriptor of the database file.
+ * @param group_commit[in] The number of commits that share one fdatasync. 1 makes every commit durable on return.
+ */
+void open_tree_log(int fd, int group_commit);
+
+/**
+ * @brief Stop logging the changes of a tree after its last checkpoint, and remove its log file.
+ * @param fd[in] The file descriptor of the database file.
+ */
+void close_tree_log(int fd);
+
+/**
+ * @brief Drop the log of a tree the way a crash would, and keep its log file for recovery.
+ * @param fd[in] The file descriptor of the database file. Nothing happens if the tree is not logged.
+ * @param torn[in] Write the first half of the records not yet written, as a write cut short by the crash would.
+ *
+ * Records still in the log buffer are lost, so are the commits since the last sync of the log.
+ */
+void abandon_tree_log(int fd, bool torn);
+
+/**
+ * @brief Write every change of a logged tree to its file, sync it, and empty the log.
+ * @param fd[in] The file descriptor of the database file.
+ */
+void checkpoint_tree(int fd);
+
+/**
+ * @brief Rename the log file along with a tree file that was renamed.
+ * @param fd[in] The file descriptor of the database file.
+ * @param file_path[in] The new path of the database file.
+ */
+void rename_tree_log(int fd, const char *file_path);
+
+/**
+ * @brief Start a mini-transaction: the changes up to `commit_mini_transaction()` are logged and recovered as a unit.
+ * @param fd[in] The file descriptor of the database file. Nothing happens if the tree is not logged.
+ */
+void begin_mini_transaction(int fd);
+
+/**
+ * @brief End a mini-transaction.
+ * @param fd[in] The file descriptor of the database file. Nothing happens if the tree is not logged.
+ *
+ * The final image of every page the mini-transaction dirtied, and the header if it changed, are appended
+ * to the log followed by a COMMIT record. The log is synced once per `group_commit` commits, and a
+ * checkpoint follows once the log outgrows WAL_CHECKPOINT_BYTES.
+ */
+void commit_mini_transaction(int fd);
+
+/**
+ * @brief Make the next mini-transaction of a logged tree stop just before its commit, for crash tests.
+ * @param fd[in] The file descriptor of the database file. Nothing happens if the tree is not logged.
+ *
+ * Its pages are written back early, after their UNDO records, and its COMMIT record is never appended.
+ * The tree must be dropped with `crash_tree()` afterwards.
+ */
+void fail_next_commit(int fd);
+
+/**
+ * @brief Get the log counters of a tree.
+ * @param fd[in] The file descriptor of the database file.
+ * @param stats[out] The destination to store the counters.
+ * @return false if the tree is not logged.
+ */
+bool get_wal_stats(int fd, wal_stats *stats);
+
+
+// Helper functions
+wal_log *get_tree_log(int fd);
+bool note_transaction_page(int fd, int64_t pgn);
+int64_t log_undo_image(int fd, int64_t pgn);
+void force_tree_log(int fd, int64_t lsn);
+int64_t append_log_record(wal_log *log, uint32_t type, int64_t pgn, const char *payload, uint32_t length);
+void append_log_bytes(wal_log *log, const char *bytes, size_t length);
+void write_log_buffer(wal_log *log);
+uint32_t compute_log_checksum(const wal_record_header *record, const char *payload);
+uint32_t update_checksum(uint32_t crc, const void *bytes, size_t length);
+bool read_log_record(int log_fd, int64_t offset, wal_record_header *record, char *payload);
+void apply_log_record(int fd, const wal_record_header *record, const char *payload);
+char *make_log_path(const char *file_path);
+
+#endif /* __WAL_H__ */